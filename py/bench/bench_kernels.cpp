@@ -0,0 +1,508 @@
+//
+// Microbenchmark of the C++ kernels on synthetic images
+//
+// $ make bench
+// $ bench/bench_kernels --sizes 256,1024,4096 -o bench.json
+// $ bench/bench_kernels --sizes 256,1024,4096 --baseline bench.json
+//
+// Each (kernel, image size) runs in a forked process, so that the peak
+// memory is that of one kernel. Results are written as JSON, one result
+// per line; with --baseline, the speedup relative to a previous output is
+// added and a table is printed to stderr.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../buffer.h"
+#include "../py_clusters.h"
+#include "../py_watershed.h"
+#include "../max_tree.h"
+#include "../watershed_ncluster.h"
+#include "../watershed_nuclei.h"
+#include "../ellipses.h"
+#include "../regionprops.h"
+#include "synthetic.h"
+
+using std::vector;
+using std::string;
+
+// No persistence criterion in construct_graph
+static const double inf = std::numeric_limits<double>::infinity();
+
+namespace {
+
+struct Options {
+  vector<string> kernels;
+  vector<int> sizes;
+  SyntheticParam param;
+  double min_time = 0.5;    // minimum total time per kernel in seconds
+  int min_repeat = 3;
+  string baseline;
+  string output;
+};
+
+struct Result {
+  double seconds;           // best time of one call
+  int repeat;
+  long peak_rss;            // peak resident memory of the process [bytes]
+  long kernel_rss;          // peak memory increase by the kernel [bytes]
+};
+
+// Default thresholds of compute_nclusters; decreasing
+Buffer<double>* default_thresholds(vector<double>& v)
+{
+  v.resize(255);
+  for(int i=0; i<255; ++i)
+    v[i] = (0.5 + (254 - i))/256.0;
+
+  return new Buffer<double>(v.data(), {v.size()});
+}
+
+//
+// Kernels
+//   Prepare untimed inputs for buf_img and return the timed call
+//
+typedef std::function<std::function<void()>(Buffer<double>&)> Kernel;
+
+std::map<string, Kernel> kernels()
+{
+  std::map<string, Kernel> m;
+
+  m["construct_graph"] = [](Buffer<double>& buf_img) {
+    auto w = std::make_shared<Watershed>();
+    const int merge_threshold = buf_img.shape[0]*buf_img.shape[1] + 1;
+    return [w, &buf_img, merge_threshold]() {
+      NoStats stats;
+      w->construct_graph<double, true>(buf_img, 0.1, merge_threshold, inf,
+                                       0, stats);
+    };
+  };
+
+  m["construct_graph_sizes"] = [](Buffer<double>& buf_img) {
+    auto w = std::make_shared<Watershed>();
+    const int merge_threshold = buf_img.shape[0]*buf_img.shape[1] + 1;
+    return [w, &buf_img, merge_threshold]() {
+      NoStats stats;
+      w->construct_graph<double, false>(buf_img, 0.1, merge_threshold, inf,
+                                        0, stats);
+    };
+  };
+
+  m["obtain_clusters"] = [](Buffer<double>& buf_img) {
+    auto w = std::make_shared<Watershed>();
+    const int merge_threshold = buf_img.shape[0]*buf_img.shape[1] + 1;
+    NoStats stats;
+    w->construct_graph<double, true>(buf_img, 0.1, merge_threshold, inf, 0,
+                                     stats);
+    return [w, &buf_img]() {
+      Clusters clusters;
+      NoStats stats;
+      w->obtain_clusters(buf_img, 0.2, 0.2, 2, clusters, stats);
+    };
+  };
+
+  m["compute_nclusters"] = [](Buffer<double>& buf_img) {
+    auto v = std::make_shared<vector<double>>();
+    std::shared_ptr<Buffer<double>> thresholds(default_thresholds(*v));
+    auto nclusters = std::make_shared<vector<long>>(v->size());
+    return [v, thresholds, nclusters, &buf_img]() {
+      Buffer<long> buf_nclusters(nclusters->data(), {nclusters->size()});
+      NoStats stats;
+      watershed_ncluster::compute_nclusters(buf_img, *thresholds,
+                                            buf_nclusters, 5, 0, stats);
+    };
+  };
+
+  m["mark_nuclei"] = [](Buffer<double>& buf_img) {
+    auto v = std::make_shared<vector<double>>();
+    std::shared_ptr<Buffer<double>> thresholds(default_thresholds(*v));
+    const size_t n = buf_img.shape[0]*buf_img.shape[1];
+    std::shared_ptr<bool> nuclei(new bool[n], std::default_delete<bool[]>());
+    return [v, thresholds, nuclei, n, &buf_img]() {
+      std::fill(nuclei.get(), nuclei.get() + n, false);
+      Buffer<bool> buf_nuclei(nuclei.get(), {n});
+      NoStats stats;
+      watershed_nuclei::mark_nuclei(buf_img, *thresholds, 10, 200,
+                                    buf_nuclei, stats);
+    };
+  };
+
+  m["max_tree"] = [](Buffer<double>& buf_img) {
+    auto t = std::make_shared<MaxTree>();
+    return [t, &buf_img]() {
+      NoStats stats;
+      t->construct(buf_img, stats);
+    };
+  };
+
+  m["clusters"] = [](Buffer<double>& buf_img) {
+    return [&buf_img]() {
+      Clusters clusters;
+      NoStats stats;
+      clusters.construct(buf_img, 0.3, 0, stats);
+    };
+  };
+
+  m["clusters_labels"] = [](Buffer<double>& buf_img) {
+    const size_t nx = buf_img.shape[0], ny = buf_img.shape[1];
+    auto labels = std::make_shared<vector<int>>(nx*ny);
+    return [labels, nx, ny, &buf_img]() {
+      Buffer<int> buf_labels(labels->data(), {nx, ny});
+      Clusters clusters;
+      NoStats stats;
+      clusters.construct(buf_img, 0.3, 0, stats, &buf_labels);
+    };
+  };
+
+  m["clusters_parallel"] = [](Buffer<double>& buf_img) {
+    return [&buf_img]() {
+      Clusters clusters;
+      NoStats stats;
+      clusters.construct_parallel(buf_img, 0.3, 0, stats);
+    };
+  };
+
+  m["clusters_runs"] = [](Buffer<double>& buf_img) {
+    return [&buf_img]() {
+      Clusters clusters;
+      NoStats stats;
+      clusters.construct_runs(buf_img, 0.3, 0, stats);
+    };
+  };
+
+  m["ellipses"] = [](Buffer<double>& buf_img) {
+    return [&buf_img]() {
+      vector<double> v;
+      ellipses::obtain_ellipses(buf_img, 0.3, 0, false, v);
+    };
+  };
+
+  m["ellipses_weighted"] = [](Buffer<double>& buf_img) {
+    return [&buf_img]() {
+      vector<double> v;
+      ellipses::obtain_ellipses(buf_img, 0.3, 0, true, v);
+    };
+  };
+
+  m["regionprops"] = [](Buffer<double>& buf_img) {
+    // Clusters of the image and a stack of 6 copies of the image
+    auto clusters = std::make_shared<Clusters>();
+    NoStats stats;
+    clusters->construct_runs(buf_img, 0.3, 0, stats);
+
+    const size_t nx = buf_img.shape[0], ny = buf_img.shape[1];
+    auto stack = std::make_shared<vector<double>>(6*nx*ny);
+    for(size_t c=0; c<6; ++c)
+      for(size_t ix=0; ix<nx; ++ix)
+        for(size_t iy=0; iy<ny; ++iy)
+          (*stack)[(c*nx + ix)*ny + iy] = buf_img(ix, iy);
+
+    const size_t ncol = regionprops::n_columns(6);
+    auto table = std::make_shared<vector<double>>(ncol*clusters->size());
+    return [clusters, stack, table, nx, ny, ncol]() {
+      Buffer<double> buf_stack(stack->data(), {6, nx, ny});
+      Buffer<double> buf_table(table->data(), {ncol, clusters->size()});
+      regionprops::compute(*clusters, buf_stack, buf_table);
+    };
+  };
+
+  return m;
+}
+
+long maxrss_bytes()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return 1024L*usage.ru_maxrss; // kilobytes on Linux
+}
+
+//
+// Run one kernel in this process
+//
+Result run(const Kernel& kernel, const Options& opt, const int size)
+{
+  SyntheticParam param = opt.param;
+  param.nx = param.ny = size;
+
+  vector<double> img = synthetic_image(param);
+  Buffer<double> buf_img(img.data(), {static_cast<size_t>(param.nx),
+                                      static_cast<size_t>(param.ny)});
+
+  std::function<void()> f = kernel(buf_img);
+  const long rss_before = maxrss_bytes();
+
+  Result r;
+  r.seconds = 1.0e30;
+  r.repeat = 0;
+  double total = 0.0;
+
+  while(r.repeat < opt.min_repeat || total < opt.min_time) {
+    auto ts = std::chrono::high_resolution_clock::now();
+    f();
+    auto te = std::chrono::high_resolution_clock::now();
+
+    const double t = std::chrono::duration<double>(te - ts).count();
+    r.seconds = std::min(r.seconds, t);
+    total += t;
+    r.repeat++;
+  }
+
+  r.peak_rss = maxrss_bytes();
+  r.kernel_rss = r.peak_rss - rss_before;
+
+  return r;
+}
+
+//
+// Run one kernel in a child process
+//
+bool run_forked(const Kernel& kernel, const Options& opt, const int size,
+                Result& r)
+{
+  int fd[2];
+  if(pipe(fd) != 0) {
+    perror("pipe");
+    return false;
+  }
+
+  const pid_t pid = fork();
+  if(pid < 0) {
+    perror("fork");
+    return false;
+  }
+
+  if(pid == 0) {
+    close(fd[0]);
+    Result child = run(kernel, opt, size);
+    ssize_t ret = write(fd[1], &child, sizeof(Result));
+    close(fd[1]);
+    _exit(ret == sizeof(Result) ? 0 : 1);
+  }
+
+  close(fd[1]);
+  ssize_t nread = read(fd[0], &r, sizeof(Result));
+  close(fd[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  return nread == sizeof(Result) && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+//
+// Baseline
+//   ns_per_pixel for "kernel nx" in a previous output
+//
+bool json_value(const string& line, const string& key, string& value)
+{
+  const string pattern = "\"" + key + "\": ";
+  size_t i = line.find(pattern);
+  if(i == string::npos)
+    return false;
+
+  i += pattern.size();
+  if(line[i] == '"') {
+    size_t j = line.find('"', i + 1);
+    value = line.substr(i + 1, j - i - 1);
+  }
+  else {
+    size_t j = line.find_first_of(",}", i);
+    value = line.substr(i, j - i);
+  }
+  return true;
+}
+
+std::map<string, double> read_baseline(const string& filename)
+{
+  std::map<string, double> m;
+  std::ifstream fin(filename);
+  if(!fin) {
+    fprintf(stderr, "Error: unable to open baseline %s\n", filename.c_str());
+    exit(1);
+  }
+
+  string line;
+  while(std::getline(fin, line)) {
+    string kernel, nx, ns;
+    if(json_value(line, "kernel", kernel) && json_value(line, "nx", nx) &&
+       json_value(line, "ns_per_pixel", ns))
+      m[kernel + " " + nx] = atof(ns.c_str());
+  }
+
+  return m;
+}
+
+//
+// Command-line options
+//
+vector<string> split(const string& s)
+{
+  vector<string> v;
+  std::stringstream ss(s);
+  string item;
+  while(std::getline(ss, item, ','))
+    if(!item.empty())
+      v.push_back(item);
+  return v;
+}
+
+void usage()
+{
+  fprintf(stderr,
+    "bench_kernels [options]\n"
+    "  --kernels a,b,...   kernels (default: all)\n"
+    "  --sizes n1,n2,...   image sizes nxn (default: 256,1024,4096)\n"
+    "  --density d         blobs per 100x100 pixels (default: 4)\n"
+    "  --sigma s           mean blob radius in pixels (default: 4)\n"
+    "  --noise s           rms background noise (default: 0.02)\n"
+    "  --seed n            random seed (default: 1)\n"
+    "  --min-time t        minimum time per kernel in sec (default: 0.5)\n"
+    "  --baseline file     compare with a previous output\n"
+    "  -o file             output JSON (default: stdout)\n");
+}
+
+Options parse_options(int argc, char* argv[],
+                      const std::map<string, Kernel>& all)
+{
+  Options opt;
+  opt.sizes = {256, 1024, 4096};
+
+  for(int i=1; i<argc; ++i) {
+    const string arg = argv[i];
+    if(arg == "-h" || arg == "--help") {
+      usage();
+      exit(0);
+    }
+    if(i + 1 >= argc) {
+      usage();
+      exit(1);
+    }
+
+    const string val = argv[++i];
+    if(arg == "--kernels")
+      opt.kernels = split(val);
+    else if(arg == "--sizes") {
+      opt.sizes.clear();
+      for(const string& s : split(val))
+        opt.sizes.push_back(atoi(s.c_str()));
+    }
+    else if(arg == "--density")
+      opt.param.density = atof(val.c_str());
+    else if(arg == "--sigma")
+      opt.param.sigma = atof(val.c_str());
+    else if(arg == "--noise")
+      opt.param.noise = atof(val.c_str());
+    else if(arg == "--seed")
+      opt.param.seed = atoi(val.c_str());
+    else if(arg == "--min-time")
+      opt.min_time = atof(val.c_str());
+    else if(arg == "--baseline")
+      opt.baseline = val;
+    else if(arg == "-o")
+      opt.output = val;
+    else {
+      usage();
+      exit(1);
+    }
+  }
+
+  if(opt.kernels.empty()) {
+    for(const auto& k : all)
+      opt.kernels.push_back(k.first);
+  }
+
+  for(const string& k : opt.kernels) {
+    if(all.find(k) == all.end()) {
+      fprintf(stderr, "Error: unknown kernel %s\n", k.c_str());
+      exit(1);
+    }
+  }
+
+  return opt;
+}
+
+} // unnamed namespace
+
+
+int main(int argc, char* argv[])
+{
+  const std::map<string, Kernel> all = kernels();
+  const Options opt = parse_options(argc, argv, all);
+
+  std::map<string, double> baseline;
+  if(!opt.baseline.empty())
+    baseline = read_baseline(opt.baseline);
+
+  FILE* fp = stdout;
+  if(!opt.output.empty()) {
+    fp = fopen(opt.output.c_str(), "w");
+    if(fp == nullptr) {
+      fprintf(stderr, "Error: unable to write %s\n", opt.output.c_str());
+      return 1;
+    }
+  }
+
+  fprintf(fp, "{\"density\": %g, \"sigma\": %g, \"noise\": %g, "
+          "\"seed\": %u,\n \"results\": [\n",
+          opt.param.density, opt.param.sigma, opt.param.noise,
+          opt.param.seed);
+
+  if(!baseline.empty())
+    fprintf(stderr, "%-24s %6s %12s %12s %8s\n", "kernel", "n",
+            "base ns/px", "ns/px", "speedup");
+
+  bool first = true;
+  for(const string& name : opt.kernels) {
+    for(const int size : opt.sizes) {
+      Result r;
+      if(!run_forked(all.at(name), opt, size, r)) {
+        fprintf(stderr, "Error: %s %d failed\n", name.c_str(), size);
+        continue;
+      }
+
+      const double npix = static_cast<double>(size)*size;
+      const double ns_per_pixel = 1.0e9*r.seconds/npix;
+
+      fprintf(fp, "%s  {\"kernel\": \"%s\", \"nx\": %d, \"ny\": %d, "
+              "\"repeat\": %d, \"seconds\": %.6e, \"pixels_per_sec\": %.6e, "
+              "\"ns_per_pixel\": %.4f, \"peak_rss_bytes\": %ld, "
+              "\"kernel_rss_bytes\": %ld",
+              first ? "" : ",\n", name.c_str(), size, size, r.repeat,
+              r.seconds, npix/r.seconds, ns_per_pixel,
+              r.peak_rss, r.kernel_rss);
+      first = false;
+
+      auto p = baseline.find(name + " " + std::to_string(size));
+      if(p != baseline.end()) {
+        const double speedup = p->second/ns_per_pixel;
+        fprintf(fp, ", \"baseline_ns_per_pixel\": %.4f, \"speedup\": %.4f",
+                p->second, speedup);
+        fprintf(stderr, "%-24s %6d %12.3f %12.3f %8.3f\n", name.c_str(),
+                size, p->second, ns_per_pixel, speedup);
+      }
+      fprintf(fp, "}");
+      fflush(fp);
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+
+  if(fp != stdout)
+    fclose(fp);
+
+  return 0;
+}
@@ -0,0 +1,323 @@
+"""
+End-to-end benchmark of the plate pipeline
+
+  data.load -> nucleus.median_quarter_maximum_threshold
+            -> ellipses.obtain -> nucleus.obtain_clips
+
+for all wells in data.load_header on a generated fake input tree.
+
+$ python3 bench/bench_pipeline.py generate /tmp/fake
+$ python3 bench/bench_pipeline.py run /tmp/fake --mode single
+$ python3 bench/bench_pipeline.py run /tmp/fake --mode batched --nthreads 8
+$ python3 bench/bench_pipeline.py run /tmp/fake --trace trace.json
+
+Stages
+  decode:      PNG decoding in data.load
+  sort:        pixel sort in compute_nclusters
+  flood:       flooding in compute_nclusters
+  ccl_moments: connected components and moments in ellipses.obtain
+  clips:       rotation and crop in nucleus.obtain_clips
+
+The time of median_quarter_maximum_threshold is split into sort and flood
+in proportion to the phase seconds of its stats; in batched mode these are
+summed over the threads. Components and moments are one raster scan in
+ellipses.obtain, so they are one stage.
+"""
+
+import os
+import sys
+import json
+import time
+import argparse
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+
+path = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(path, '..'))
+
+from junkoda_cellularlib import (data, ellipses, nucleus,  # noqa
+                                 parallel, trace)
+
+
+stages = ['decode', 'sort', 'flood', 'ccl_moments', 'clips']
+
+
+#
+# Fake input tree
+#
+def synthetic_image(rng, nc, *, density=4.0, sigma=6.0, noise=0.02):
+    """
+    Gaussian blobs on a noisy background in [0, 1]
+
+    Args:
+      density (float): number of blobs per 100x100 pixels
+      sigma (float): mean blob radius in pixels
+      noise (float): rms of the background noise
+    """
+    img = np.zeros((nc, nc))
+    n_blobs = int(density * nc * nc / 1.0e4 + 0.5)
+
+    for x0, y0, s, amp in zip(nc * rng.random(n_blobs),
+                              nc * rng.random(n_blobs),
+                              sigma * (0.5 + rng.random(n_blobs)),
+                              0.3 + 0.7 * rng.random(n_blobs)):
+        r = 4.0 * s
+        ix = np.arange(max(int(x0 - r), 0), min(int(x0 + r) + 1, nc))
+        iy = np.arange(max(int(y0 - r), 0), min(int(y0 + r) + 1, nc))
+        dx = ix + 0.5 - x0
+        dy = iy + 0.5 - y0
+        img[ix[0]:(ix[-1] + 1), iy[0]:(iy[-1] + 1)] += \
+            amp * np.exp(-(dx[:, None]**2 + dy[None, :]**2) / (2.0 * s * s))
+
+    img += noise * rng.standard_normal(img.shape)
+
+    return np.clip(img, 0.0, 1.0)
+
+
+def generate(root, *, n_experiments=1, n_plates=2, n_wells=8, nc=512,
+             seed=1):
+    """
+    Write <root>/input/train.csv, train_controls.csv, and
+    <root>/input/train/<experiment>/Plate<n>/<well>_s<site>_w<ch>.png
+    """
+    from PIL import Image
+
+    rng = np.random.default_rng(seed)
+    wells = ['%s%02d' % (chr(ord('B') + row), col)
+             for row in range(14) for col in range(2, 24)][:(n_wells + 1)]
+
+    rows = []
+    rows_controls = []
+    for iex in range(n_experiments):
+        experiment = '%s-%02d' % (data.cell_types[iex % 4], iex // 4 + 1)
+        for plate in range(1, n_plates + 1):
+            d = '%s/input/train/%s/Plate%d' % (root, experiment, plate)
+            os.makedirs(d, exist_ok=True)
+
+            for i, well in enumerate(wells):
+                id_code = '%s_%d_%s' % (experiment, plate, well)
+                if i == n_wells:
+                    rows_controls.append((id_code, experiment, plate, well,
+                                          data.negative_control,
+                                          'negative_control'))
+                else:
+                    rows.append((id_code, experiment, plate, well,
+                                 int(rng.integers(data.nsirna))))
+
+                for site in (1, 2):
+                    for ch in range(1, 7):
+                        img = synthetic_image(rng, nc)
+                        Image.fromarray((255 * img).astype(np.uint8)).save(
+                            '%s/%s_s%d_w%d.png' % (d, well, site, ch))
+
+    with open('%s/input/train.csv' % root, 'w') as f:
+        f.write('id_code,experiment,plate,well,sirna\n')
+        for r in rows:
+            f.write('%s,%s,%d,%s,%d\n' % r)
+
+    with open('%s/input/train_controls.csv' % root, 'w') as f:
+        f.write('id_code,experiment,plate,well,sirna,well_type\n')
+        for r in rows_controls:
+            f.write('%s,%s,%d,%s,%d,%s\n' % r)
+
+
+#
+# Pipeline
+#
+class Timer:
+    def __init__(self):
+        self.seconds = dict((s, 0.0) for s in stages)
+
+    def add(self, stage, ts):
+        self.seconds[stage] += time.perf_counter() - ts
+
+    def split(self, stats, ts):
+        # Split the time since ts into sort and flood by the phase seconds
+        # of the kernel stats
+        t = time.perf_counter() - ts
+        sort = stats['seconds'].get('sort', 0.0)
+        flood = stats['seconds'].get('flood', 0.0)
+        f = sort / (sort + flood) if sort + flood > 0.0 else 0.0
+        self.seconds['sort'] += f * t
+        self.seconds['flood'] += (1.0 - f) * t
+
+
+def run_single(items, timer, n_clips):
+    # One image after another in this thread
+    n_failed = 0
+    for id_code, site in items:
+        ts = time.perf_counter()
+        X = data.load('train', id_code, site)
+        timer.add('decode', ts)
+
+        stats = {}
+        ts = time.perf_counter()
+        try:
+            threshold = nucleus.median_quarter_maximum_threshold(
+                X[0], stats=stats)
+        except RuntimeError:
+            threshold = None  # no cluster
+        timer.split(stats, ts)
+
+        if threshold is None:
+            n_failed += 1
+            continue
+
+        ts = time.perf_counter()
+        es = ellipses.obtain(X[0], threshold, size_threshold=5)
+        timer.add('ccl_moments', ts)
+
+        ts = time.perf_counter()
+        try:
+            nucleus.obtain_clips(X.transpose(1, 2, 0), n_clips,
+                                 threshold=threshold, ellipses=es)
+        except RuntimeError:
+            n_failed += 1
+        timer.add('clips', ts)
+
+    return n_failed
+
+
+def run_batched(items, timer, n_clips, nthreads, batch_size):
+    # Batched kernels on the C++ thread pool; decode and clips on
+    # Python threads
+    n_failed = 0
+    executor = ThreadPoolExecutor(nthreads)
+
+    for ibegin in range(0, len(items), batch_size):
+        batch = items[ibegin:(ibegin + batch_size)]
+
+        ts = time.perf_counter()
+        Xs = list(executor.map(lambda x: data.load('train', *x), batch))
+        imgs = np.stack([X[0] for X in Xs])
+        timer.add('decode', ts)
+
+        stats = {}
+        ts = time.perf_counter()
+        thresholds = nucleus.median_quarter_maximum_threshold_batch(
+            imgs, stats=stats)
+        timer.split(stats, ts)
+
+        ok = np.isfinite(thresholds)
+        n_failed += np.sum(~ok)
+        thresholds[~ok] = np.inf  # no cluster
+
+        ts = time.perf_counter()
+        es = ellipses.obtain_batch(imgs, thresholds, size_threshold=5)
+        i_img = es[:, 6].astype(int)
+        es_list = [es[i_img == i, :6] for i in range(len(batch))]
+        timer.add('ccl_moments', ts)
+
+        def clips(i):
+            try:
+                nucleus.obtain_clips(Xs[i].transpose(1, 2, 0), n_clips,
+                                     threshold=thresholds[i],
+                                     ellipses=es_list[i])
+            except RuntimeError:
+                return 1
+            return 0
+
+        ts = time.perf_counter()
+        n_failed += sum(executor.map(clips, np.flatnonzero(ok)))
+        timer.add('clips', ts)
+
+    executor.shutdown()
+
+    return int(n_failed)
+
+
+def run(root, *, mode='single', nthreads=0, batch_size=16, n_clips=8,
+        max_images=None, seed=1):
+    data.set_data_dir('%s/input' % root)
+    df = data.load_header('train')
+
+    items = [(id_code, site) for id_code in df['id_code']
+             for site in (1, 2)]
+    if max_images is not None:
+        items = items[:max_images]
+
+    parallel.set_nthreads(nthreads)
+    nthreads = parallel.get_nthreads()
+    np.random.seed(seed)
+
+    timer = Timer()
+    ts = time.perf_counter()
+    if mode == 'single':
+        n_failed = run_single(items, timer, n_clips)
+    elif mode == 'batched':
+        n_failed = run_batched(items, timer, n_clips, nthreads, batch_size)
+    else:
+        raise ValueError('Unknown mode: %s' % mode)
+    seconds = time.perf_counter() - ts
+
+    total = sum(timer.seconds.values())
+    return {'mode': mode,
+            'nthreads': nthreads if mode == 'batched' else 1,
+            'n_images': len(items),
+            'n_failed': n_failed,
+            'seconds': seconds,
+            'images_per_sec': len(items) / seconds,
+            'stages': dict((s, {'seconds': t, 'share': t / total})
+                           for s, t in timer.seconds.items())}
+
+
+def print_result(r):
+    print('%s, %d threads: %d images in %.3f sec, %.2f images/sec'
+          % (r['mode'], r['nthreads'], r['n_images'], r['seconds'],
+             r['images_per_sec']))
+    for s, d in r['stages'].items():
+        print('  %-12s %8.3f sec %6.1f%%' % (s, d['seconds'],
+                                             100 * d['share']))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('generate', help='write a fake input tree')
+    p.add_argument('root')
+    p.add_argument('--experiments', type=int, default=1)
+    p.add_argument('--plates', type=int, default=2)
+    p.add_argument('--wells', type=int, default=8,
+                   help='number of wells per plate')
+    p.add_argument('--seed', type=int, default=1)
+
+    p = sub.add_parser('run', help='run the pipeline')
+    p.add_argument('root')
+    p.add_argument('--mode', choices=['single', 'batched'],
+                   default='single')
+    p.add_argument('--nthreads', type=int, default=0,
+                   help='0 for the number of cores')
+    p.add_argument('--batch-size', type=int, default=16)
+    p.add_argument('--n-clips', type=int, default=8)
+    p.add_argument('--max-images', type=int, default=None)
+    p.add_argument('--json', help='write the result to this file')
+    p.add_argument('--trace',
+                   help='write a Chrome trace of the kernels to this file')
+
+    args = parser.parse_args()
+
+    if args.command == 'generate':
+        generate(args.root, n_experiments=args.experiments,
+                 n_plates=args.plates, n_wells=args.wells, seed=args.seed)
+        return
+
+    if args.trace:
+        trace.start(args.trace)
+
+    r = run(args.root, mode=args.mode, nthreads=args.nthreads,
+            batch_size=args.batch_size, n_clips=args.n_clips,
+            max_images=args.max_images)
+
+    if args.trace:
+        trace.stop()
+    print_result(r)
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(r, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,69 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H 1
+
+//
+// Reproducible synthetic cell images for benchmarks
+//
+// Gaussian blobs on a noisy background; pixel values are roughly in [0, 1]
+// like the float images loaded by junkoda_cellularlib.data.
+//
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+struct SyntheticParam {
+  int nx = 1024, ny = 1024;
+  double density = 4.0;    // number of blobs per 100x100 pixels
+  double sigma = 4.0;      // mean blob radius in pixels
+  double noise = 0.02;     // rms of the Gaussian background noise
+  unsigned int seed = 1;
+};
+
+// Returns nx*ny pixels in C order, index = ix*ny + iy
+inline std::vector<double> synthetic_image(const SyntheticParam& p)
+{
+  const int nx = p.nx;
+  const int ny = p.ny;
+  std::vector<double> img(static_cast<size_t>(nx)*ny, 0.0);
+
+  std::mt19937 mt(p.seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::normal_distribution<double> gaussian(0.0, 1.0);
+
+  const int n_blobs =
+    static_cast<int>(p.density*static_cast<double>(nx)*ny/1.0e4 + 0.5);
+
+  for(int b=0; b<n_blobs; ++b) {
+    const double x0 = nx*uniform(mt);
+    const double y0 = ny*uniform(mt);
+    const double sigma = p.sigma*(0.5 + uniform(mt));  // 0.5 - 1.5 sigma
+    const double amp = 0.5 + 0.5*uniform(mt);
+    const double r = 4.0*sigma;
+    const double fac = 1.0/(2.0*sigma*sigma);
+
+    const int ix_begin = std::max(static_cast<int>(x0 - r), 0);
+    const int ix_end = std::min(static_cast<int>(x0 + r) + 1, nx);
+    const int iy_begin = std::max(static_cast<int>(y0 - r), 0);
+    const int iy_end = std::min(static_cast<int>(y0 + r) + 1, ny);
+
+    for(int ix=ix_begin; ix<ix_end; ++ix) {
+      const double dx = ix + 0.5 - x0;
+      for(int iy=iy_begin; iy<iy_end; ++iy) {
+        const double dy = iy + 0.5 - y0;
+        img[static_cast<size_t>(ix)*ny + iy] +=
+          amp*std::exp(-(dx*dx + dy*dy)*fac);
+      }
+    }
+  }
+
+  if(p.noise > 0.0) {
+    for(double& x : img)
+      x += p.noise*gaussian(mt);
+  }
+
+  return img;
+}
+
+#endif
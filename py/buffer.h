@@ -14,6 +14,7 @@
 
 #include "error.h"
 #include "py_util.h"
+#include "trace.h"
 
 template <typename T>
 class Buffer {
@@ -23,6 +24,14 @@ class Buffer {
   //   py_array: Buffer object, e.g., numpy array
   Buffer();
   Buffer(PyObject* const py_array, char const * const name_=nullptr);
+
+  // View of parent[i] sliced along the first axis
+  //   does not own the Python buffer; must not outlive parent
+  Buffer(const Buffer<T>& parent, const size_t i);
+
+  // View of C-contiguous C++ memory, e.g., for benchmarks without numpy
+  //   does not own data; must not outlive data
+  Buffer(T* const data, const std::vector<size_t>& shape_);
   ~Buffer();
 
   // delete assignment and copy
@@ -69,6 +78,7 @@ class Buffer {
  private:
   Py_buffer pybuf;
   char const * const name;
+  bool view;
   void type_error(const char error_msg[]) const;
 };
 
@@ -76,7 +86,7 @@ class Buffer {
 // Default constructre
 //
 template<typename T>
-Buffer<T>::Buffer() : ndim(0), buf(nullptr)
+Buffer<T>::Buffer() : ndim(0), buf(nullptr), name(nullptr), view(false)
 {
 }
 
@@ -85,12 +95,41 @@ Buffer<T>::Buffer() : ndim(0), buf(nullptr)
 //
 template<typename T>
 Buffer<T>::Buffer(PyObject* const py_array, char const * const name_) :
-ndim(0), buf(nullptr), name(name_)
+ndim(0), buf(nullptr), name(name_), view(false)
 {
   // May throw TypeError
   assign(py_array);
 }
 
+//
+// Slice of a buffer
+//
+template<typename T>
+Buffer<T>::Buffer(const Buffer<T>& parent, const size_t i) :
+ndim(parent.ndim - 1), str_format(parent.str_format),
+buf(parent.buf + parent.stride[0]*i), name(parent.name), view(true)
+{
+  assert(parent.ndim >= 1 && i < parent.shape[0]);
+  shape.assign(parent.shape.begin() + 1, parent.shape.end());
+  stride.assign(parent.stride.begin() + 1, parent.stride.end());
+}
+
+//
+// C-contiguous array
+//
+template<typename T>
+Buffer<T>::Buffer(T* const data, const std::vector<size_t>& shape_) :
+ndim(static_cast<int>(shape_.size())), shape(shape_), buf(data),
+name(nullptr), view(true)
+{
+  stride.resize(ndim);
+  size_t s = 1;
+  for(int i=ndim-1; i>=0; --i) {
+    stride[i] = s;
+    s *= shape[i];
+  }
+}
+
 //
 // Deconstrucor: automatically realease buffer object
 //
@@ -108,7 +147,9 @@ void Buffer<T>::assign(PyObject* const py_array)
   //
   // Throws: TypeError
   //
+  trace::Span span("buffer");
   release();
+  view = false;
   
   char msg[128];
 
@@ -201,6 +242,13 @@ void Buffer<T>::assign(PyObject* const py_array)
       type_error(msg);
     }
   }
+  else if(str_format == "H") { // np.uint16
+    if(typeid(T) != typeid(unsigned short)) {
+      sprintf(msg, "Expected an array of %.16s but type is %.4s",
+	      util_type_name<T>(), pybuf.format);
+      type_error(msg);
+    }
+  }
   else {
     sprintf(msg, "Array has an unknown dtype %.4s.", str_format.c_str());
     type_error(msg);
@@ -243,11 +291,38 @@ void Buffer<T>::assign(PyObject* const py_array)
 template<typename T>
 void Buffer<T>::release()
 {
-  if(buf) {
+  if(buf && !view) {
     PyBuffer_Release(&pybuf);
   }
   buf = nullptr;
   ndim = 0;
+  shape.clear();
+  stride.clear();
+}
+
+//
+// Format of a buffer object without the byte-order character,
+// e.g., "d" for float64 and "B" for uint8; used to choose the template
+// argument T of Buffer<T>
+//
+// Throws: TypeError
+//
+inline std::string buffer_format(PyObject* const py_array)
+{
+  Py_buffer pybuf;
+  if(PyObject_GetBuffer(py_array, &pybuf, PyBUF_FORMAT | PyBUF_STRIDED)
+     == -1) {
+    PyErr_SetString(PyExc_TypeError,
+                    "Expected a contiguous or strided buffer protocol");
+    throw TypeError();
+  }
+
+  const char c = pybuf.format[0];
+  std::string format(c == '@' || c == '=' || c == '<' ?
+                     pybuf.format + 1 : pybuf.format);
+  PyBuffer_Release(&pybuf);
+
+  return format;
 }
 
 template<typename T>
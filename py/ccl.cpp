@@ -0,0 +1,245 @@
+//
+// Connected-component labelling; tile-parallel and scanline
+//
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "buffer.h"
+#include "graph.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "memory.h"
+#include "ccl.h"
+
+using std::vector;
+using ccl::find;
+using ccl::unite;
+
+namespace {
+
+// Number of rows in a band; the bands, and so the spanning-tree edges,
+// do not depend on the number of threads
+constexpr int band_rows = 64;
+
+// find() without modifying the tree; safe to call from many threads
+inline int find_root(int const * const parent, int i)
+{
+  while(parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+// Edge between pixels 1 and 2 with the lower pixel value
+template<typename T>
+inline void add_edge(const Buffer<T>& buf_img, const int ny,
+                     const int index1, const int index2,
+                     memory::vector<Edge>& edges)
+{
+  const double f1 = static_cast<double>(buf_img(index1 / ny, index1 % ny));
+  const double f2 = static_cast<double>(buf_img(index2 / ny, index2 % ny));
+  edges.emplace_back(index1, index2, std::min(f1, f2));
+}
+
+// Label rows [ix_begin, ix_end) independently of other bands;
+// writes parent[] of the band only
+template<typename T>
+void label_band(const Buffer<T>& buf_img, const double pixel_threshold,
+                const int ix_begin, const int ix_end,
+                int* const parent, memory::vector<Edge>* const edges)
+{
+  trace::Span span("band");
+  const int ny = static_cast<int>(buf_img.shape[1]);
+
+  for(int ix=ix_begin; ix<ix_end; ++ix) {
+    for(int iy=0; iy<ny; ++iy) {
+      const int index = ix*ny + iy;
+      if(buf_img(ix, iy) < pixel_threshold) {
+        parent[index] = -1;
+        continue;
+      }
+
+      parent[index] = index;
+
+      // Connect to the left and upper neighbours in this band
+      if(iy > 0 && parent[index - 1] >= 0 &&
+         unite(parent, index - 1, index) && edges)
+        add_edge(buf_img, ny, index - 1, index, *edges);
+
+      if(ix > ix_begin && parent[index - ny] >= 0 &&
+         unite(parent, index - ny, index) && edges)
+        add_edge(buf_img, ny, index - ny, index, *edges);
+    }
+  }
+}
+
+} // unnamed namespace
+
+
+namespace ccl {
+
+bool unite(int* const parent, const int i, const int j)
+{
+  int r1 = find(parent, i);
+  int r2 = find(parent, j);
+  if(r1 == r2)
+    return false;
+
+  if(r1 > r2)
+    std::swap(r1, r2);
+  parent[r2] = r1;
+
+  return true;
+}
+
+int default_nbands(const int nx)
+{
+  return std::max(1, nx / band_rows);
+}
+
+template<typename T>
+int label(const Buffer<T>& buf_img,
+          const double pixel_threshold,
+          memory::vector<int>& labels,
+          memory::vector<Edge>* const edges,
+          int nbands)
+{
+  // Note:
+  //   Pure C++; called without the GIL. Bands run on the shared pool
+  trace::Span span("ccl");
+
+  const int nx = static_cast<int>(buf_img.shape[0]);
+  const int ny = static_cast<int>(buf_img.shape[1]);
+  const int n = nx*ny;
+
+  labels.resize(n);
+  if(n == 0)
+    return 0;
+
+  if(nbands <= 0)
+    nbands = default_nbands(nx);
+  nbands = std::min(nbands, nx);
+
+  // Band b is rows [band_begin[b], band_begin[b + 1])
+  vector<int> band_begin(nbands + 1);
+  for(int b=0; b<=nbands; ++b)
+    band_begin[b] = static_cast<int>(static_cast<long>(nx)*b/nbands);
+
+  std::shared_ptr<ThreadPool> pool = thread_pool::get();
+
+  // Union-find of pixel indices; -1 below pixel_threshold
+  memory::vector<int> parent(n);
+  int* const p = parent.data();
+
+  // Spanning-tree edges of each band, concatenated in band order
+  vector<memory::vector<Edge>> band_edges(edges ? nbands : 0);
+
+  pool->parallel_for(nbands, [&](const int b) {
+    label_band(buf_img, pixel_threshold, band_begin[b], band_begin[b + 1],
+               p, edges ? &band_edges[b] : nullptr);
+  });
+
+  if(edges) {
+    edges->clear();
+    for(const memory::vector<Edge>& e : band_edges)
+      edges->insert(edges->end(), e.begin(), e.end());
+  }
+
+  // Merge the components across the seams in band order, which keeps the
+  // spanning-tree edges deterministic; O(ny) per seam
+  {
+    trace::Span span_seams("seams");
+    for(int b=1; b<nbands; ++b) {
+      const int ix = band_begin[b];
+      for(int iy=0; iy<ny; ++iy) {
+        const int index = ix*ny + iy;
+        if(p[index] >= 0 && p[index - ny] >= 0 &&
+           unite(p, index - ny, index) && edges)
+          add_edge(buf_img, ny, index - ny, index, *edges);
+      }
+    }
+  }
+
+  // Number the roots in index order: count the roots in each band, then
+  // label the roots and the other pixels; parent is read only from here
+  trace::Span span_relabel("relabel");
+  vector<int> band_offset(nbands + 1, 0);
+
+  pool->parallel_for(nbands, [&](const int b) {
+    int count = 0;
+    for(int i=band_begin[b]*ny; i<band_begin[b + 1]*ny; ++i)
+      count += p[i] == i;
+    band_offset[b + 1] = count;
+  });
+
+  for(int b=0; b<nbands; ++b)
+    band_offset[b + 1] += band_offset[b];
+
+  pool->parallel_for(nbands, [&](const int b) {
+    int next = band_offset[b];
+    for(int i=band_begin[b]*ny; i<band_begin[b + 1]*ny; ++i)
+      if(p[i] == i)
+        labels[i] = next++;
+  });
+
+  pool->parallel_for(nbands, [&](const int b) {
+    for(int i=band_begin[b]*ny; i<band_begin[b + 1]*ny; ++i) {
+      if(p[i] < 0)
+        labels[i] = -1;
+      else if(p[i] != i)
+        labels[i] = labels[find_root(p, i)];
+    }
+  });
+
+  return band_offset[nbands];
+}
+
+template<typename T>
+int label_runs(const Buffer<T>& buf_img,
+               const double pixel_threshold,
+               memory::vector<Run>& runs,
+               memory::vector<int>& run_labels)
+{
+  // Note:
+  //   Pure C++; called without the GIL
+  trace::Span span("ccl_runs");
+
+  runs.clear();
+
+  // Union-find of run indices; parent is the label storage
+  memory::vector<int>& parent = run_labels;
+
+  scan_runs(buf_img, pixel_threshold, parent,
+            [&runs](const int k, const Run& r) { runs.push_back(r); },
+            [](const int root, const int child) {});
+
+  // Number the roots in index order, overwriting parent with the labels;
+  // parent[k] < k for a non-root run, which is already relabelled with
+  // the label of its root
+  const int n_runs = static_cast<int>(runs.size());
+  int n_labels = 0;
+  for(int k=0; k<n_runs; ++k) {
+    if(parent[k] == k)
+      run_labels[k] = n_labels++;
+    else
+      run_labels[k] = run_labels[parent[k]];
+  }
+
+  return n_labels;
+}
+
+// explicit instantiation
+#define CCL_INSTANTIATE(T) \
+  template int label(const Buffer<T>&, const double, memory::vector<int>&, \
+                     memory::vector<Edge>* const, const int); \
+  template int label_runs(const Buffer<T>&, const double, \
+                          memory::vector<Run>&, memory::vector<int>&);
+
+CCL_INSTANTIATE(unsigned char)
+CCL_INSTANTIATE(unsigned short)
+CCL_INSTANTIATE(float)
+CCL_INSTANTIATE(double)
+
+#undef CCL_INSTANTIATE
+
+}
@@ -0,0 +1,157 @@
+#ifndef CCL_H
+#define CCL_H 1
+
+//
+// Connected-component labelling; tile-parallel and scanline
+//
+// A component is a 4-connected set of pixels >= pixel_threshold, the same
+// cluster as the BFS of Clusters::construct. The image is split into bands
+// of rows (first axis), each band is labelled on the thread pool with a
+// union-find of pixel indices, and the components are merged across the
+// seams between bands.
+//
+// Labels are deterministic: 0, 1, 2, ... in the order of the first pixel of
+// the component in index order, which is the order of clusters in the
+// serial BFS. Spanning-tree edges are also deterministic; the default
+// bands have a fixed height, so the edges do not depend on the number of
+// threads. They are a spanning tree of the component, but not the one of
+// the BFS.
+//
+// label_runs() is the serial scanline variant: pixels are grouped into
+// runs along rows, and runs overlapping in adjacent rows are united, so
+// the work is per run rather than per pixel for large components.
+// scan_runs() is the same scan with callbacks, for kernels that accumulate
+// statistics of the components while they are merged.
+//
+
+#include <utility>
+#include "buffer.h"
+#include "graph.h"
+#include "memory.h"
+
+namespace ccl {
+
+// Pixels [iy_begin, iy_end) of row ix
+struct Run {
+  Run() : ix(0), iy_begin(0), iy_end(0) {}
+  Run(const int ix_, const int iy_begin_, const int iy_end_) :
+    ix(ix_), iy_begin(iy_begin_), iy_end(iy_end_) {}
+  int size() const { return iy_end - iy_begin; }
+  int ix, iy_begin, iy_end;
+};
+
+// Root of i with path halving; the root is the smallest index of the tree
+inline int find(int* const parent, int i)
+{
+  while(parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Merge the trees of i and j; the smaller root index becomes the root, so
+// that parent[i] < i for all non-root i.
+// Returns false if they are already in the same tree
+bool unite(int* const parent, const int i, const int j);
+
+// Union-find over the runs of pixels >= pixel_threshold in index order
+//   parent:   [output] parent run of each run
+//   on_run:   on_run(k, run) is called for each run k = 0, 1, 2, ...
+//   on_merge: on_merge(root, child) is called when the tree of root child
+//             is merged under root; root < child
+template<typename T, typename RunFunc, typename MergeFunc>
+void scan_runs(const Buffer<T>& buf_img,
+               const double pixel_threshold,
+               memory::vector<int>& parent,
+               RunFunc on_run,
+               MergeFunc on_merge)
+{
+  const int nx = static_cast<int>(buf_img.shape[0]);
+  const int ny = static_cast<int>(buf_img.shape[1]);
+
+  parent.clear();
+
+  // Runs of the previous and current rows
+  memory::vector<Run> prev, cur;
+  memory::vector<int> prev_index, cur_index;
+
+  for(int ix=0; ix<nx; ++ix) {
+    size_t j_begin = 0;
+
+    int iy = 0;
+    while(iy < ny) {
+      if(buf_img(ix, iy) < pixel_threshold) {
+        ++iy;
+        continue;
+      }
+
+      const int iy_begin = iy;
+      while(iy < ny && buf_img(ix, iy) >= pixel_threshold)
+        ++iy;
+
+      const int k = static_cast<int>(parent.size());
+      const Run run(ix, iy_begin, iy);
+      parent.push_back(k);
+      cur.push_back(run);
+      cur_index.push_back(k);
+      on_run(k, run);
+
+      // Unite with the runs in the previous row that share a column;
+      // j does not go back because the runs are sorted in both rows
+      while(j_begin < prev.size() && prev[j_begin].iy_end <= iy_begin)
+        ++j_begin;
+
+      for(size_t j=j_begin; j<prev.size() && prev[j].iy_begin < iy; ++j) {
+        int r1 = find(parent.data(), prev_index[j]);
+        int r2 = find(parent.data(), k);
+        if(r1 == r2)
+          continue;
+
+        if(r1 > r2)
+          std::swap(r1, r2);
+        parent[r2] = r1;
+        on_merge(r1, r2);
+      }
+    }
+
+    prev.swap(cur);
+    prev_index.swap(cur_index);
+    cur.clear();
+    cur_index.clear();
+  }
+}
+
+// Number of bands of a fixed height for an image with nx rows
+int default_nbands(const int nx);
+
+// Label the components
+//   labels: [output] label of each pixel index, -1 for pixels below
+//           pixel_threshold
+//   edges:  [output] if not nullptr, edges of a spanning tree of each
+//           component; the value is the lower of the two pixels
+//   nbands: number of bands; default_nbands(nx) if <= 0
+// Returns:
+//   number of components
+// T: unsigned char, unsigned short, float, or double
+template<typename T>
+int label(const Buffer<T>& buf_img,
+          const double pixel_threshold,
+          memory::vector<int>& labels,
+          memory::vector<Edge>* const edges,
+          const int nbands=0);
+
+// Label the components by runs
+//   runs:       [output] runs of pixels >= pixel_threshold in index order
+//   run_labels: [output] label of each run, in the same order as label()
+// Returns:
+//   number of components
+template<typename T>
+int label_runs(const Buffer<T>& buf_img,
+               const double pixel_threshold,
+               memory::vector<Run>& runs,
+               memory::vector<int>& run_labels);
+
+}
+
+#endif
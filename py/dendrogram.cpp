@@ -0,0 +1,496 @@
+//
+// Merge hierarchy of the watershed graph for all edge thresholds
+//
+// Kruskal's algorithm over the edges in descending order of value with a
+// union-find of the leaves. Pixels and edges are then laid out in subtree
+// order with offsets passed from each merge to its children.
+//
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cassert>
+
+#include "buffer.h"
+#include "np_array.h"
+#include "ccl.h"
+#include "stats.h"
+#include "memory.h"
+#include "trace.h"
+#include "dendrogram.h"
+
+using std::vector;
+
+//
+// static functions
+//
+
+// Python deconstructor
+static void py_dendrogram_free(PyObject *obj);
+
+//
+// Dendrogram members
+//
+Dendrogram::Dendrogram() :
+  _nx(0), _ny(0)
+{
+
+}
+
+template<typename T, typename Stats>
+void Dendrogram::construct(const Watershed& w, const Buffer<T>& buf_img,
+                           const double pixel_threshold, Stats& stats)
+{
+  // Note:
+  //   Pure C++; called without the GIL
+  memory::Call call("dendrogram");
+
+  _nx = w._nx;
+  _ny = w._ny;
+  const int ny = _ny;
+  const int n_edges = static_cast<int>(w.v_edge.size());
+
+  auto value = [&buf_img, ny](const int index) {
+    return static_cast<double>(buf_img(index / ny, index % ny));
+  };
+
+  // Edge values and the order of the merges; v_edge of a flooded graph is
+  // already in descending order, so the sort is usually skipped
+  stats.begin_phase();
+  memory::vector<double> values(n_edges);
+  for(int e=0; e<n_edges; ++e)
+    values[e] = value(w.v_edge[e].index[0]);
+
+  memory::vector<int> order(n_edges);
+  std::iota(order.begin(), order.end(), 0);
+  auto descending = [&values](const int e1, const int e2) {
+    return values[e1] > values[e2];
+  };
+  if(!std::is_sorted(order.begin(), order.end(), descending))
+    std::stable_sort(order.begin(), order.end(), descending);
+  stats.end_phase("sort");
+
+  stats.begin_phase();
+
+  // Leaves in the order of their first merge
+  leaf_pixel.clear();
+  memory::vector<int> leaf_of(static_cast<size_t>(_nx)*ny, -1);
+  for(const int e : order) {
+    for(const int index : w.v_edge[e].index) {
+      if(leaf_of[index] < 0) {
+        leaf_of[index] = static_cast<int>(leaf_pixel.size());
+        leaf_pixel.push_back(index);
+      }
+    }
+  }
+  const int n = n_leaves();
+
+  // Components by the root leaf: node, size, first edge, and number of
+  // edges
+  memory::vector<int> parent(n);
+  std::iota(parent.begin(), parent.end(), 0);
+  memory::vector<int> node(parent.begin(), parent.end());
+  memory::vector<int> size(n), first(n, n_edges), n_sub_edges(n, 0);
+  for(int k=0; k<n; ++k)
+    size[k] = value(leaf_pixel[k]) >= pixel_threshold;
+
+  merge_a.resize(n_edges);
+  merge_b.resize(n_edges);
+  merge_value.resize(n_edges);
+  merge_size.resize(n_edges);
+  merge_parent.assign(n_edges, -1);
+  merge_first.resize(n_edges);
+  memory::vector<int> merge_edges(n_edges);  // edges in the subtree
+
+  for(int j=0; j<n_edges; ++j) {
+    const int e = order[j];
+    const int r1 = ccl::find(parent.data(), leaf_of[w.v_edge[e].index[0]]);
+    const int r2 = ccl::find(parent.data(), leaf_of[w.v_edge[e].index[1]]);
+    assert(r1 != r2);  // the graph is a forest
+
+    merge_a[j] = node[r1];
+    merge_b[j] = node[r2];
+    merge_value[j] = values[e];
+    merge_size[j] = size[r1] + size[r2];
+    merge_first[j] = std::min(std::min(first[r1], first[r2]), e);
+    merge_edges[j] = n_sub_edges[r1] + n_sub_edges[r2] + 1;
+
+    for(const int child : {node[r1], node[r2]}) {
+      if(child >= n)
+        merge_parent[child - n] = j;
+    }
+
+    ccl::unite(parent.data(), r1, r2);
+    const int r = std::min(r1, r2);  // the root of ccl::unite
+    node[r] = n + j;
+    size[r] = merge_size[j];
+    first[r] = merge_first[j];
+    n_sub_edges[r] = merge_edges[j];
+    stats.merge();
+  }
+  stats.end_phase("merge");
+
+  // Subtree order: the pixels of a, then b; the edges of a, b, then the
+  // edge of the merge. Offsets of the roots are assigned in merge order,
+  // and those of the children from the parent, which comes later
+  stats.begin_phase();
+  pixel_begin.resize(n_edges);
+  edge_begin.resize(n_edges);
+  edge_end.resize(n_edges);
+
+  int pixel_end = 0, edges_end = 0;
+  for(int j=0; j<n_edges; ++j) {
+    if(merge_parent[j] < 0) {
+      pixel_begin[j] = pixel_end;
+      edge_begin[j] = edges_end;
+      pixel_end += merge_size[j];
+      edges_end += merge_edges[j];
+    }
+  }
+
+  memory::vector<int> leaf_pos(n);  // position of the leaf in v_pixel
+  v_pixel.resize(pixel_end);
+  v_edge_index.resize(edges_end);
+  v_edge_value.resize(edges_end);
+
+  for(int j=n_edges-1; j>=0; --j) {
+    int pixel_offset = pixel_begin[j];
+    int edge_offset = edge_begin[j];
+
+    for(const int child : {merge_a[j], merge_b[j]}) {
+      if(child < n) {
+        leaf_pos[child] = pixel_offset;
+        pixel_offset += value(leaf_pixel[child]) >= pixel_threshold;
+      }
+      else {
+        pixel_begin[child - n] = pixel_offset;
+        edge_begin[child - n] = edge_offset;
+        pixel_offset += merge_size[child - n];
+        edge_offset += merge_edges[child - n];
+      }
+    }
+
+    edge_end[j] = edge_offset + 1;
+    v_edge_index[edge_offset] = w.v_edge[order[j]];
+    v_edge_value[edge_offset] = merge_value[j];
+  }
+
+  for(int k=0; k<n; ++k) {
+    if(value(leaf_pixel[k]) >= pixel_threshold)
+      v_pixel[leaf_pos[k]] = leaf_pixel[k];
+  }
+  stats.end_phase("layout");
+}
+
+void Dendrogram::count_clusters(const Buffer<double>& buf_thresholds,
+                                const int size_threshold,
+                                Buffer<long>& buf_nclusters) const
+{
+  // One sweep over the merges; a merge replaces its children by one
+  // component
+  const int n_thresholds = static_cast<int>(buf_thresholds.shape[0]);
+  assert(buf_nclusters.ndim == 1 &&
+         static_cast<int>(buf_nclusters.shape[0]) == n_thresholds);
+
+  const int n = n_leaves();
+  const int size_min = std::max(size_threshold, 1);
+
+  // 1 if node k is a cluster of size >= size_threshold; 0 for a leaf,
+  // which is not a cluster without an edge
+  auto counted = [&](const int k) -> long {
+    return k >= n && merge_size[k - n] >= size_min;
+  };
+
+  const int m = n_merges();
+  long count = 0;
+  int j = 0;
+  for(int i=0; i<n_thresholds; ++i) {
+    for(; j<m && merge_value[j] >= buf_thresholds(i); ++j)
+      count += counted(n + j) - counted(merge_a[j]) - counted(merge_b[j]);
+    buf_nclusters(i) = count;
+  }
+}
+
+void Dendrogram::obtain_clusters(const double edge_threshold,
+                                 const size_t size_threshold,
+                                 Clusters& clusters,
+                                 Buffer<int>* const buf_labels) const
+{
+  memory::Call call("dendrogram_clusters");
+  clusters.clear();
+  clusters._nx = _nx;
+  clusters._ny = _ny;
+
+  if(buf_labels) {
+    for(size_t ix=0; ix<buf_labels->shape[0]; ++ix)
+      for(size_t iy=0; iy<buf_labels->shape[1]; ++iy)
+        (*buf_labels)(ix, iy) = 0;
+  }
+
+  // Merges [0, m) are those with value >= edge_threshold; the clusters
+  // are the ones whose parent is not among them
+  const int m = static_cast<int>(
+      std::partition_point(merge_value.begin(), merge_value.end(),
+                           [edge_threshold](const double v) {
+                             return v >= edge_threshold; })
+      - merge_value.begin());
+
+  memory::vector<int> cut;
+  for(int j=0; j<m; ++j) {
+    const size_t size = static_cast<size_t>(merge_size[j]);
+    if((merge_parent[j] < 0 || merge_parent[j] >= m) &&
+       size > 0 && size >= size_threshold)
+      cut.push_back(j);
+  }
+
+  // In the order of the first edge, the order of obtain_clusters
+  std::sort(cut.begin(), cut.end(), [this](const int j1, const int j2) {
+    return merge_first[j1] < merge_first[j2];
+  });
+
+  for(const int j : cut) {
+    const int label = static_cast<int>(clusters.size()) + 1;
+    for(int p=pixel_begin[j]; p<pixel_begin[j] + merge_size[j]; ++p) {
+      const int index = v_pixel[p];
+      clusters.push_pixel(index);
+      if(buf_labels)
+        (*buf_labels)(index / _ny, index % _ny) = label;
+    }
+
+    for(int q=edge_begin[j]; q<edge_end[j]; ++q)
+      clusters.push_edge(v_edge_index[q].index[0], v_edge_index[q].index[1],
+                         v_edge_value[q]);
+
+    clusters.close_cluster();
+  }
+}
+
+// explicit instantiation
+#define DENDROGRAM_INSTANTIATE_STATS(T, S) \
+  template void Dendrogram::construct(const Watershed&, const Buffer<T>&, \
+                                      const double, S&);
+#define DENDROGRAM_INSTANTIATE(T) \
+  DENDROGRAM_INSTANTIATE_STATS(T, NoStats) \
+  DENDROGRAM_INSTANTIATE_STATS(T, KernelStats)
+
+DENDROGRAM_INSTANTIATE(unsigned char)
+DENDROGRAM_INSTANTIATE(unsigned short)
+DENDROGRAM_INSTANTIATE(float)
+DENDROGRAM_INSTANTIATE(double)
+
+#undef DENDROGRAM_INSTANTIATE
+#undef DENDROGRAM_INSTANTIATE_STATS
+
+
+//
+// Python interface
+//
+PyObject* py_dendrogram_alloc(PyObject* self, PyObject* args)
+{
+  // _dendrogram_alloc()
+  // Create a new dendrogram object
+  Dendrogram* const d = new Dendrogram();
+
+  return PyCapsule_New(d, "_Dendrogram", py_dendrogram_free);
+}
+
+void py_dendrogram_free(PyObject *obj)
+{
+  // Delete Dendrogram object, called automatically by Python
+  Dendrogram* const d =
+    (Dendrogram*) PyCapsule_GetPointer(obj, "_Dendrogram");
+  assert(d);
+
+  d->retire_views();
+  delete d;
+}
+
+static Dendrogram* get_dendrogram(PyObject* py_dendrogram)
+{
+  Dendrogram* const d =
+    (Dendrogram*) PyCapsule_GetPointer(py_dendrogram, "_Dendrogram");
+  assert(d);
+
+  return d;
+}
+
+
+template<typename T>
+static void construct(Dendrogram* const d, Watershed const * const w,
+                      PyObject* const py_img, const double pixel_threshold,
+                      PyObject* const py_stats)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+  w->check_shape(buf_img);
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    d->construct(*w, buf_img, pixel_threshold, stats);
+  });
+}
+
+PyObject* py_dendrogram_construct(PyObject* self, PyObject* args)
+{
+  // _dendrogram_construct(_dendrogram, _watershed, img, pixel_threshold,
+  //                       stats=None)
+  //   img: the image the watershed graph is constructed from
+  //   stats (dict): instrumentation counters are set if not None
+  trace::Span span("_dendrogram_construct");
+  PyObject *py_dendrogram, *py_watershed, *py_img;
+  PyObject *py_stats = Py_None;
+  double pixel_threshold;
+  if(!PyArg_ParseTuple(args, "OOOd|O", &py_dendrogram, &py_watershed,
+                       &py_img, &pixel_threshold, &py_stats)) {
+    return NULL;
+  }
+
+  Dendrogram* const d = get_dendrogram(py_dendrogram);
+  Watershed const * const w =
+    (Watershed const *) PyCapsule_GetPointer(py_watershed, "_Watershed");
+  assert(w);
+
+  if(!w->has_edges) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Watershed graph is constructed without edges");
+    return NULL;
+  }
+
+  d->retire_views();
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      construct<unsigned char>(d, w, py_img, pixel_threshold, py_stats);
+    else if(format == "H")
+      construct<unsigned short>(d, w, py_img, pixel_threshold, py_stats);
+    else if(format == "f")
+      construct<float>(d, w, py_img, pixel_threshold, py_stats);
+    else
+      construct<double>(d, w, py_img, pixel_threshold, py_stats);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_dendrogram_get_merges(PyObject* self, PyObject* args)
+{
+  // _dendrogram_get_merges(_dendrogram)
+  // Returns: views of arrays (a, b, value, size)
+  PyObject *py_dendrogram;
+  if(!PyArg_ParseTuple(args, "O", &py_dendrogram)) {
+    return NULL;
+  }
+
+  Dendrogram* const d = get_dendrogram(py_dendrogram);
+  PyObject* const base = d->generation.base();
+
+  return Py_BuildValue("NNNN",
+                       np_array::view_from_vector(d->merge_a, base),
+                       np_array::view_from_vector(d->merge_b, base),
+                       np_array::view_from_vector(d->merge_value, base),
+                       np_array::view_from_vector(d->merge_size, base));
+}
+
+PyObject* py_dendrogram_get_leaf_pixels(PyObject* self, PyObject* args)
+{
+  // _dendrogram_get_leaf_pixels(_dendrogram)
+  // Returns: view of the pixel index of each leaf
+  PyObject *py_dendrogram;
+  if(!PyArg_ParseTuple(args, "O", &py_dendrogram)) {
+    return NULL;
+  }
+
+  Dendrogram* const d = get_dendrogram(py_dendrogram);
+  return np_array::view_from_vector(d->leaf_pixel, d->generation.base());
+}
+
+PyObject* py_dendrogram_count_clusters(PyObject* self, PyObject* args)
+{
+  // _dendrogram_count_clusters(_dendrogram, thresholds, nclusters,
+  //                            size_threshold)
+  //   thresholds (array float64): decreasing edge thresholds
+  //   nclusters (array long): [output] number of clusters
+  trace::Span span("_dendrogram_count_clusters");
+  PyObject *py_dendrogram, *py_thresholds, *py_nclusters;
+  int size_threshold;
+  if(!PyArg_ParseTuple(args, "OOOi", &py_dendrogram, &py_thresholds,
+                       &py_nclusters, &size_threshold)) {
+    return NULL;
+  }
+
+  Dendrogram const * const d = get_dendrogram(py_dendrogram);
+
+  try {
+    Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+    Buffer<long> buf_nclusters(py_nclusters, "py_nclusters");
+
+    Py_BEGIN_ALLOW_THREADS
+    d->count_clusters(buf_thresholds, size_threshold, buf_nclusters);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_dendrogram_obtain_clusters(PyObject* self, PyObject* args)
+{
+  // _dendrogram_obtain_clusters(_dendrogram, edge_threshold,
+  //                             size_threshold, _clusters, labels=None)
+  //   labels (2D array int32): [output] label image if not None
+  trace::Span span("_dendrogram_obtain_clusters");
+  PyObject *py_dendrogram, *py_clusters;
+  PyObject *py_labels = Py_None;
+  double edge_threshold;
+  int size_threshold;
+  if(!PyArg_ParseTuple(args, "OdiO|O", &py_dendrogram, &edge_threshold,
+                       &size_threshold, &py_clusters, &py_labels)) {
+    return NULL;
+  }
+
+  Dendrogram const * const d = get_dendrogram(py_dendrogram);
+  Clusters* const clusters =
+    (Clusters*) PyCapsule_GetPointer(py_clusters, "_Clusters");
+  assert(clusters);
+
+  clusters->retire_views();
+
+  try {
+    // Buffer may throw TypeError
+    Buffer<int> buf_labels;
+    if(py_labels != Py_None)
+      buf_labels.assign(py_labels);
+
+    Buffer<int>* const labels =
+      py_labels == Py_None ? nullptr : &buf_labels;
+
+    Py_BEGIN_ALLOW_THREADS
+    d->obtain_clusters(edge_threshold, std::max(size_threshold, 0),
+                       *clusters, labels);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_dendrogram_nbytes(PyObject* self, PyObject* args)
+{
+  // _dendrogram_nbytes(_dendrogram)
+  // Returns: heap memory owned by the dendrogram object in bytes
+  PyObject *py_dendrogram;
+  if(!PyArg_ParseTuple(args, "O", &py_dendrogram)) {
+    return NULL;
+  }
+
+  return PyLong_FromSize_t(get_dendrogram(py_dendrogram)->nbytes());
+}
@@ -0,0 +1,109 @@
+#ifndef DENDROGRAM_H
+#define DENDROGRAM_H 1
+
+#include <vector>
+#include "Python.h"
+#include "buffer.h"
+#include "graph.h"
+#include "stats.h"
+#include "memory.h"
+#include "np_array.h"
+#include "py_clusters.h"
+#include "py_watershed.h"
+
+//
+// Merge hierarchy of the watershed graph for all edge thresholds
+//
+// Edges are processed once in descending order of value (Kruskal); each
+// edge merges two components of the graph, because the watershed graph is
+// a forest. Node k < n_leaves() is leaf k, the pixel leaf_pixel[k], and
+// merge j is node n_leaves() + j, the component of the edges
+// >= merge_value[j] that contains its two children. Merges are in
+// descending order of value, so the parent of a merge comes after it.
+//
+// The cluster of Watershed::obtain_clusters for edge_threshold is a merge
+// j with merge_value[j] >= edge_threshold whose parent is below the
+// threshold or does not exist. Pixels >= pixel_threshold and edges of the
+// subtree of every merge are contiguous in v_pixel and v_edge_index, so
+// clusters at a cut are copied in time proportional to the output.
+//
+class Dendrogram {
+ public:
+  Dendrogram();
+  Dendrogram(Dendrogram const&) = delete;
+  Dendrogram& operator=(Dendrogram const&) = delete;
+
+  // w: watershed graph with edges, constructed from buf_img
+  // pixel_threshold: only pixels >= this are counted in the sizes and
+  //                  listed in the clusters, as in obtain_clusters
+  // T: unsigned char, unsigned short, float, or double
+  // Stats: NoStats or KernelStats (stats.h)
+  template<typename T, typename Stats>
+  void construct(const Watershed& w, const Buffer<T>& buf_img,
+                 const double pixel_threshold, Stats& stats);
+
+  // Number of clusters with size >= size_threshold for each edge threshold
+  //   buf_thresholds: in decreasing order
+  void count_clusters(const Buffer<double>& buf_thresholds,
+                      const int size_threshold,
+                      Buffer<long>& buf_nclusters) const;
+
+  // Same clusters as Watershed::obtain_clusters with the pixel_threshold
+  // of the construction, in the same order; pixels and edges of a cluster
+  // are in subtree order
+  //   buf_labels: [output] if not nullptr, label image of the clusters
+  void obtain_clusters(const double edge_threshold,
+                       const size_t size_threshold,
+                       Clusters& clusters,
+                       Buffer<int>* const buf_labels=nullptr) const;
+
+  int n_leaves() const { return static_cast<int>(leaf_pixel.size()); }
+  int n_merges() const { return static_cast<int>(merge_value.size()); }
+
+  // Heap memory owned by this object
+  size_t nbytes() const {
+    return sizeof(Dendrogram) + memory::nbytes(leaf_pixel) +
+           memory::nbytes(merge_a) + memory::nbytes(merge_b) +
+           memory::nbytes(merge_value) + memory::nbytes(merge_size) +
+           memory::nbytes(merge_parent) + memory::nbytes(merge_first) +
+           memory::nbytes(pixel_begin) + memory::nbytes(edge_begin) +
+           memory::nbytes(edge_end) + memory::nbytes(v_pixel) +
+           memory::nbytes(v_edge_index) + memory::nbytes(v_edge_value);
+  }
+
+  // Hand the merge arrays and leaf_pixel over to their numpy views, if
+  // any are alive, before the hierarchy is reconstructed or freed; with
+  // the GIL
+  void retire_views() {
+    generation.retire(leaf_pixel, merge_a, merge_b, merge_value,
+                      merge_size);
+  }
+
+  int _nx, _ny;
+
+  std::vector<int> leaf_pixel;      // pixel index of each leaf
+  std::vector<int> merge_a;         // children nodes of the merges
+  std::vector<int> merge_b;
+  std::vector<double> merge_value;  // edge value, descending
+  std::vector<int> merge_size;      // pixels >= pixel_threshold
+  std::vector<int> merge_parent;    // parent merge; -1 for a root
+  std::vector<int> merge_first;     // first edge in Watershed::v_edge
+  std::vector<int> pixel_begin;     // subtree in v_pixel
+  std::vector<int> edge_begin;      // subtree in v_edge_index; the edge
+  std::vector<int> edge_end;        // of the merge is the last
+  std::vector<int> v_pixel;         // pixels in subtree order
+  std::vector<EdgeIndex> v_edge_index;  // edges in subtree order
+  std::vector<double> v_edge_value;
+
+  np_array::Generation generation;  // of the exported views
+};
+
+
+PyObject* py_dendrogram_alloc(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_construct(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_get_merges(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_get_leaf_pixels(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_count_clusters(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_obtain_clusters(PyObject* self, PyObject* args);
+PyObject* py_dendrogram_nbytes(PyObject* self, PyObject* args);
+#endif
@@ -5,16 +5,19 @@ A cluster is a connected component of pixels >= pixel_threshold
 Pixels are connected with 4 adjacent neibours
 */
 
-#include <iostream>  // DEBUG!!!
 #include <vector>
-#include <queue>
-#include <random>
-#include <utility>  // swap
-
-#include <eigen3/Eigen/Dense>
+#include <algorithm>
+#include <utility>  // swap, move
+#include <cmath>
+#include <cstdint>
+#include <cassert>
 
 #include "np_array.h"
 #include "buffer.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "memory.h"
+#include "ccl.h"
 #include "ellipses.h"
 
 using std::vector;
@@ -33,179 +36,373 @@ using std::vector;
 // C++ implementations
 //
 
-static PyObject* obtain_ellipses(PyObject* const py_img,
-                                 const double pixel_threshold,
-                                 const int size_threshold)
-{
-  /*
-   * Args:
-   *   py_img (2D array float64): 2D image array
-   *   pixel_threshold: pixel value < are neglected
-   *   size_threshold: cluster size < are neglected
-   *   
-   * Exceptions:
-   *   TypeError
-   */
+namespace {
 
-  // Buffer may throw Type error
-  Buffer<double> buf_img(py_img, "py_img");  // image/2D pixels;
+// Number of clusters per task of the ellipse finalisation
+constexpr int ellipse_chunk = 256;
 
-  // image size
-  const int nx = static_cast<int>(buf_img.shape[0]);
-  const int ny = static_cast<int>(buf_img.shape[1]);
+//
+// Raw moments of pixel positions (ix, iy) in a cluster, exact in int64
+//
+struct Moments {
+  // Moments of the pixels of a run in closed form
+  template<typename T>
+  Moments(const ccl::Run& r, const Buffer<T>& buf_img) {
+    const int64_t x = r.ix;
+    const int64_t b = r.iy_begin;
+    const int64_t e = r.iy_end - 1;  // last pixel
+
+    n = r.size();
+    sx = n*x;
+    sy = n*(b + e)/2;
+    sxx = n*x*x;
+    sxy = x*sy;
+    syy = (e*(e + 1)*(2*e + 1) - (b - 1)*b*(2*b - 1))/6;
+  }
 
-  // number of pixels
-  const int n = nx*ny;
+  Moments& operator+=(const Moments& m) {
+    n += m.n; sx += m.sx; sy += m.sy;
+    sxx += m.sxx; sxy += m.sxy; syy += m.syy;
+    return *this;
+  }
 
-  // Define neighbour pixel
-  const int dx_list[] = {1, -1, 0, 0}; // right, left, up, down
-  const int dy_list[] = {0,  0, -1, 1};
+  int64_t size() const { return n; }
+
+  // Mean and covariance
+  void normalise(double& mx, double& my,
+                 double& cxx, double& cxy, double& cyy) const {
+    const double w = static_cast<double>(n);
+    mx = sx/w;
+    my = sy/w;
+    cxx = sxx/w - mx*mx;
+    cxy = sxy/w - mx*my;
+    cyy = syy/w - my*my;
+  }
 
-  // remember visited pixels
-  vector<bool> visited(n, false);
+  int64_t n, sx, sy, sxx, sxy, syy;
+};
 
-  // queue of pixel indices in the same cluster
-  std::queue<int> q;
+//
+// Moments of pixel positions weighted by the pixel values
+//
+struct WeightedMoments {
+  template<typename T>
+  WeightedMoments(const ccl::Run& r, const Buffer<T>& buf_img) :
+    n(r.size()), w(0), wx(0), wy(0), wxx(0), wxy(0), wyy(0) {
+    const double x = r.ix;
+    for(int iy=r.iy_begin; iy<r.iy_end; ++iy) {
+      const double f = static_cast<double>(buf_img(r.ix, iy));
+      w += f;
+      wy += f*iy;
+      wyy += f*iy*iy;
+    }
+    wx = x*w;
+    wxx = x*x*w;
+    wxy = x*wy;
+  }
 
-  // Eigen-value solver
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix2d> e;
+  WeightedMoments& operator+=(const WeightedMoments& m) {
+    n += m.n; w += m.w; wx += m.wx; wy += m.wy;
+    wxx += m.wxx; wxy += m.wxy; wyy += m.wyy;
+    return *this;
+  }
 
-  // Return value
-  vector<double> ellipses;
+  int64_t size() const { return n; }
 
-  constexpr double ellipse_factor = 5.991;
-  // a, b = sqrt(5.991*eigen_value)
-  // This is the 95% contour for Gaussian
-
-
-    
-  // Travers all pixels
-  for(int index0=0; index0<n; ++index0) {
-    int ix0 = index0 / ny;
-    int iy0 = index0 % ny;
-
-    if(visited[index0] || buf_img(ix0, iy0) < pixel_threshold)
-      continue;
-
-    visited[index0] = true;
-    assert(q.empty());
-
-    // First pixel in a new cluster
-    q.push(index0);
-
-    // Mean and covariance of the pixels in the cluster
-    int sum = 0;
-    Eigen::Vector2d mu(0.0, 0.0);
-    Eigen::Matrix2d cov; cov << 0.0, 0.0, 0.0, 0.0;
-
-    const Eigen::DiagonalMatrix<double, 2> diag(1.0/12.0, 1.0/12.0);
-
-    while(!q.empty()) {
-      int index1 = q.front(); q.pop();
-      assert(0 <= index1 && index1 < n);
-      
-      int ix1 = index1 / ny;
-      int iy1 = index1 % ny;
-
-      Eigen::Vector2d x(ix1, iy1);;
-      mu += x;
-      cov += x*x.transpose();
-      ++sum;
-      // Note: use value?
-      
-      // Loop over 4 neighbors
-      for(int j=0; j<4; ++j) {
-        int ix2 = ix1 + dx_list[j];
-        int iy2 = iy1 + dy_list[j];
-        
-        if(!(0 <= ix2 && ix2 < nx && 0 <= iy2 && iy2 < ny))
-          continue;  // Outside the image
-
-        int index2 = ix2*ny + iy2;
-        if(visited[index2] || buf_img(ix2, iy2) < pixel_threshold)
-          continue;
-
-        // Add a connected pixel to the queue
-        visited[index2] = true;
-        q.push(index2);
-      }      
-    }
+  void normalise(double& mx, double& my,
+                 double& cxx, double& cxy, double& cyy) const {
+    mx = wx/w;
+    my = wy/w;
+    cxx = wxx/w - mx*mx;
+    cxy = wxy/w - mx*my;
+    cyy = wyy/w - my*my;
+  }
 
-    if(sum < size_threshold)
-      continue;
+  int64_t n;  // number of pixels
+  double w, wx, wy, wxx, wxy, wyy;
+};
 
-    
-    // Normalise mean and covariance
-    mu /= sum;
-    cov /= sum;
-    cov -= mu*mu.transpose();
-    cov += diag; // Add 1/12 to diagonal, variance of the square pixel
+//
+// 6 numbers of the ellipses (see obtain_ellipses) of clusters
+// roots[0:n], n <= ellipse_chunk
+//
+// The 2x2 symmetric eigen problem is solved in closed form. The loop over
+// the clusters is branch free on arrays of a chunk, so that the compiler
+// can vectorise it.
+//
+template<typename M>
+void compute_ellipses(const memory::vector<M>& moments,
+                      int const * const roots, const int n,
+                      double* const out)
+{
+  assert(n <= ellipse_chunk);
+  double mx[ellipse_chunk], my[ellipse_chunk];
+  double cxx[ellipse_chunk], cxy[ellipse_chunk], cyy[ellipse_chunk];
+  double a[ellipse_chunk], b[ellipse_chunk], theta[ellipse_chunk];
+
+  for(int i=0; i<n; ++i)
+    moments[roots[i]].normalise(mx[i], my[i], cxx[i], cxy[i], cyy[i]);
+
+  for(int i=0; i<n; ++i)
+    ellipses::axes(cxx[i], cxy[i], cyy[i], a[i], b[i]);
+
+  for(int i=0; i<n; ++i)
+    theta[i] = ellipses::angle(cxx[i], cxy[i], cyy[i]);
+
+  for(int i=0; i<n; ++i) {
+    double* const e = out + 6*i;
+    e[0] = static_cast<double>(moments[roots[i]].size());
+    e[1] = mx[i];
+    e[2] = my[i];
+    e[3] = a[i];
+    e[4] = b[i];
+    e[5] = theta[i];
+  }
+}
 
-    
-    // Solve for eigen vectors and eigen values 
-    e.compute(cov);
-    assert(e.info() == Eigen::Success);
+template<typename M, typename T>
+void obtain_ellipses_moments(const Buffer<T>& buf_img,
+                             const double pixel_threshold,
+                             const int size_threshold,
+                             vector<double>& ellipses)
+{
+  // Moments of each run; of the whole cluster for a root
+  memory::vector<int> parent;
+  memory::vector<M> moments;
+
+  ccl::scan_runs(buf_img, pixel_threshold, parent,
+    [&moments, &buf_img](const int k, const ccl::Run& r) {
+      moments.emplace_back(r, buf_img);
+    },
+    [&moments](const int root, const int child) {
+      moments[root] += moments[child];
+    });
+
+  // Clusters in the order of their first pixels, i.e., roots
+  memory::vector<int> roots;
+  const int n_runs = static_cast<int>(parent.size());
+  for(int k=0; k<n_runs; ++k) {
+    if(parent[k] == k && moments[k].size() >= size_threshold)
+      roots.push_back(k);
+  }
 
-    double a = e.eigenvalues()[0];
-    double b = e.eigenvalues()[1];
+  const int n_ellipses = static_cast<int>(roots.size());
+  const size_t offset = ellipses.size();
+  ellipses.resize(offset + 6*static_cast<size_t>(n_ellipses));
+  double* const out = ellipses.data() + offset;
+
+  const int n_chunks = (n_ellipses + ellipse_chunk - 1)/ellipse_chunk;
+  thread_pool::get()->parallel_for(n_chunks, [&](const int ichunk) {
+    const int begin = ichunk*ellipse_chunk;
+    const int end = std::min(n_ellipses, begin + ellipse_chunk);
+    compute_ellipses(moments, roots.data() + begin, end - begin,
+                     out + 6*begin);
+  });
+}
 
-    // (ex, ey) is the eigen vector along major axis
-    double ex, ey;
+} // unnamed namespace
 
-    if(a >= b) {
-      ex = e.eigenvectors().col(0)[0];
-      ey = e.eigenvectors().col(0)[1];
-    }
-    else {
-      std::swap(a, b);
-      ex = e.eigenvectors().col(1)[0];
-      ey = e.eigenvectors().col(1)[1];
-    }
 
-    assert(a >= b);
+namespace ellipses {
 
-    // angle between x axis and the major axis in radians
-    double theta = ex >=0 ? asin(ey) : M_PI - asin(ey);
+template<typename T>
+void obtain_ellipses(const Buffer<T>& buf_img,
+                     const double pixel_threshold,
+                     const int size_threshold,
+                     const bool weighted,
+                     vector<double>& ellipses)
+{
+  /*
+   * Args:
+   *   buf_img (2D array): 2D image array of T
+   *   pixel_threshold: pixel value < are neglected
+   *   size_threshold: cluster size < are neglected
+   *   weighted: weight the moments by pixel values
+   *   ellipses: [output] 6 numbers per ellipse
+   *
+   * Clusters are labelled with one raster scan of runs (ccl::scan_runs);
+   * the moments of a run are added to the table when the run is found,
+   * and the moments of two clusters are added when they are merged. The
+   * ellipses of the remaining roots are computed on the thread pool.
+   *
+   * Note:
+   *   Pure C++; called without the GIL
+   */
+  trace::Span span("ellipses");
+  memory::Call call("ellipses");
+
+  if(weighted)
+    obtain_ellipses_moments<WeightedMoments>(buf_img, pixel_threshold,
+                                             size_threshold, ellipses);
+  else
+    obtain_ellipses_moments<Moments>(buf_img, pixel_threshold,
+                                     size_threshold, ellipses);
+}
 
-    a = sqrt(ellipse_factor*a); // semi-major axis
-    b = sqrt(ellipse_factor*b); // semi-minor axis;  a >= b
+// explicit instantiation
+#define ELLIPSES_INSTANTIATE(T) \
+  template void obtain_ellipses(const Buffer<T>&, const double, const int, \
+                                const bool, vector<double>&);
 
-    ellipses.push_back(sum);    
-    ellipses.push_back(mu[0]);
-    ellipses.push_back(mu[1]);
-    ellipses.push_back(a);
-    ellipses.push_back(b);
-    ellipses.push_back(theta);
-  } // goto to next pixel for a new cluster
+ELLIPSES_INSTANTIATE(unsigned char)
+ELLIPSES_INSTANTIATE(unsigned short)
+ELLIPSES_INSTANTIATE(float)
+ELLIPSES_INSTANTIATE(double)
+
+#undef ELLIPSES_INSTANTIATE
 
-  return np_array::copy_from_vector(ellipses);
 }
 
+using ellipses::obtain_ellipses;
+
 //
 // Python interface
 //
 
+template<typename T>
+static void obtain_image(PyObject* const py_img,
+                         const double pixel_threshold,
+                         const int size_threshold,
+                         const bool weighted,
+                         vector<double>& ellipses)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+
+  Py_BEGIN_ALLOW_THREADS
+  obtain_ellipses(buf_img, pixel_threshold, size_threshold, weighted,
+                  ellipses);
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+}
+
+template<typename T>
+static void obtain_images(PyObject* const py_imgs,
+                          PyObject* const py_thresholds,
+                          const int size_threshold,
+                          const bool weighted,
+                          vector<double>& ellipses)
+{
+  // Buffer may throw TypeError
+  Buffer<T> buf_imgs(py_imgs, "py_imgs");
+  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+
+  assert(buf_imgs.ndim == 3 && buf_thresholds.ndim == 1);
+  assert(buf_thresholds.shape[0] == buf_imgs.shape[0]);
+
+  const int n_imgs = static_cast<int>(buf_imgs.shape[0]);
+
+  Py_BEGIN_ALLOW_THREADS
+  vector<vector<double>> v_ellipses(n_imgs);
+
+  thread_pool::get()->parallel_for(n_imgs, [&](const int i) {
+    trace::Span span("image");
+    Buffer<T> buf_img(buf_imgs, i);
+    obtain_ellipses(buf_img, buf_thresholds(i), size_threshold, weighted,
+                    v_ellipses[i]);
+  });
+
+  // Concatenate with image index
+  size_t n = 0;
+  for(const vector<double>& v : v_ellipses)
+    n += v.size()/6;
+
+  ellipses.reserve(7*n);
+  for(int i=0; i<n_imgs; ++i) {
+    const vector<double>& v = v_ellipses[i];
+    for(size_t j=0; j<v.size(); j += 6) {
+      ellipses.insert(ellipses.end(), v.begin() + j, v.begin() + j + 6);
+      ellipses.push_back(i);
+    }
+  }
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+}
+
 namespace ellipses {
 
 PyObject* obtain(PyObject* self, PyObject* args)
 {
-  // _ellipses_obtain()
+  // _ellipses_obtain(img, pixel_threshold, size_threshold, weighted=0)
+  //   weighted (int): weight the moments by pixel values if nonzero
+  trace::Span span("_ellipses_obtain");
   PyObject *py_img;
   double pixel_threshold;
   int size_threshold;
-  if(!PyArg_ParseTuple(args, "Odi", &py_img,
-                       &pixel_threshold, &size_threshold)) {
+  int weighted = 0;
+  if(!PyArg_ParseTuple(args, "Odi|i", &py_img,
+                       &pixel_threshold, &size_threshold, &weighted)) {
     return NULL;
   }
 
+  vector<double> ellipses;
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      obtain_image<unsigned char>(py_img, pixel_threshold, size_threshold,
+                                  weighted, ellipses);
+    else if(format == "H")
+      obtain_image<unsigned short>(py_img, pixel_threshold, size_threshold,
+                                   weighted, ellipses);
+    else if(format == "f")
+      obtain_image<float>(py_img, pixel_threshold, size_threshold,
+                          weighted, ellipses);
+    else
+      obtain_image<double>(py_img, pixel_threshold, size_threshold,
+                           weighted, ellipses);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  return np_array::move_from_vector(std::move(ellipses));
+}
+
+PyObject* obtain_batch(PyObject* self, PyObject* args)
+{
+  // _ellipses_obtain_batch(imgs, pixel_thresholds, size_threshold,
+  //                        weighted=0)
+  //   imgs (3D array): N images
+  //   pixel_thresholds (1D array float64): threshold for each image
+  //   weighted (int): weight the moments by pixel values if nonzero
+  // Returns:
+  //   7 numbers per ellipse; 6 numbers of _ellipses_obtain and the
+  //   image index
+  trace::Span span("_ellipses_obtain_batch");
+  PyObject *py_imgs, *py_thresholds;
+  int size_threshold;
+  int weighted = 0;
+  if(!PyArg_ParseTuple(args, "OOi|i", &py_imgs, &py_thresholds,
+                       &size_threshold, &weighted)) {
+    return NULL;
+  }
+
+  vector<double> ellipses;
+
   try {
-    return obtain_ellipses(py_img, pixel_threshold, size_threshold);
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_imgs);
+
+    if(format == "B")
+      obtain_images<unsigned char>(py_imgs, py_thresholds, size_threshold,
+                                   weighted, ellipses);
+    else if(format == "H")
+      obtain_images<unsigned short>(py_imgs, py_thresholds, size_threshold,
+                                    weighted, ellipses);
+    else if(format == "f")
+      obtain_images<float>(py_imgs, py_thresholds, size_threshold,
+                           weighted, ellipses);
+    else
+      obtain_images<double>(py_imgs, py_thresholds, size_threshold,
+                            weighted, ellipses);
   }
   catch (TypeError e) {
     return NULL;
   }
 
-  Py_RETURN_NONE;
+  return np_array::move_from_vector(std::move(ellipses));
 }
 
 }
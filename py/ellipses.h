@@ -1,11 +1,51 @@
 #ifndef ELLIPSES_H
 #define ELLIPSES_H 1
 
+#include <vector>
+#include <algorithm>
+#include <cmath>
 #include "Python.h"
+#include "buffer.h"
 
 namespace ellipses {
 
+// Semi-major and semi-minor axes, a >= b, of the ellipse of the covariance
+// (cxx, cxy, cyy) of pixel positions; a^2 and b^2 are 5.991 times the
+// eigen values after adding 1/12, the variance of a square pixel, to the
+// diagonal. 5.991 is the 95% contour for a Gaussian.
+inline void axes(const double cxx, const double cxy, const double cyy,
+                 double& a, double& b)
+{
+  constexpr double ellipse_factor = 5.991;
+
+  // Eigen values are (cxx + cyy)/2 +- sqrt(((cxx - cyy)/2)^2 + cxy^2)
+  const double h = 0.5*(cxx - cyy);
+  const double t = 0.5*(cxx + cyy) + 1.0/12.0;
+  const double r = std::sqrt(h*h + cxy*cxy);
+
+  a = std::sqrt(ellipse_factor*(t + r));
+  b = std::sqrt(ellipse_factor*std::max(t - r, 0.0));
+}
+
+// Angle between x axis and the major axis in radians, [-pi/2, pi/2]
+inline double angle(const double cxx, const double cxy, const double cyy)
+{
+  return 0.5*std::atan2(2.0*cxy, cxx - cyy);
+}
+
+// 6 numbers per ellipse: size, centre x, y, semi-major, semi-minor axes,
+// and the angle of the major axis in [-pi/2, pi/2]
+// weighted: centre and axes of the moments weighted by pixel values
+// T: unsigned char, unsigned short, float, or double
+template<typename T>
+void obtain_ellipses(const Buffer<T>& buf_img,
+                     const double pixel_threshold,
+                     const int size_threshold,
+                     const bool weighted,
+                     std::vector<double>& ellipses);
+
 PyObject* obtain(PyObject* self, PyObject* args);
+PyObject* obtain_batch(PyObject* self, PyObject* args);
 
 }
 
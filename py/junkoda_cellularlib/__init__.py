@@ -1,16 +1,23 @@
 from . import data
 from . import ellipses
+from . import memory
+from . import parallel
+from . import regionprops
 from . import threshold
+from . import trace
 from . import watershed
 
 from .watershed import Watershed
 from .clusters import Clusters
 from .delaunay import Delaunay
+from .dendrogram import Dendrogram
 from .graph import Graph
-from .watershed_ncluster import compute_nclusters
+from .max_tree import MaxTree
+from .watershed_ncluster import compute_nclusters, compute_nclusters_batch
 
 
-__all__ = ['clip', 'ellipses', 'data',
-           'threshold', 'watershed',
-           'compute_nclusters',
-           'Clusters', 'Delaunay', 'Graph', 'Watershed']
+__all__ = ['clip', 'ellipses', 'data', 'memory', 'parallel',
+           'regionprops', 'threshold', 'trace', 'watershed',
+           'compute_nclusters', 'compute_nclusters_batch',
+           'Clusters', 'Delaunay', 'Dendrogram', 'Graph', 'MaxTree',
+           'Watershed']
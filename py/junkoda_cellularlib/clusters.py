@@ -4,32 +4,59 @@ import junkoda_cellularlib._cellularlib as c  # library in C++
 from .graph import Graph
 
 
+def _check_labels(labels, shape):
+    """
+    Check that labels is a label image for an image of given shape
+
+    Exception:
+      TypeError, ValueError
+    """
+    if labels is None:
+        return
+
+    if not isinstance(labels, np.ndarray) or labels.dtype != np.int32:
+        raise TypeError('Expected an np.int32 array for labels')
+
+    if labels.shape != tuple(shape):
+        raise ValueError('Shape of labels %s != image %s'
+                         % (labels.shape, tuple(shape)))
+
+
 class Cluster:
-    def __init__(self, _cluster, nx, ny):
-        self._cluster = _cluster
+    """
+    Cluster k of Clusters; arrays are slices of the arrays of all
+    clusters, without a copy. The arrays and offsets are taken when the
+    Cluster is created, so it stays the same after the clusters are
+    obtained again
+    """
+    def __init__(self, clusters, k):
+        self._arrays = clusters._get_arrays()
+        self._ranges = tuple((offset[k], offset[k + 1])
+                             for offset in clusters._get_offsets())
+        self._n_vertices = int(clusters._get_sizes()[k])
+        self._shape = clusters.shape
         self._graph = None
-        self.nx = nx
-        self.ny = ny
-
-    def __repr__(self):
-        return 'Cluster (%d vertices, %d edges)' % (len(self), self.n_edges)
 
-    def __len__(self):
-        """
-        Number of vertices in the cluster
-        """
-        return self.n_vertices
+    def _slice(self, j, i):
+        # Slice of array i with range j of pixel, edge, and run offsets
+        begin, end = self._ranges[j]
+        return self._arrays[i][begin:end]
 
-    def __lt__(self, other):
-        return len(self) > len(other)
+    @property
+    def nx(self):
+        return self._shape[0]
 
     @property
-    def n_edges(self):
-        return c._clusters_cluster_nedges(self._cluster)
+    def ny(self):
+        return self._shape[1]
 
     @property
-    def n_vertices(self):
-        return c._clusters_cluster_nvertices(self._cluster)
+    def pixels(self):
+        """
+        Returns:
+          np.array (int): pixel indices; index = ix * ny + iy
+        """
+        return self._slice(0, 1)
 
     @property
     def edge_indices(self):
@@ -38,7 +65,7 @@ class Cluster:
           np.array (int): n_edges x 2
                           [pixel index1, pixel index2] of the endpoints
         """
-        return c._clusters_cluster_get_edges(self._cluster)
+        return self._slice(1, 3)
 
     @property
     def edge_values(self):
@@ -46,7 +73,38 @@ class Cluster:
         Returns:
           np.array (float [n_edge,]): the value of lower pixel
         """
-        return c._clusters_cluster_get_edge_values(self._cluster)
+        return self._slice(1, 4)
+
+    @property
+    def runs(self):
+        """
+        Returns:
+          np.array (int): n_runs x 3 [ix, iy_begin, iy_end]
+                          pixels iy_begin <= iy < iy_end of row ix;
+                          only for Clusters(..., runs=True)
+        """
+        return self._slice(2, 6)
+
+    def __repr__(self):
+        return 'Cluster (%d vertices, %d edges)' % (len(self), self.n_edges)
+
+    def __len__(self):
+        """
+        Number of vertices in the cluster
+        """
+        return self.n_vertices
+
+    def __lt__(self, other):
+        return len(self) > len(other)
+
+    @property
+    def n_edges(self):
+        begin, end = self._ranges[1]
+        return end - begin
+
+    @property
+    def n_vertices(self):
+        return self._n_vertices
 
     def obtain_graph(self):
         """
@@ -68,19 +126,56 @@ class Cluster:
 
 class Clusters:
     """
-    Clusters(img, pixel_threshold, *, size_threshold=0)
+    Clusters(img, pixel_threshold, *, size_threshold=0, parallel=False,
+             runs=False)
+
+    Connected components of pixels >= pixel_threshold.
+    With parallel=True, the image is labelled in bands of rows on the C++
+    thread pool; the clusters and their order are the same, but pixels of
+    a cluster are in index order instead of BFS order, and the edges are
+    a different spanning tree of the cluster from the BFS one. Both do
+    not depend on the number of threads.
+    With runs=True, clusters are labelled by scanline and kept as runs of
+    pixels in rows (Cluster.runs) without edges, which is faster and
+    smaller for masks with long runs.
+    With labels, an np.int32 array of the image shape, the label image is
+    written while the clusters are found: 0 for pixels not in a cluster
+    and k for pixels in clusters[k - 1].
+
+    Clusters are stored as flat arrays in compressed sparse row (CSR)
+    format, exposed as numpy views without a copy; cluster k has
+      pixels[pixel_offset[k]:pixel_offset[k + 1]]
+      edge_indices[edge_offset[k]:edge_offset[k + 1]], and edge_values
+      runs[run_offset[k]:run_offset[k + 1]]
+    The views keep their arrays alive; they stay valid after the clusters
+    are obtained again or deleted.
 
     len(clusters): number of clusters
     clusters[i]: ith cluster
 
+    Properties:
+      pixel_offset, pixels, edge_offset, edge_indices, edge_values,
+      run_offset, runs, shape, sizes, nbytes
+
     Methods:
       plot_edges
     """
-    def __init__(self, img, pixel_threshold, *, size_threshold=0):
+    def __init__(self, img=None, pixel_threshold=None, *, size_threshold=0,
+                 parallel=False, runs=False, labels=None, stats=None):
         self._clusters = c._clusters_alloc()
+        self._reset()
 
         if img is not None:
-            self.obtain(img, pixel_threshold, size_threshold)
+            self.obtain(img, pixel_threshold, size_threshold,
+                        parallel=parallel, runs=runs, labels=labels,
+                        stats=stats)
+
+    def _reset(self):
+        # Arrays cached from the C++ clusters
+        self._arrays = None
+        self._offsets = None
+        self._sizes = None
+        self._shape = None
 
     def __len__(self):
         """
@@ -88,6 +183,10 @@ class Clusters:
         """
         return c._clusters_len(self._clusters)
 
+    def __iter__(self):
+        for k in range(len(self)):
+            yield Cluster(self, k)
+
     def __repr__(self):
         return 'Clusters %d' % len(self)
 
@@ -101,16 +200,52 @@ class Clusters:
 
         Exception: raise IndexError when i is out of range
         """
-        _cluster, nx, ny = c._clusters_get_cluster(self._clusters, i)
-        return Cluster(_cluster, nx, ny)
-
-    def obtain(self, img, pixel_threshold, size_threshold=0):
+        n = len(self)
+        if i < 0:
+            i += n
+        if not (0 <= i < n):
+            raise IndexError('cluster index out of range')
+
+        return Cluster(self, i)
+
+    def _get_arrays(self):
+        # CSR arrays of all clusters with one call
+        if self._arrays is None:
+            self._arrays = c._clusters_get_arrays(self._clusters)
+        return self._arrays
+
+    def _get_offsets(self):
+        # pixel, edge, and run offsets as lists
+        if self._offsets is None:
+            arrays = self._get_arrays()
+            self._offsets = (arrays[0].tolist(), arrays[2].tolist(),
+                             arrays[5].tolist())
+        return self._offsets
+
+    def _get_sizes(self):
+        if self._sizes is None:
+            self._sizes = np.empty(len(self), dtype=int)
+            c._clusters_get_sizes(self._clusters, self._sizes)
+        return self._sizes
+
+    def obtain(self, img, pixel_threshold, size_threshold=0, *,
+               parallel=False, runs=False, labels=None, stats=None):
+        """
+        Args:
+          parallel (bool): tile-parallel labelling on the thread pool
+          runs (bool): keep clusters as runs; see Clusters
+          labels (array): [output] np.int32 label image; see Clusters
+          stats (dict): if given, instrumentation counters are set
+        """
         if img.ndim != 2:
             raise TypeError('Expeceted a 2-dimensional array for img: '
                             '%d' % img.ndim)
+        _check_labels(labels, img.shape)
 
+        self._reset()
         c._clusters_obtain(self._clusters, img,
-                           pixel_threshold, size_threshold)
+                           pixel_threshold, size_threshold, stats,
+                           int(parallel), int(runs), labels)
         return self
 
     def plot_edges(self, colour=None, *, cmap='OrRd', vmin=None, vmax=None,
@@ -121,23 +256,80 @@ class Clusters:
         for cl in self:
             cl.plot_edges(colour, cmap=cmap, vmin=vmin, vmax=vmax, **kwargs)
 
+    @property
+    def pixel_offset(self):
+        return self._get_arrays()[0]
+
+    @property
+    def pixels(self):
+        """
+        Returns: pixel indices of all clusters (int array);
+                 index = ix * ny + iy
+        """
+        return self._get_arrays()[1]
+
+    @property
+    def edge_offset(self):
+        return self._get_arrays()[2]
+
+    @property
+    def edge_indices(self):
+        """
+        Returns: n_edges x 2 pixel indices of the end points (int array)
+        """
+        return self._get_arrays()[3]
+
+    @property
+    def edge_values(self):
+        """
+        Returns: the value of the lower pixel of the edges (float array)
+        """
+        return self._get_arrays()[4]
+
+    @property
+    def run_offset(self):
+        return self._get_arrays()[5]
+
+    @property
+    def runs(self):
+        """
+        Returns: n_runs x 3 [ix, iy_begin, iy_end] (int array);
+                 only for Clusters(..., runs=True)
+        """
+        return self._get_arrays()[6]
+
+    @property
+    def shape(self):
+        """
+        Returns: (nx, ny) of the image
+        """
+        if self._shape is None:
+            self._shape = c._clusters_get_shape(self._clusters)
+        return self._shape
+
+    @property
+    def nbytes(self):
+        """
+        Returns: heap memory owned by the C++ clusters in bytes
+        """
+        return c._clusters_nbytes(self._clusters)
+
     @property
     def sizes(self):
-        out = np.empty(len(self), dtype=int)
-        c._clusters_get_sizes(self._clusters, out)
-        return out
+        return self._get_sizes().copy()
 
 
-def obtain(img, pixel_threshold, size_threshold=0):
+def obtain(img, pixel_threshold, size_threshold=0, *, labels=None):
     """
     Obtain clusters from image
 
     cluster is defined as a connected component of pixels >= pixel_threshold
 
     Args:
-      img (array): 2D array of float64
-      pixel_threshold (array): 1D array of thresholds (float64)
+      img (array): 2D array of uint8, uint16, float32, or float64
+      pixel_threshold (float): threshold in pixel value of img
       size_threshold (int): neglect clusters smaller than this
+      labels (array): [output] np.int32 label image; see Clusters
 
     Retuns: Clusters
 
@@ -147,6 +339,6 @@ def obtain(img, pixel_threshold, size_threshold=0):
 
     clusters = Clusters()
 
-    clusters.obtain(img, pixel_threshold, size_threshold)
+    clusters.obtain(img, pixel_threshold, size_threshold, labels=labels)
 
     return clusters
@@ -51,7 +51,7 @@ def load_header(set_type):
     return df_all
 
 
-def load(set_type, id_code, site):
+def load(set_type, id_code, site, *, dtype=np.float64):
     """
     Load image specified by the id_code
 
@@ -59,6 +59,8 @@ def load(set_type, id_code, site):
       set_type (str): train or test
       id_code (str): U2OS-03_4_O19  (or, can be a pd.Series with id_code)
       site (int): 1 or 2
+      dtype: np.float64 or np.float32 for pixel values in [0, 1];
+             np.uint8 for the 8-bit pixel values in the PNG files
 
     Returns:
       img (np.array): 6 x 512 x 512
@@ -84,12 +86,19 @@ def load(set_type, id_code, site):
 
     nc = 512
 
-    X = np.empty((6, nc, nc))
+    integer = np.issubdtype(dtype, np.integer)
+    if integer:
+        from PIL import Image
+
+    X = np.empty((6, nc, nc), dtype=dtype)
     for ichannel in range(6):
         filename = ('%s/%s/%s/Plate%s/%s_s%d_w%d.png' % (_data_dir,
                     set_type, batch, plate, well, site, ichannel + 1))
 
-        img = mpimg.imread(filename)
+        if integer:
+            img = np.asarray(Image.open(filename))
+        else:
+            img = mpimg.imread(filename)
         X[ichannel, :, :] = img[:, :]
 
     return X
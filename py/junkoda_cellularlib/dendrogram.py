@@ -0,0 +1,155 @@
+"""
+Class for the merge hierarchy of a watershed graph
+"""
+
+import numpy as np
+import pandas as pd
+import junkoda_cellularlib._cellularlib as c  # library in C++
+from .clusters import Clusters, _check_labels
+from .watershed_ncluster import _sorted_thresholds
+
+
+class Dendrogram:
+    """
+    Dendrogram(watershed=None, pixel_threshold=0.0, *, stats=None)
+
+    Merge hierarchy of the watershed graph for all edge thresholds, built
+    with one pass over the edges in descending order of value. Clusters of
+    Watershed.obtain_clusters for any edge_threshold, and the number of
+    clusters against edge threshold, are obtained without traversing the
+    graph again.
+
+    Node k < n_leaves is a leaf, the pixel leaf_pixels[k]; merge j is node
+    n_leaves + j, which joins nodes a[j] and b[j] at edge value[j] into a
+    cluster of size[j] pixels >= pixel_threshold. Merges are in descending
+    order of value.
+
+    Args:
+      watershed (Watershed): graph constructed with record_edges=True
+      pixel_threshold (float): pixels >= this are in the clusters; same as
+                               obtain_clusters
+      stats (dict): if given, instrumentation counters are set
+
+    Properties:
+      merges, leaf_pixels, nbytes
+      arrays are views of the C++ hierarchy without a copy
+
+    Methods:
+      nclusters(edge_thresholds, *, size_threshold=0)
+      obtain_clusters(edge_threshold, *, size_threshold=0, labels=None)
+    """
+    def __init__(self, watershed=None, pixel_threshold=0.0, *, stats=None):
+        self._dendrogram = c._dendrogram_alloc()
+        self.img = None
+
+        if watershed is not None:
+            self.construct(watershed, pixel_threshold, stats=stats)
+
+    def __repr__(self):
+        s = 'Dendrogram'
+        if self.img is not None:
+            s += '(%d %d), %d merges' % (self.img.shape[0],
+                                         self.img.shape[1], len(self))
+        return s
+
+    def __len__(self):
+        return len(c._dendrogram_get_merges(self._dendrogram)[0])
+
+    def construct(self, watershed, pixel_threshold=0.0, *, stats=None):
+        """
+        Construct the hierarchy of the edges of watershed
+
+        Args:
+          watershed (Watershed): constructed with record_edges=True
+          pixel_threshold (float)
+          stats (dict): if given, instrumentation counters are set
+        """
+        if watershed.img is None:
+            raise RuntimeError('Graph is not constructed yet')
+
+        c._dendrogram_construct(self._dendrogram, watershed._watershed,
+                                watershed.img, float(pixel_threshold),
+                                stats)
+        self.img = watershed.img
+        self.pixel_threshold = float(pixel_threshold)
+
+        return self
+
+    def _check(self):
+        if self.img is None:
+            raise RuntimeError('Dendrogram is not constructed yet')
+
+    @property
+    def merges(self):
+        """
+        Returns: merges (pd.DataFrame)
+          a, b:  children nodes
+          value: edge value of the merge
+          size:  number of pixels >= pixel_threshold in the merged cluster
+        """
+        self._check()
+        a, b, value, size = c._dendrogram_get_merges(self._dendrogram)
+        return pd.DataFrame({'a': a, 'b': b, 'value': value, 'size': size})
+
+    @property
+    def leaf_pixels(self):
+        """
+        Returns: pixel index of each leaf (int array); index = ix * ny + iy
+        """
+        self._check()
+        return c._dendrogram_get_leaf_pixels(self._dendrogram)
+
+    @property
+    def nbytes(self):
+        """
+        Returns: heap memory owned by the C++ dendrogram in bytes
+        """
+        return c._dendrogram_nbytes(self._dendrogram)
+
+    def nclusters(self, edge_thresholds, *, size_threshold=0):
+        """
+        Number of clusters of obtain_clusters for given edge thresholds
+
+        Args:
+          edge_thresholds (array): 1D array of thresholds in edge values
+          size_threshold (int): count clusters larger or equal than this
+
+        Returns: edge_thresholds, nclusters
+          edge_thresholds: array of thresholds (sorted, decreasing)
+          nclusters:  number of clusters for the threshold at same index
+        """
+        self._check()
+        thresholds = _sorted_thresholds(edge_thresholds, self.img.dtype)
+        nclusters = np.zeros(len(thresholds), dtype=int)
+
+        c._dendrogram_count_clusters(self._dendrogram, thresholds,
+                                     nclusters, int(size_threshold))
+
+        return thresholds, nclusters
+
+    def obtain_clusters(self, edge_threshold, *, size_threshold=0,
+                        labels=None):
+        """
+        Same clusters as Watershed.obtain_clusters with the pixel_threshold
+        of the construction, in the same order; pixels and edges of a
+        cluster are in the order of the hierarchy
+
+        Args:
+          edge_threshold (float): edge.value >= is used
+          size_threshold (int): cluster size >= is added to clusters
+          labels (array): [output] np.int32 array of the image shape;
+                          see Watershed.obtain_clusters
+
+        Returns:
+          clusters (Clusters)
+        """
+        self._check()
+        _check_labels(labels, self.img.shape)
+
+        clusters = Clusters()
+        c._dendrogram_obtain_clusters(self._dendrogram,
+                                      float(edge_threshold),
+                                      int(size_threshold),
+                                      clusters._clusters, labels)
+
+        return clusters
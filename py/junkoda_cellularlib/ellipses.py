@@ -6,16 +6,18 @@ import numpy as np
 import junkoda_cellularlib._cellularlib as c  # library in C++
 
 
-def obtain(img, pixel_threshold, size_threshold=0):
+def obtain(img, pixel_threshold, size_threshold=0, *, weighted=False):
     """
     Obtain ellipse parameters for clusters
 
     cluster is defined as a connected component of pixels >= pixel_threshold
 
     Args:
-      img (array): 2D array of float64
-      pixel_threshold (array): 1D array of thresholds (float64)
+      img (array): 2D array of uint8, uint16, float32, or float64
+      pixel_threshold (float): threshold in pixel value of img
       size_threshold (int): neglect clusters smaller than this
+      weighted (bool): centre and axes of the moments weighted by pixel
+                       values; pixel values must be positive
 
     Retuns: a (np.array)
       a[:, 0]  size: number of pixels in the cluster
@@ -23,7 +25,8 @@ def obtain(img, pixel_threshold, size_threshold=0):
       a[:, 2]  y
       a[:, 3]  a: semi-major axis; a^2 is the eigen value of cov
       a[:, 4]  b: semi-minor axis; b^2 is the eigen value of cov (a >= b)
-      a[:, 5]  theta: angle between major axis and x axis in radians [-pi, pi]
+      a[:, 5]  theta: angle between major axis and x axis in radians
+                      [-pi/2, pi/2]
 
     Exception:
       TypeError
@@ -34,12 +37,50 @@ def obtain(img, pixel_threshold, size_threshold=0):
         raise TypeError('Expeceted a 2-dimensional array for img: '
                         '%d' % img.ndim)
 
-    es = c._ellipses_obtain(img, float(pixel_threshold), int(size_threshold))
+    es = c._ellipses_obtain(img, float(pixel_threshold), int(size_threshold),
+                            int(weighted))
     assert(len(es) % 6 == 0)
 
     return es.reshape(-1, 6)
 
 
+def obtain_batch(imgs, pixel_threshold, size_threshold=0, *,
+                 weighted=False):
+    """
+    Obtain ellipse parameters for clusters in many images on the C++
+    thread pool
+
+    Args:
+      imgs (array): 3D array of uint8, uint16, float32, or float64;
+                    imgs[i] is the ith image,
+                    e.g., 6 x 512 x 512 array of data.load
+      pixel_threshold (float or array): threshold for all images or
+                                        for each image
+      size_threshold (int): neglect clusters smaller than this
+      weighted (bool): same as obtain()
+
+    Retuns: a (np.array)
+      a[:, :6] same as obtain()
+      a[:, 6]  index of the image
+
+    Exception:
+      TypeError
+    """
+
+    if imgs.ndim != 3:
+        raise TypeError('Expeceted a 3-dimensional array for imgs: '
+                        '%d' % imgs.ndim)
+
+    thresholds = np.empty(imgs.shape[0])
+    thresholds[:] = pixel_threshold
+
+    es = c._ellipses_obtain_batch(imgs, thresholds, int(size_threshold),
+                                  int(weighted))
+    assert(len(es) % 7 == 0)
+
+    return es.reshape(-1, 7)
+
+
 def plot(es, img=None, *, axis_factor=2.0, **kwargs):
     """
     ellipses (array): output of ellipses.obtain()
@@ -0,0 +1,196 @@
+"""
+Class for max-tree (component tree) of an image
+"""
+
+import numpy as np
+import junkoda_cellularlib._cellularlib as c  # library in C++
+from .watershed_ncluster import _sorted_thresholds
+
+
+class MaxTree:
+    """
+    MaxTree(img=None, *, stats=None)
+
+    Tree of connected components of pixels >= threshold for all thresholds,
+    built with one sort and one flood of the image. Threshold-dependent
+    queries, e.g., number of clusters or nuclei, do not flood the image
+    again.
+
+    Node k is a connected component of pixels >= level[k]; it is a cluster
+    for thresholds in (level[parent[k]], level[k]]. Nodes are in root-first
+    order; node 0 is the whole image and parent[k] < k.
+
+    Args:
+      img (array): 2D array of uint8, uint16, float32, or float64
+      stats (dict): if given, instrumentation counters are set
+
+    Properties:
+      parent, level, area, offset, pixels, nbytes
+      arrays are views of the C++ tree without a copy; they stay valid
+      after the tree is constructed again or deleted
+
+    Methods:
+      node_pixels(k)
+      nclusters(thresholds=None, *, size_threshold=0)
+      select_nodes(size_min, size_max, thresholds=None)
+      nuclei_mask(size_min, size_max, thresholds=None)
+    """
+    def __init__(self, img=None, *, stats=None):
+        self._max_tree = c._max_tree_alloc()
+        self.img = None
+
+        if img is not None:
+            self.construct(img, stats=stats)
+
+    def __repr__(self):
+        s = 'MaxTree'
+        if self.img is not None:
+            s += '(%d %d), %d nodes' % (self.img.shape[0], self.img.shape[1],
+                                        len(self))
+        return s
+
+    def __len__(self):
+        return c._max_tree_len(self._max_tree)
+
+    def construct(self, img, *, stats=None):
+        """
+        Construct the max-tree
+
+        Args:
+          img (array): 2D array of uint8, uint16, float32, or float64
+          stats (dict): if given, instrumentation counters are set
+        """
+        if img.ndim != 2:
+            raise TypeError('Expeceted a 2-dimensional array for img: '
+                            '%d' % img.ndim)
+
+        c._max_tree_construct(self._max_tree, img, stats)
+        self.img = img
+
+        return self
+
+    def _check(self):
+        if self.img is None:
+            raise RuntimeError('Max-tree is not constructed yet')
+
+    @property
+    def parent(self):
+        """
+        Returns: parent node (int array); -1 for the root
+        """
+        self._check()
+        return c._max_tree_get_nodes(self._max_tree)[0]
+
+    @property
+    def level(self):
+        """
+        Returns: pixel value of the node (float array)
+        """
+        self._check()
+        return c._max_tree_get_nodes(self._max_tree)[1]
+
+    @property
+    def area(self):
+        """
+        Returns: number of pixels in the subtree (int array)
+        """
+        self._check()
+        return c._max_tree_get_nodes(self._max_tree)[2]
+
+    @property
+    def offset(self):
+        """
+        Returns: offset of the subtree in pixels (int array)
+        """
+        self._check()
+        return c._max_tree_get_nodes(self._max_tree)[3]
+
+    @property
+    def pixels(self):
+        """
+        Returns: pixel indices (int array) in subtree order
+          pixels[offset[k]:(offset[k] + area[k])] are the pixels of node k
+        """
+        self._check()
+        return c._max_tree_get_pixels(self._max_tree)
+
+    @property
+    def nbytes(self):
+        """
+        Returns: heap memory owned by the C++ max-tree in bytes
+        """
+        return c._max_tree_nbytes(self._max_tree)
+
+    def node_pixels(self, k):
+        """
+        Returns: pixel indices of node k (int array), i.e., the cluster
+                 that contains them; index = ix * ny + iy
+        """
+        offset = self.offset[k]
+        return self.pixels[offset:(offset + self.area[k])]
+
+    def nclusters(self, thresholds=None, *, size_threshold=0):
+        """
+        Number of connected components of pixels >= threshold with size
+        >= size_threshold, for given array of thresholds, without flooding
+        the image again
+
+        This is the count of scipy.ndimage.label on img >= threshold.
+        compute_nclusters differs: it leaves nclusters[i] = 0 for a
+        threshold with no pixel in [thresholds[i], thresholds[i - 1]).
+
+        Args:
+          thresholds (array): 1D array of thresholds in pixel values
+                              default: same as compute_nclusters
+          size_threshold (int): count clusters larger or equal than this
+
+        Returns: thresholds, nclusters
+          thresholds: array of thresholds (sorted)
+          nclusters:  number of clusters for the threshold at same index
+        """
+        self._check()
+        thresholds = _sorted_thresholds(thresholds, self.img.dtype)
+        nclusters = np.zeros(len(thresholds), dtype=int)
+
+        c._max_tree_count_clusters(self._max_tree, thresholds, nclusters,
+                                   int(size_threshold))
+
+        return thresholds, nclusters
+
+    def select_nodes(self, size_min, size_max, thresholds=None):
+        """
+        Nodes with size_min <= area <= size_max that are a cluster for one of
+        the thresholds
+
+        Args:
+          thresholds (array): 1D array of thresholds; all levels if None
+
+        Returns:
+          nodes (int array)
+        """
+        self._check()
+        if thresholds is not None:
+            thresholds = _sorted_thresholds(thresholds, self.img.dtype)
+
+        return c._max_tree_select_nodes(self._max_tree, int(size_min),
+                                        int(size_max), thresholds)
+
+    def nuclei_mask(self, size_min, size_max, thresholds=None):
+        """
+        Pixels in a cluster with size_min <= size <= size_max for any of the
+        thresholds; cf. threshold.obtain_nuclei_pixels
+
+        Args:
+          thresholds (array): 1D array of thresholds; all levels if None
+
+        Returns:
+          nuclei (array of bool): nx x ny
+        """
+        nodes = self.select_nodes(size_min, size_max, thresholds)
+
+        nx, ny = self.img.shape
+        nuclei = np.zeros(nx * ny, dtype=bool)
+        c._max_tree_mark_pixels(self._max_tree, nodes.astype(np.int32),
+                                nuclei)
+
+        return nuclei.reshape(nx, ny)
@@ -0,0 +1,32 @@
+"""
+Heap memory used by the C++ kernels
+
+Working arrays of kernels are allocated with a counting allocator; for
+each kernel, the current and peak bytes over all threads, and the largest
+peak of one call are recorded. Memory kept in Watershed and Clusters
+objects is reported by their nbytes property.
+
+Functions:
+  kernels
+  reset_peak
+"""
+
+import junkoda_cellularlib._cellularlib as c  # library in C++
+
+
+def kernels():
+    """
+    Returns: dict {kernel name: dict}
+      current (int):   bytes in use now, over all threads
+      peak (int):      maximum of current since the last reset_peak()
+      call_peak (int): largest peak of one call since the last reset_peak()
+      calls (int):     number of calls
+    """
+    return c._memory_kernels()
+
+
+def reset_peak():
+    """
+    Set peak to current and call_peak to 0 for all kernels
+    """
+    c._memory_reset_peak()
@@ -6,14 +6,16 @@ import numpy as np
 import math
 
 from scipy import ndimage
-from .watershed_ncluster import compute_nclusters
+from .watershed_ncluster import compute_nclusters, compute_nclusters_batch
 from .ellipses import obtain
 
 
-def median_quarter_maximum_threshold(img):
+def median_quarter_maximum_threshold(img, *, stats=None):
     """
     Args:
-      img (np.array): 2D array of image, assuming value in [0, 1]
+      img (np.array): 2D array of image, value in [0, 1] for float or
+                      [0, 255] for uint8
+      stats (dict): if given, counters of compute_nclusters are set
 
     Median quatre maximum threshold
       median(threshold) for threshold > 0.25*max(ncluster),
@@ -27,9 +29,8 @@ def median_quarter_maximum_threshold(img):
     if img.ndim != 2:
         raise TypeError('Expected a 2-dimensional image')
 
-    thresholds = (0.5 + np.arange(255)) / 256
-    thresholds, nclusters = compute_nclusters(img,
-                                              thresholds, size_threshold=5)
+    thresholds, nclusters = compute_nclusters(img, size_threshold=5,
+                                              stats=stats)
 
     quarter_maximum = 0.25 * np.max(nclusters)
     idx = nclusters > quarter_maximum
@@ -40,7 +41,38 @@ def median_quarter_maximum_threshold(img):
     raise RuntimeError('No cluster found')
 
 
-def obtain_clips(img, n_clips, *, clip_size=128, threshold=None):
+def median_quarter_maximum_threshold_batch(imgs, *, stats=None):
+    """
+    median_quarter_maximum_threshold for many images on the C++ thread pool
+
+    Args:
+      imgs (np.array): 3D array; imgs[i] is the ith image
+      stats (dict): if given, counters of compute_nclusters_batch are set
+
+    Returns:
+      thresholds (np.array): threshold for each image; nan if no cluster
+                             exists in that image
+    """
+
+    if imgs.ndim != 3:
+        raise TypeError('Expected a 3-dimensional array')
+
+    thresholds, nclusters = compute_nclusters_batch(imgs, size_threshold=5,
+                                                    stats=stats)
+
+    quarter_maximum = 0.25 * np.max(nclusters, axis=0)
+    idx = nclusters > quarter_maximum
+
+    result = np.full(imgs.shape[0], np.nan)
+    for i in range(imgs.shape[0]):
+        if np.any(idx[:, i]):
+            result[i] = np.median(thresholds[idx[:, i]])
+
+    return result
+
+
+def obtain_clips(img, n_clips, *, clip_size=128, threshold=None,
+                 ellipses=None):
     """
     Return n_clips image clips centred on a cluster of nuclei.
     The major axis of the cluster is aligned with the x axis
@@ -48,6 +80,10 @@ def obtain_clips(img, n_clips, *, clip_size=128, threshold=None):
     Args:
       img (np.array): img[ix, iy, ichannel]
       n_clips (int):  number of maximum random clips in the output
+      threshold (float): pixel threshold of nuclei; default
+                         median_quarter_maximum_threshold
+      ellipses (np.array): ellipses.obtain(img[:, :, 0], threshold,
+                           size_threshold=5) if already computed
 
     Returns:
       clips[iclip, ix, iy, ichannel], ellipses[iclip, 3]
@@ -56,6 +92,11 @@ def obtain_clips(img, n_clips, *, clip_size=128, threshold=None):
         ellipses[:, 0]: x
         ellipses[:, 1]: y
         ellipses[:, 2]: theta, angle between major axis and x axis (degree)
+                        in [-90, 90]; the major axis has no direction, so
+                        a clip is aligned up to a rotation by 180 degrees.
+                        Older versions returned theta in [-90, 270], and
+                        their clip of the same cluster may be rotated by
+                        180 degrees from the present one
 
     Excption:
       RuntimeError: when no ellipse is found
@@ -65,10 +106,12 @@ def obtain_clips(img, n_clips, *, clip_size=128, threshold=None):
       The clips may overlap, but the centers is different
     """
 
-    if threshold is None:
-        threshold = median_quarter_maximum_threshold(img[:, :, 0])
+    if ellipses is None:
+        if threshold is None:
+            threshold = median_quarter_maximum_threshold(img[:, :, 0])
+
+        ellipses = obtain(img[:, :, 0], threshold, size_threshold=5)
 
-    ellipses = obtain(img[:, :, 0], threshold, size_threshold=5)
     n_ellipses = len(ellipses)
     if n_ellipses == 0:
         raise RuntimeError()
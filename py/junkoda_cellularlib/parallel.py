@@ -0,0 +1,30 @@
+"""
+Thread pool of the C++ library used by the batch functions
+
+The pool is the only source of threads in the library; the sort and
+labelling inside each image of a batch share it, so at most n threads run.
+
+Functions:
+  set_nthreads
+  get_nthreads
+"""
+
+import junkoda_cellularlib._cellularlib as c  # library in C++
+
+
+def set_nthreads(n):
+    """
+    Set the number of threads for batch functions and for the parallel
+    parts of single-image kernels
+
+    Args:
+      n (int): number of threads; number of cores if n <= 0
+    """
+    c._set_nthreads(int(n))
+
+
+def get_nthreads():
+    """
+    Returns: number of threads for batch functions
+    """
+    return c._get_nthreads()
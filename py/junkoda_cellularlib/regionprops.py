@@ -0,0 +1,93 @@
+"""
+Region properties of clusters in a multi-channel image
+"""
+
+import numpy as np
+import pandas as pd
+import junkoda_cellularlib._cellularlib as c  # library in C++
+from .clusters import Clusters
+
+_geometry_columns = ['size', 'x', 'y', 'ix_begin', 'ix_end',
+                     'iy_begin', 'iy_end', 'a', 'b', 'theta']
+_channel_columns = ['sum', 'mean', 'min', 'max', 'var']
+
+
+def obtain(stack, labels, pixel_threshold=None, *, size_threshold=0,
+           channel_names=None):
+    """
+    Properties of clusters for all channels of an image, computed in C++
+    with one pass over the pixels of each cluster
+
+    Args:
+      stack (array): 3D array of uint8, uint16, float32, or float64;
+                     n_channels x nx x ny, e.g., 6 x 512 x 512 array of
+                     data.load
+      labels: clusters, one of
+        Clusters: e.g., Clusters(img, pixel_threshold) or
+                  Watershed.obtain_clusters()
+        2D array of bool: nuclei mask, e.g.,
+                          threshold.obtain_nuclei_pixels;
+                          connected components of the mask
+        2D array: connected components of pixels >= pixel_threshold,
+                  e.g., stack[0]
+      pixel_threshold (float): threshold for a 2D array labels
+      size_threshold (int): neglect clusters smaller than this for 2D
+                            array labels
+      channel_names (list): channel names in the columns;
+                            default 0, 1, 2, ...
+
+    Returns: table (pd.DataFrame), one row per cluster in the order of
+             the clusters
+      size: number of pixels
+      x, y: centre of the pixel positions
+      ix_begin, ix_end, iy_begin, iy_end: bounding box; end is exclusive
+      a, b, theta: ellipse of the pixel positions; same as
+                   ellipses.obtain
+      sum_<ch>, mean_<ch>, min_<ch>, max_<ch>, var_<ch>:
+        pixel values of channel ch; var is the population variance
+
+    Exception:
+      TypeError, ValueError
+    """
+
+    if stack.ndim != 3:
+        raise TypeError('Expeceted a 3-dimensional array for stack: '
+                        '%d' % stack.ndim)
+
+    if not isinstance(labels, Clusters):
+        if labels.ndim != 2:
+            raise TypeError('Expeceted a 2-dimensional array for labels: '
+                            '%d' % labels.ndim)
+
+        if labels.dtype == bool:
+            labels = Clusters(labels.view(np.uint8), 1,
+                              size_threshold=size_threshold, runs=True)
+        elif pixel_threshold is None:
+            raise ValueError('pixel_threshold is required for an image')
+        else:
+            labels = Clusters(labels, pixel_threshold,
+                              size_threshold=size_threshold, runs=True)
+
+    nc = stack.shape[0]
+    if channel_names is None:
+        channel_names = list(range(nc))
+    elif len(channel_names) != nc:
+        raise ValueError('Number of channel_names %d != number of channels '
+                         '%d' % (len(channel_names), nc))
+
+    # Clusters() that is not obtained has no image; shape (0, 0)
+    nx, ny = labels.shape
+    if stack.shape[1:] != (nx, ny) and (len(labels) > 0 or nx > 0):
+        raise ValueError('Image size of stack (%d, %d) != clusters '
+                         '(%d, %d)' % (stack.shape[1], stack.shape[2],
+                                       nx, ny))
+
+    columns = list(_geometry_columns)
+    for name in channel_names:
+        columns += ['%s_%s' % (col, name) for col in _channel_columns]
+
+    table = np.empty((len(columns), len(labels)))
+    if len(labels) > 0:
+        c._regionprops_compute(labels._clusters, stack, table)
+
+    return pd.DataFrame(dict(zip(columns, table)))
@@ -6,9 +6,9 @@ Functions:
 """
 
 import numpy as np
-import numbers
 import junkoda_cellularlib._cellularlib as c  # library in C++
-from .watershed_ncluster import compute_nclusters
+from .watershed_ncluster import compute_nclusters, _sorted_thresholds
+from .clusters import _check_labels
 
 
 def median_quarter_maximum(img):
@@ -59,34 +59,53 @@ def mean2(img, *, iter=5):
     return m
 
 
-def obtain_nuclei_pixels(img, size_min, size_max, *, thresholds=None):
+def obtain_nuclei_pixels(img, size_min, size_max, *, thresholds=None,
+                         labels=None, stats=None):
+    """
+    Args:
+      labels (array): [output] np.int32 array of the image shape;
+                      0 for pixels not in nuclei and 1, 2, ... for
+                      nuclei in the order they are found
+      stats (dict): if given, instrumentation counters are set
+    """
     assert(img.ndim == 2)
-
-    img1D = img.flatten()
-    arg_sort = np.argsort(img1D)
+    _check_labels(labels, img.shape)
 
     # Prepare thresholds
-    if thresholds is None:
-        thresholds = (0.5 + np.arange(255)) / 256
-    elif isinstance(thresholds, numbers.Real):
-        thresholds = np.array([float(thresholds), ])  # one number
-    elif not isinstance(thresholds, np.ndarray):
-        thresholds = np.array(thresholds)             # e.g., list, tuple
-    else:
-        thresholds = thresholds.copy()
-
-    thresholds.sort()
-    thresholds = thresholds[::-1]
-
-    if thresholds.ndim != 1:
-        raise TypeError('Expected an 1-dimensional array for tresholds: '
-                        '%d' % thresholds.ndim)
+    thresholds = _sorted_thresholds(thresholds, img.dtype)
 
     # Ouput array
-    n = len(img1D)
+    n = img.shape[0] * img.shape[1]
     nuclei = np.zeros(n, dtype=bool)
 
-    c._watershed_nuclei_obtain(img, arg_sort, thresholds,
-                               size_min, size_max, nuclei)
+    c._watershed_nuclei_obtain(img, thresholds,
+                               size_min, size_max, nuclei, stats, labels)
 
     return nuclei.reshape(img.shape[0], img.shape[1])
+
+
+def obtain_nuclei_pixels_batch(imgs, size_min, size_max, *, thresholds=None):
+    """
+    obtain_nuclei_pixels for many images on the C++ thread pool
+
+    Args:
+      imgs (array): 3D array of uint8, uint16, float32, or float64;
+                    imgs[i] is the ith image
+
+    Returns:
+      nuclei (array of bool): N x nx x ny
+    """
+    if imgs.ndim != 3:
+        raise TypeError('Expeceted a 3-dimensional array for imgs: '
+                        '%d' % imgs.ndim)
+
+    thresholds = _sorted_thresholds(thresholds, imgs.dtype)
+
+    # Ouput array
+    n_imgs, nx, ny = imgs.shape
+    nuclei = np.zeros((n_imgs, nx * ny), dtype=bool)
+
+    c._watershed_nuclei_obtain_batch(imgs, thresholds,
+                                     size_min, size_max, nuclei)
+
+    return nuclei.reshape(n_imgs, nx, ny)
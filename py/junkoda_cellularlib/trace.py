@@ -0,0 +1,47 @@
+"""
+Timeline of C++ kernel calls in Chrome trace format
+
+Spans of buffer acquisition, sort, flood, cluster extraction, numpy export,
+and reacquiring the GIL are recorded for each thread, and written as JSON
+that can be opened in chrome://tracing or https://ui.perfetto.dev.
+
+Tracing is also enabled by the environment variable
+  JUNKODA_CELLULARLIB_TRACE=<filename>
+in which case the trace is written at exit.
+
+Functions:
+  start
+  stop
+  flush
+
+Example:
+  trace.start('trace.json')
+  ...
+  trace.stop()
+"""
+
+import junkoda_cellularlib._cellularlib as c  # library in C++
+
+
+def start(filename):
+    """
+    Start recording; spans recorded before are discarded
+
+    Args:
+      filename (str): output JSON file written by stop() or flush()
+    """
+    c._trace_start(str(filename))
+
+
+def stop():
+    """
+    Stop recording and write the trace file
+    """
+    c._trace_stop()
+
+
+def flush():
+    """
+    Write the spans recorded so far and continue recording
+    """
+    c._trace_flush()
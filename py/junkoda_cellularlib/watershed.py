@@ -5,41 +5,57 @@ Class for watershed analysis
 import numpy as np
 import pandas as pd
 import junkoda_cellularlib._cellularlib as c  # library in C++
-from .clusters import Clusters
+from .clusters import Clusters, _check_labels
 from .graph import Graph
 
 
 class Watershed:
     """
-    Watershed(img=None, pixel_theshold=0.0, merge_threshold=-1)
+    Watershed(img=None, pixel_theshold=0.0, merge_threshold=-1,
+              persistence_threshold=None, record_edges=True)
 
     Args:
-      img (array):             2D array of float64
+      img (array):             2D array of uint8, uint16, float32,
+                               or float64
       pixel_threshold (float): construct graph for pixels above
       merge_threshold (int):   do not merge two large clusters above this size
                                no such threshold if -1
+      persistence_threshold (float): do not merge two clusters if the lower
+                               top is higher than the saddle pixel by this
+                               or more; no such threshold if None
       seed_random_direction (int): use random first edge while graph
                                contruction with this seed; no randomness if 0.
+      record_edges (bool):     if False, only cluster_sizes() is available;
+                               faster and uses less memory
+      stats (dict):            if given, instrumentation counters of graph
+                               construction are set
 
     Methods:
       edges
+      persistence
+      nbytes
 
       plot.edges(idx=None, *, color='black', cmap=None, vmin, vmax)
       obtain_graph()
       obtain_clusters(pixel_threshold=0.0,
                       edge_threshold=None,
                       size_threshold=0)
+      dendrogram(pixel_threshold=0.0)
     """
     def __init__(self, img=None, pixel_threshold=0.0, *,
                  merge_threshold=-1,
-                 seed_random_direction=0):
+                 persistence_threshold=None,
+                 seed_random_direction=0,
+                 record_edges=True, stats=None):
         self._watershed = c._watershed_alloc()
         self.img = None
         self.graph = None
 
         if img is not None:
             self.construct(img, pixel_threshold, merge_threshold,
-                           seed_random_direction)
+                           seed_random_direction, record_edges,
+                           persistence_threshold=persistence_threshold,
+                           stats=stats)
 
     def __repr__(self):
         s = 'Watershed'
@@ -51,16 +67,24 @@ class Watershed:
         return s
 
     def construct(self, img, pixel_threshold, merge_threshold,
-                  seed_random_direction):
+                  seed_random_direction, record_edges=True, *,
+                  persistence_threshold=None, stats=None):
         """
         Construct watershed graph
 
         Args:
-          img (array): 2D array of float64
+          img (array): 2D array of uint8, uint16, float32, or float64
           pixel_threshold
+          record_edges (bool): record graph edges
+          persistence_threshold (float): see Watershed; None for no
+                                         persistence criterion
+          stats (dict): if given, instrumentation counters are set
 
+        Note:
+          img is copied; the queries read pixel values from the copy, so
+          img can be modified afterwards.
         """
-        self.img = img
+        img_copy = np.array(img)
         self.pixel_threshold = float(pixel_threshold)
 
         if merge_threshold < 0:
@@ -68,18 +92,31 @@ class Watershed:
         else:
             self.merge_threshold = int(merge_threshold)
 
-        self.seed_random_direction = int(seed_random_direction)
+        if persistence_threshold is None:
+            self.persistence_threshold = float('inf')
+        else:
+            self.persistence_threshold = float(persistence_threshold)
 
-        img1D = img.flatten()
-        arg_sort = np.argsort(img1D)
+        self.seed_random_direction = int(seed_random_direction)
+        self.record_edges = bool(record_edges)
 
-        c._watershed_construct(self._watershed, img, arg_sort,
+        c._watershed_construct(self._watershed, img_copy,
                                self.pixel_threshold,
                                self.merge_threshold,
-                               self.seed_random_direction)
+                               self.persistence_threshold,
+                               self.seed_random_direction,
+                               int(self.record_edges), stats)
+        self.img = img_copy
 
         return self
 
+    @property
+    def nbytes(self):
+        """
+        Returns: heap memory owned by the C++ graph in bytes
+        """
+        return c._watershed_nbytes(self._watershed)
+
     @property
     def edges(self):
         """
@@ -90,6 +127,28 @@ class Watershed:
                              'index2': ei[:, 1],
                              'value': self.edge_values})
 
+    @property
+    def persistence(self):
+        """
+        Persistence table of the merges of clusters in graph construction;
+        at each merge the cluster with the lower top dies at the saddle.
+        Clusters that are never merged are not in the table.
+
+        Returns: persistence (pd.DataFrame)
+          top:   top pixel index of the cluster that died
+          birth: pixel value of the top
+          death: pixel value of the saddle pixel
+          persistence: birth - death
+        """
+        if self.img is None:
+            raise RuntimeError('Graph is not constructed yet')
+
+        top, birth, death = c._watershed_get_persistence(self._watershed)
+        return pd.DataFrame({'top': top,
+                             'birth': birth,
+                             'death': death,
+                             'persistence': birth - death})
+
     def obtain_graph(self):
         """
         Returns: graph (cellularlib.Graph)
@@ -106,6 +165,8 @@ class Watershed:
           edge_indices (int array): n_edges x 2
             e[i, 0]: index of lower pixel
             e[i, 1]: index of higher pixel
+          a view of the C++ edges without a copy, which stays valid after
+          the graph is constructed again or deleted
         """
         if self.img is None:
             raise RuntimeError('Graph is not constructed yet')
@@ -120,7 +181,7 @@ class Watershed:
         """
         if self.img is None:
             raise RuntimeError('Graph is not constructed yet')
-        return c._watershed_get_edge_values(self._watershed)
+        return c._watershed_get_edge_values(self._watershed, self.img)
 
     def cluster_sizes(self, *, pixel_threshold=0.0, size_threshold=0):
         """
@@ -137,14 +198,16 @@ class Watershed:
 
         if self.img is None:
             raise RuntimeError('Graph is not constructed yet')
-        return c._watershed_obtain_cluster_sizes(self._watershed,
+        return c._watershed_obtain_cluster_sizes(self._watershed, self.img,
                                                  float(pixel_threshold),
                                                  int(size_threshold))
 
     def obtain_clusters(self, *,
                         pixel_threshold=0.0,
                         edge_threshold=None,
-                        size_threshold=0):
+                        size_threshold=0,
+                        labels=None,
+                        stats=None):
         """
         Find connected components in the watershed grapch
 
@@ -152,6 +215,10 @@ class Watershed:
           pixel_threshold (float): pixel.value >= is added to vertex
           edge_threshold (float): edge.value >= is used
           size_threshold (int): cluster size >= is added to clusters
+          labels (array): [output] np.int32 array of the image shape;
+                          0 for pixels not in a cluster and k for pixels
+                          in clusters[k - 1]
+          stats (dict): if given, instrumentation counters are set
 
         Returns:
           clusters (Clusters)
@@ -167,15 +234,29 @@ class Watershed:
         if edge_threshold is None:
             edge_threshold = pixel_threshold
 
+        _check_labels(labels, self.img.shape)
+
         clusters = Clusters()
-        c._watershed_obtain_clusters(self._watershed,
+        c._watershed_obtain_clusters(self._watershed, self.img,
                                      float(pixel_threshold),
                                      float(edge_threshold),
                                      int(size_threshold),
-                                     clusters._clusters)
+                                     clusters._clusters, stats, labels)
 
         return clusters
 
+    def dendrogram(self, pixel_threshold=0.0, *, stats=None):
+        """
+        Merge hierarchy of the edges for all edge thresholds; use it
+        instead of calling obtain_clusters repeatedly with the same
+        pixel_threshold
+
+        Returns:
+          dendrogram (Dendrogram)
+        """
+        from .dendrogram import Dendrogram
+        return Dendrogram(self, pixel_threshold, stats=stats)
+
     def plot_edges(self, **kwargs):
         if self.graph is None:
             self.graph = self.obtain_graph()
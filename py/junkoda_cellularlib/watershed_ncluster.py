@@ -7,21 +7,61 @@ import numbers
 import junkoda_cellularlib._cellularlib as c  # library in C++
 
 
+def _sorted_thresholds(thresholds, dtype=np.float64):
+    """
+    Convert thresholds to an 1D float64 array in decreasing order
+
+    Args:
+      thresholds: None for default 255 thresholds, a real number, or
+                  list/tuple/array of numbers
+      dtype: pixel type of the image; thresholds are pixel values of
+             this type, e.g., 0 - 255 for uint8 and 0 - 1 for float
+    """
+    # convert thresholds to np.array if necessary
+    # `threshold` can be a real number or list/tuple of numbers
+    if thresholds is None:
+        thresholds = (0.5 + np.arange(255)) / 256
+        if np.issubdtype(dtype, np.integer):
+            thresholds *= np.iinfo(dtype).max + 1
+    elif isinstance(thresholds, numbers.Real):
+        thresholds = np.array([float(thresholds), ])  # one number
+    elif not isinstance(thresholds, np.ndarray):
+        thresholds = np.array(thresholds, dtype=float)  # e.g., list, tuple
+    else:
+        thresholds = thresholds.astype(float)
+
+    thresholds.sort()
+    thresholds = thresholds[::-1]
+
+    if thresholds.ndim != 1:
+        raise TypeError('Expected an 1-dimensional array for tresholds: '
+                        '%d' % thresholds.ndim)
+
+    return thresholds
+
+
 def compute_nclusters(img, thresholds=None, *,
-                      size_threshold=0, seed_random_direction=0):
+                      size_threshold=0, seed_random_direction=0,
+                      stats=None):
     """
     Compute the number of clusters for given array of thresholds
 
     Args:
-      img (array): 2D array of float64
-      thresholds (array): 1D array of thresholds (float64)
+      img (array): 2D array of uint8, uint16, float32, or float64
+      thresholds (array): 1D array of thresholds in pixel values
+                          default: 255 thresholds in [0, 1] for float
+                          and in [0, 256) for uint8
       size_threshold (int): count clusters larger or equal than this number
       seed_random_direction (int): introduce randomness in neighbour
                                    selection; no randomness with 0
+      stats (dict): if given, instrumentation counters are set
 
     Retuns: d (dict)
       d['thresholds']: array of thresholds (sorted)
-      d['nclusters']:  number of clusters for the threshold at same index
+      d['nclusters']:  number of clusters for the threshold at same index;
+                       0 if no pixel is in [thresholds[i],
+                       thresholds[i - 1]); see MaxTree.nclusters for the
+                       count at every threshold
 
     Exception:
       TypeError
@@ -32,23 +72,7 @@ def compute_nclusters(img, thresholds=None, *,
         raise TypeError('Expeceted a 2-dimensional array for img: '
                         '%d' % img.ndim)
 
-    # convert thresholds to np.array if necessary
-    # `threshold` can be a real number or list/tuple of numbers
-    if thresholds is None:
-        thresholds = (0.5 + np.arange(255)) / 256
-    elif isinstance(thresholds, numbers.Real):
-        thresholds = np.array([float(thresholds), ])  # one number
-    elif not isinstance(thresholds, np.ndarray):
-        thresholds = np.array(thresholds)             # e.g., list, tuple
-    else:
-        thresholds = thresholds.copy()
-
-    thresholds.sort()
-    thresholds = thresholds[::-1]
-
-    if thresholds.ndim != 1:
-        raise TypeError('Expected an 1-dimensional array for tresholds: '
-                        '%d' % thresholds.ndim)
+    thresholds = _sorted_thresholds(thresholds, img.dtype)
 
     # TODO: merge threshold can be an option
     # if merge_threshold < 0:
@@ -57,14 +81,51 @@ def compute_nclusters(img, thresholds=None, *,
     #    merge_threshold = int(merge_threshold)
     #
 
-    img1D = img.flatten()
-    arg_sort = np.argsort(img1D)
-
     # results
     nclusters = np.zeros(len(thresholds), dtype=int)
 
-    c._watershed_ncluster_compute(img, arg_sort,
-                                  thresholds, nclusters,
-                                  size_threshold, seed_random_direction)
+    c._watershed_ncluster_compute(img, thresholds, nclusters,
+                                  size_threshold, seed_random_direction,
+                                  stats)
+
+    return thresholds, nclusters
+
+
+def compute_nclusters_batch(imgs, thresholds=None, *,
+                            size_threshold=0, seed_random_direction=0,
+                            stats=None):
+    """
+    Compute the number of clusters for many images on the C++ thread pool
+
+    Args:
+      imgs (array): 3D array of uint8, uint16, float32, or float64;
+                    imgs[i] is the ith image,
+                    e.g., 6 x 512 x 512 array of data.load
+      thresholds, size_threshold, seed_random_direction:
+                    same as compute_nclusters
+      stats (dict): if given, instrumentation counters are set; added
+                    over the images, so seconds are the sum of the
+                    threads
+
+    Retuns: thresholds, nclusters
+      thresholds: array of thresholds (sorted)
+      nclusters:  n_thresholds x N array; nclusters[:, i] for imgs[i]
+
+    Exception:
+      TypeError
+    """
+
+    if imgs.ndim != 3:
+        raise TypeError('Expeceted a 3-dimensional array for imgs: '
+                        '%d' % imgs.ndim)
+
+    thresholds = _sorted_thresholds(thresholds, imgs.dtype)
+
+    # results
+    nclusters = np.zeros((len(thresholds), imgs.shape[0]), dtype=int)
+
+    c._watershed_ncluster_compute_batch(imgs, thresholds, nclusters.T,
+                                        size_threshold,
+                                        seed_random_direction, stats)
 
     return thresholds, nclusters
@@ -0,0 +1,554 @@
+//
+// Max-tree (component tree) of an image
+//
+// Construction follows the union-find algorithm of Berger et al. (2007):
+// pixels are added from the highest value and the tree root of each
+// neighbour cluster becomes a child of the new pixel; parent links are
+// then canonicalised so that all pixels of a node point to one canonical
+// pixel.
+//
+#include <vector>
+#include <utility>
+#include <cassert>
+
+#include "buffer.h"
+#include "np_array.h"
+#include "union_find.h"
+#include "pixel_order.h"
+#include "stats.h"
+#include "memory.h"
+#include "trace.h"
+#include "max_tree.h"
+
+using std::vector;
+
+//
+// static functions
+//
+
+// Python deconstructor
+static void py_max_tree_free(PyObject *obj);
+
+// Number of leading thresholds > x in decreasing buf_thresholds
+static int count_above(const Buffer<double>& buf_thresholds, const double x)
+{
+  int lo = 0;
+  int hi = static_cast<int>(buf_thresholds.shape[0]);
+
+  while(lo < hi) {
+    const int mid = (lo + hi)/2;
+    if(buf_thresholds(mid) > x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// Index range [begin, end) of decreasing thresholds in (lower, upper]
+static void threshold_range(const Buffer<double>& buf_thresholds,
+                            const double lower, const double upper,
+                            int& begin, int& end)
+{
+  begin = count_above(buf_thresholds, upper);
+  end = count_above(buf_thresholds, lower);
+}
+
+
+//
+// MaxTree members
+//
+MaxTree::MaxTree() :
+  _nx(0), _ny(0)
+{
+
+}
+
+template<typename T, typename Stats>
+void MaxTree::construct(const Buffer<T>& buf_img, Stats& stats)
+{
+  // Args:
+  //   buf_img (2D array): 2D image array of T
+  //   stats: NoStats or KernelStats
+  //
+  // Note:
+  //   Pure C++; called without the GIL
+  memory::Call call("max_tree");
+
+  const int nx = _nx = static_cast<int>(buf_img.shape[0]);
+  const int ny = _ny = static_cast<int>(buf_img.shape[1]);
+  const int n = nx*ny;
+
+  node_parent.clear();
+  node_level.clear();
+  node_area.clear();
+  node_offset.clear();
+  v_pixel.clear();
+  pixel_node.clear();
+
+  if(n == 0)
+    return;
+
+  auto value = [&buf_img, ny](const int index) {
+    return buf_img(index / ny, index % ny);
+  };
+
+  // pixel indices in ascending pixel value
+  stats.begin_phase();
+  memory::vector<int> v_order;
+  pixel_order::compute(buf_img, v_order);
+  stats.end_phase("sort");
+
+  // Define neighbour pixel
+  const int dx_list[] = {1, -1, 0, 0}; // right, left, up, down
+  const int dy_list[] = {0,  0, -1, 1};
+
+  stats.begin_phase();
+
+  // Parent pixel in the tree; the top pixel of a cluster, the last pixel
+  // added, is the root of the tree of that cluster
+  memory::vector<int> v_parent(n);
+  {
+    UnionFind uf(n);
+
+    for(int i=n-1; i>=0; --i) {
+      const int index1 = v_order[i];
+      const int ix1 = index1 / ny;
+      const int iy1 = index1 % ny;
+
+      uf.add(index1);
+      v_parent[index1] = index1;
+      int the_cluster = index1;
+
+      for(int j=0; j<4; ++j) {
+        const int ix2 = ix1 + dx_list[j];
+        const int iy2 = iy1 + dy_list[j];
+
+        if(!(0 <= ix2 && ix2 < nx && 0 <= iy2 && iy2 < ny))
+          continue;  // Outside the image
+
+        const int index2 = ix2*ny + iy2;
+        if(!uf.contains(index2))
+          continue;  // This neighbour is not obove waterlevel yet.
+
+        const int nbr_cluster = uf.find(index2, stats);
+        if(nbr_cluster == the_cluster)
+          continue;
+
+        v_parent[uf.top(nbr_cluster)] = index1;
+        the_cluster = uf.unite(the_cluster, nbr_cluster, index1);
+        stats.merge();
+      }
+    }
+  }
+
+  stats.end_phase("flood");
+  stats.begin_phase();
+
+  // Canonicalise from the root; the canonical pixel of a node is the
+  // first pixel of the node in v_order, which is processed before the
+  // other pixels of the node
+  pixel_node.resize(n);
+
+  for(int i=0; i<n; ++i) {
+    const int p = v_order[i];
+    const int q = v_parent[p];
+
+    if(value(v_parent[q]) == value(q))
+      v_parent[p] = v_parent[q];
+
+    const int par = v_parent[p];
+
+    if(p == par || value(par) != value(p)) {
+      // p is canonical; a new node
+      const int k = static_cast<int>(node_parent.size());
+      pixel_node[p] = k;
+      node_parent.push_back(p == par ? -1 : pixel_node[par]);
+      node_level.push_back(static_cast<double>(value(p)));
+      stats.new_cluster();
+    }
+    else {
+      pixel_node[p] = pixel_node[par];
+    }
+  }
+
+  const int m = static_cast<int>(node_parent.size());
+
+  // Area, from the leaves
+  node_area.assign(m, 0);
+  for(int p=0; p<n; ++p)
+    node_area[pixel_node[p]]++;
+
+  for(int k=m-1; k>0; --k)
+    node_area[node_parent[k]] += node_area[k];
+
+  assert(node_area[0] == n);
+
+  // Subtree layout, from the root; all pixels at the level of a node come
+  // before the pixels of its children in v_order
+  node_offset.assign(m, 0);
+  memory::vector<int> cursor(m, 0);
+  v_pixel.resize(n);
+
+  for(int i=0; i<n; ++i) {
+    const int p = v_order[i];
+    const int k = pixel_node[p];
+
+    if(v_parent[p] == p || pixel_node[v_parent[p]] != k) {
+      // first pixel of node k
+      if(k > 0) {
+        const int parent = node_parent[k];
+        node_offset[k] = cursor[parent];
+        cursor[parent] += node_area[k];
+      }
+      cursor[k] = node_offset[k];
+    }
+
+    v_pixel[cursor[k]++] = p;
+  }
+
+  stats.end_phase("tree");
+}
+
+void MaxTree::count_clusters(const Buffer<double>& buf_thresholds,
+                             const int size_threshold,
+                             Buffer<long>& buf_nclusters) const
+{
+  // Node k with area >= size_threshold is one cluster for the thresholds
+  // in (level of parent, level of k]
+  const int n_thresholds = static_cast<int>(buf_thresholds.shape[0]);
+  assert(buf_nclusters.ndim == 1 &&
+         static_cast<int>(buf_nclusters.shape[0]) == n_thresholds);
+
+  memory::Call call("max_tree_count");
+  memory::vector<long> diff(n_thresholds + 1, 0);
+
+  const int m = n_nodes();
+  for(int k=0; k<m; ++k) {
+    if(node_area[k] < size_threshold)
+      continue;
+
+    int begin, end;
+    threshold_range(buf_thresholds, parent_level(k), node_level[k],
+                    begin, end);
+
+    if(begin < end) {
+      diff[begin]++;
+      diff[end]--;
+    }
+  }
+
+  long count = 0;
+  for(int i=0; i<n_thresholds; ++i) {
+    count += diff[i];
+    buf_nclusters(i) = count;
+  }
+}
+
+void MaxTree::select_nodes(const int size_min, const int size_max,
+                           Buffer<double> const * const buf_thresholds,
+                           vector<int>& v_nodes) const
+{
+  v_nodes.clear();
+
+  const int m = n_nodes();
+  for(int k=0; k<m; ++k) {
+    if(!(size_min <= node_area[k] && node_area[k] <= size_max))
+      continue;
+
+    if(buf_thresholds) {
+      int begin, end;
+      threshold_range(*buf_thresholds, parent_level(k), node_level[k],
+                      begin, end);
+      if(begin >= end)
+        continue;
+    }
+
+    v_nodes.push_back(k);
+  }
+}
+
+void MaxTree::mark_pixels(const vector<int>& v_nodes,
+                          Buffer<bool>& buf_mask) const
+{
+  // A pixel is marked if its node or an ancestor is in v_nodes
+  const int m = n_nodes();
+  const int n = static_cast<int>(pixel_node.size());
+  assert(buf_mask.ndim == 1 && static_cast<int>(buf_mask.shape[0]) == n);
+
+  memory::Call call("max_tree_mark");
+  memory::vector<bool> marked(m, false);
+
+  for(int k : v_nodes) {
+    assert(0 <= k && k < m);
+    marked[k] = true;
+  }
+
+  for(int k=1; k<m; ++k) {
+    if(marked[node_parent[k]])
+      marked[k] = true;
+  }
+
+  for(int p=0; p<n; ++p) {
+    if(marked[pixel_node[p]])
+      buf_mask(p) = true;
+  }
+}
+
+// explicit instantiation
+#define MAX_TREE_INSTANTIATE_STATS(T, S) \
+  template void MaxTree::construct(const Buffer<T>&, S&);
+#define MAX_TREE_INSTANTIATE(T) \
+  MAX_TREE_INSTANTIATE_STATS(T, NoStats) \
+  MAX_TREE_INSTANTIATE_STATS(T, KernelStats)
+
+MAX_TREE_INSTANTIATE(unsigned char)
+MAX_TREE_INSTANTIATE(unsigned short)
+MAX_TREE_INSTANTIATE(float)
+MAX_TREE_INSTANTIATE(double)
+
+#undef MAX_TREE_INSTANTIATE
+#undef MAX_TREE_INSTANTIATE_STATS
+
+
+//
+// Python interface
+//
+PyObject* py_max_tree_alloc(PyObject* self, PyObject* args)
+{
+  // _max_tree_alloc()
+  // Create a new max-tree object
+  MaxTree* const t = new MaxTree();
+
+  return PyCapsule_New(t, "_MaxTree", py_max_tree_free);
+}
+
+void py_max_tree_free(PyObject *obj)
+{
+  // Delete MaxTree object, called automatically by Python
+  MaxTree* const t = (MaxTree*) PyCapsule_GetPointer(obj, "_MaxTree");
+  assert(t);
+
+  t->retire_views();
+  delete t;
+}
+
+static MaxTree* get_max_tree(PyObject* py_max_tree)
+{
+  MaxTree* const t = (MaxTree*) PyCapsule_GetPointer(py_max_tree, "_MaxTree");
+  assert(t);
+
+  return t;
+}
+
+
+template<typename T>
+static void construct(MaxTree* const t, PyObject* const py_img,
+                      PyObject* const py_stats)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    t->construct(buf_img, stats);
+  });
+}
+
+PyObject* py_max_tree_construct(PyObject* self, PyObject* args)
+{
+  // _max_tree_construct(_max_tree, img, stats=None)
+  //   stats (dict): instrumentation counters are set if not None
+  trace::Span span("_max_tree_construct");
+  PyObject *py_max_tree, *py_img;
+  PyObject *py_stats = Py_None;
+  if(!PyArg_ParseTuple(args, "OO|O", &py_max_tree, &py_img, &py_stats)) {
+    return NULL;
+  }
+
+  MaxTree* const t = get_max_tree(py_max_tree);
+  t->retire_views();
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      construct<unsigned char>(t, py_img, py_stats);
+    else if(format == "H")
+      construct<unsigned short>(t, py_img, py_stats);
+    else if(format == "f")
+      construct<float>(t, py_img, py_stats);
+    else
+      construct<double>(t, py_img, py_stats);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_max_tree_len(PyObject* self, PyObject* args)
+{
+  // _max_tree_len(_max_tree)
+  // Returns: number of nodes
+  PyObject *py_max_tree;
+  if(!PyArg_ParseTuple(args, "O", &py_max_tree)) {
+    return NULL;
+  }
+
+  return Py_BuildValue("i", get_max_tree(py_max_tree)->n_nodes());
+}
+
+PyObject* py_max_tree_get_nodes(PyObject* self, PyObject* args)
+{
+  // _max_tree_get_nodes(_max_tree)
+  // Returns: views of arrays (parent, level, area, offset)
+  PyObject *py_max_tree;
+  if(!PyArg_ParseTuple(args, "O", &py_max_tree)) {
+    return NULL;
+  }
+
+  MaxTree* const t = get_max_tree(py_max_tree);
+  PyObject* const base = t->generation.base();
+
+  return Py_BuildValue("NNNN",
+                       np_array::view_from_vector(t->node_parent, base),
+                       np_array::view_from_vector(t->node_level, base),
+                       np_array::view_from_vector(t->node_area, base),
+                       np_array::view_from_vector(t->node_offset, base));
+}
+
+PyObject* py_max_tree_get_pixels(PyObject* self, PyObject* args)
+{
+  // _max_tree_get_pixels(_max_tree)
+  // Returns: view of pixel indices in subtree order
+  PyObject *py_max_tree;
+  if(!PyArg_ParseTuple(args, "O", &py_max_tree)) {
+    return NULL;
+  }
+
+  MaxTree* const t = get_max_tree(py_max_tree);
+  return np_array::view_from_vector(t->v_pixel, t->generation.base());
+}
+
+PyObject* py_max_tree_count_clusters(PyObject* self, PyObject* args)
+{
+  // _max_tree_count_clusters(_max_tree, thresholds, nclusters,
+  //                          size_threshold)
+  //   thresholds (array float64): decreasing thresholds
+  //   nclusters (array long): [output] number of clusters
+  trace::Span span("_max_tree_count_clusters");
+  PyObject *py_max_tree, *py_thresholds, *py_nclusters;
+  int size_threshold;
+  if(!PyArg_ParseTuple(args, "OOOi", &py_max_tree, &py_thresholds,
+                       &py_nclusters, &size_threshold)) {
+    return NULL;
+  }
+
+  MaxTree const * const t = get_max_tree(py_max_tree);
+
+  try {
+    Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+    Buffer<long> buf_nclusters(py_nclusters, "py_nclusters");
+
+    Py_BEGIN_ALLOW_THREADS
+    t->count_clusters(buf_thresholds, size_threshold, buf_nclusters);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_max_tree_select_nodes(PyObject* self, PyObject* args)
+{
+  // _max_tree_select_nodes(_max_tree, size_min, size_max, thresholds)
+  //   thresholds (array float64): decreasing thresholds, or None for
+  //                               all levels
+  // Returns: array of node indices
+  trace::Span span("_max_tree_select_nodes");
+  PyObject *py_max_tree, *py_thresholds;
+  int size_min, size_max;
+  if(!PyArg_ParseTuple(args, "OiiO", &py_max_tree, &size_min, &size_max,
+                       &py_thresholds)) {
+    return NULL;
+  }
+
+  MaxTree const * const t = get_max_tree(py_max_tree);
+  vector<int> v_nodes;
+
+  try {
+    Buffer<double> buf_thresholds;
+    if(py_thresholds != Py_None)
+      buf_thresholds.assign(py_thresholds);
+
+    Py_BEGIN_ALLOW_THREADS
+    t->select_nodes(size_min, size_max,
+                    py_thresholds == Py_None ? nullptr : &buf_thresholds,
+                    v_nodes);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  return np_array::move_from_vector(std::move(v_nodes));
+}
+
+PyObject* py_max_tree_mark_pixels(PyObject* self, PyObject* args)
+{
+  // _max_tree_mark_pixels(_max_tree, nodes, mask)
+  //   nodes (array int32): node indices
+  //   mask (array bool): [output] pixels in the subtrees are set True
+  trace::Span span("_max_tree_mark_pixels");
+  PyObject *py_max_tree, *py_nodes, *py_mask;
+  if(!PyArg_ParseTuple(args, "OOO", &py_max_tree, &py_nodes, &py_mask)) {
+    return NULL;
+  }
+
+  MaxTree const * const t = get_max_tree(py_max_tree);
+
+  try {
+    Buffer<int> buf_nodes(py_nodes, "py_nodes");
+    Buffer<bool> buf_mask(py_mask, "py_mask");
+
+    const int n_nodes = static_cast<int>(buf_nodes.shape[0]);
+    vector<int> v_nodes;
+    v_nodes.reserve(n_nodes);
+    for(int i=0; i<n_nodes; ++i) {
+      const int k = buf_nodes(i);
+      if(!(0 <= k && k < t->n_nodes())) {
+        PyErr_SetString(PyExc_IndexError, "node index out of range");
+        return NULL;
+      }
+      v_nodes.push_back(k);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    t->mark_pixels(v_nodes, buf_mask);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_max_tree_nbytes(PyObject* self, PyObject* args)
+{
+  // _max_tree_nbytes(_max_tree)
+  // Returns: heap memory owned by the max-tree object in bytes
+  PyObject *py_max_tree;
+  if(!PyArg_ParseTuple(args, "O", &py_max_tree)) {
+    return NULL;
+  }
+
+  return PyLong_FromSize_t(get_max_tree(py_max_tree)->nbytes());
+}
@@ -0,0 +1,97 @@
+#ifndef MAX_TREE_H
+#define MAX_TREE_H 1
+
+#include <vector>
+#include <limits>
+#include "Python.h"
+#include "buffer.h"
+#include "stats.h"
+#include "memory.h"
+#include "np_array.h"
+
+//
+// Max-tree (component tree) of an image
+//
+// A node is a connected component of pixels >= level, which is the cluster
+// for thresholds in (level of parent, level]. Nodes are in root-first
+// order, node 0 is the whole image and the parent of a node has a smaller
+// index. Pixels of the subtree of node k are
+//   v_pixel[node_offset[k]:(node_offset[k] + node_area[k])]
+// with the pixels at the level of the node first.
+//
+// Built once per image with one sort and one flood; threshold-dependent
+// queries do not flood the image again.
+//
+class MaxTree {
+ public:
+  MaxTree();
+  MaxTree(MaxTree const&) = delete;
+  MaxTree& operator=(MaxTree const&) = delete;
+
+  // T: unsigned char, unsigned short, float, or double
+  // Stats: NoStats or KernelStats (stats.h)
+  template<typename T, typename Stats>
+  void construct(const Buffer<T>& buf_img, Stats& stats);
+
+  // Number of clusters with size >= size_threshold for each threshold
+  //   buf_thresholds: in decreasing order
+  void count_clusters(const Buffer<double>& buf_thresholds,
+                      const int size_threshold,
+                      Buffer<long>& buf_nclusters) const;
+
+  // Nodes with area in [size_min, size_max] that are a cluster for one of
+  // the thresholds (decreasing); all levels if buf_thresholds is nullptr
+  void select_nodes(const int size_min, const int size_max,
+                    Buffer<double> const * const buf_thresholds,
+                    std::vector<int>& v_nodes) const;
+
+  // Mark the pixels of the subtrees of the nodes
+  void mark_pixels(const std::vector<int>& v_nodes,
+                   Buffer<bool>& buf_mask) const;
+
+  int n_nodes() const { return static_cast<int>(node_parent.size()); }
+
+  // Level of the parent node; -inf for the root
+  double parent_level(const int k) const {
+    return k == 0 ? -std::numeric_limits<double>::infinity() :
+                    node_level[node_parent[k]];
+  }
+
+  // Heap memory owned by this object
+  size_t nbytes() const {
+    return sizeof(MaxTree) + memory::nbytes(node_parent) +
+           memory::nbytes(node_level) + memory::nbytes(node_area) +
+           memory::nbytes(node_offset) + memory::nbytes(v_pixel) +
+           memory::nbytes(pixel_node);
+  }
+
+  // Hand the node arrays and v_pixel over to their numpy views, if any are
+  // alive, before the tree is reconstructed or freed; with the GIL
+  void retire_views() {
+    generation.retire(node_parent, node_level, node_area, node_offset,
+                      v_pixel);
+  }
+
+  int _nx, _ny;
+
+  std::vector<int> node_parent;    // parent node; -1 for the root
+  std::vector<double> node_level;  // pixel value of the node
+  std::vector<int> node_area;      // number of pixels in the subtree
+  std::vector<int> node_offset;    // subtree in v_pixel
+  std::vector<int> v_pixel;        // pixel indices in subtree order
+  std::vector<int> pixel_node;     // node that each pixel belongs to
+
+  np_array::Generation generation;  // of the exported views
+};
+
+
+PyObject* py_max_tree_alloc(PyObject* self, PyObject* args);
+PyObject* py_max_tree_construct(PyObject* self, PyObject* args);
+PyObject* py_max_tree_len(PyObject* self, PyObject* args);
+PyObject* py_max_tree_get_nodes(PyObject* self, PyObject* args);
+PyObject* py_max_tree_get_pixels(PyObject* self, PyObject* args);
+PyObject* py_max_tree_count_clusters(PyObject* self, PyObject* args);
+PyObject* py_max_tree_select_nodes(PyObject* self, PyObject* args);
+PyObject* py_max_tree_mark_pixels(PyObject* self, PyObject* args);
+PyObject* py_max_tree_nbytes(PyObject* self, PyObject* args);
+#endif
@@ -0,0 +1,130 @@
+//
+// Accounting of heap memory used by kernels
+//
+#include <string>
+#include <map>
+#include <mutex>
+
+#include "memory.h"
+
+namespace {
+
+std::mutex registry_mutex;
+std::map<std::string, memory::KernelAccount*> accounts; // never freed
+
+thread_local memory::Account* current_account = nullptr;
+
+// Steals the reference of py_value
+bool set_item(PyObject* const py_dict, char const * const key,
+              PyObject* const py_value)
+{
+  if(py_value == NULL)
+    return false;
+
+  const int ret = PyDict_SetItemString(py_dict, key, py_value);
+  Py_DECREF(py_value);
+
+  return ret == 0;
+}
+
+} // unnamed namespace
+
+
+namespace memory {
+
+KernelAccount& kernel(char const * const name)
+{
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  KernelAccount*& a = accounts[name];
+  if(a == nullptr)
+    a = new KernelAccount();
+
+  return *a;
+}
+
+Account* current()
+{
+  return current_account;
+}
+
+Call::Call(char const * const name) :
+  kernel_account(kernel(name)), account(&kernel_account.bytes),
+  previous(current_account)
+{
+  kernel_account.n_calls++;
+  current_account = &account;
+}
+
+Call::~Call()
+{
+  current_account = previous;
+
+  const size_t p = account.peak();
+  size_t q = kernel_account.call_peak.load();
+  while(p > q && !kernel_account.call_peak.compare_exchange_weak(q, p))
+    ;
+}
+
+
+//
+// Python interface
+//
+PyObject* py_kernels(PyObject* self, PyObject* args)
+{
+  // _memory_kernels()
+  // Returns:
+  //   dict {kernel name: {"current": bytes, "peak": bytes,
+  //                       "call_peak": bytes, "calls": int}}
+  //   current, peak: over all threads
+  //   call_peak: largest peak of one call
+  PyObject* const py_dict = PyDict_New();
+  if(py_dict == NULL)
+    return NULL;
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  for(const auto& p : accounts) {
+    const KernelAccount& a = *p.second;
+    PyObject* const py_kernel = PyDict_New();
+    if(py_kernel == NULL) {
+      Py_DECREF(py_dict);
+      return NULL;
+    }
+
+    const bool ok =
+      set_item(py_kernel, "current", PyLong_FromSize_t(a.bytes.current())) &&
+      set_item(py_kernel, "peak", PyLong_FromSize_t(a.bytes.peak())) &&
+      set_item(py_kernel, "call_peak", PyLong_FromSize_t(a.call_peak)) &&
+      set_item(py_kernel, "calls", PyLong_FromLong(a.n_calls));
+
+    if(!ok) {
+      Py_DECREF(py_kernel);
+      Py_DECREF(py_dict);
+      return NULL;
+    }
+
+    if(!set_item(py_dict, p.first.c_str(), py_kernel)) {
+      Py_DECREF(py_dict);
+      return NULL;
+    }
+  }
+
+  return py_dict;
+}
+
+PyObject* py_reset_peak(PyObject* self, PyObject* args)
+{
+  // _memory_reset_peak()
+  //   peak = current and call_peak = 0 for all kernels
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  for(const auto& p : accounts) {
+    p.second->bytes.reset_peak();
+    p.second->call_peak = 0;
+  }
+
+  Py_RETURN_NONE;
+}
+
+}
@@ -0,0 +1,151 @@
+#ifndef MEMORY_H
+#define MEMORY_H 1
+
+//
+// Accounting of heap memory used by kernels
+//
+// Working arrays of kernels are memory::vector or memory::deque, whose
+// allocator counts bytes to the memory::Call that was in scope when the
+// container was constructed in that thread. A Call adds its bytes to the
+// account of the kernel, which keeps the current and peak bytes over all
+// threads and the largest peak of one call. Containers constructed outside
+// a Call, e.g., members of the capsule objects, are not counted; the
+// capsules report their size with nbytes() instead.
+//
+// A Call must be declared before the containers of the kernel, so that it
+// outlives them.
+//
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+
+#include "Python.h"
+
+namespace memory {
+
+//
+// Current and peak bytes; bytes are also added to the parent account
+//
+class Account {
+ public:
+  explicit Account(Account* const parent_=nullptr) : parent(parent_) {}
+  Account(Account const&) = delete;
+  Account& operator=(Account const&) = delete;
+
+  void add(const size_t n) {
+    const size_t c = (n_current += n);
+    size_t p = n_peak.load();
+    while(c > p && !n_peak.compare_exchange_weak(p, c))
+      ;
+    if(parent)
+      parent->add(n);
+  }
+
+  void sub(const size_t n) {
+    n_current -= n;
+    if(parent)
+      parent->sub(n);
+  }
+
+  size_t current() const { return n_current.load(); }
+  size_t peak() const { return n_peak.load(); }
+  void reset_peak() { n_peak = n_current.load(); }
+
+ private:
+  Account* const parent;
+  std::atomic<size_t> n_current{0};
+  std::atomic<size_t> n_peak{0};
+};
+
+//
+// Account of one kernel over all calls
+//
+struct KernelAccount {
+  Account bytes;
+  std::atomic<size_t> call_peak{0};  // largest peak of a single call
+  std::atomic<long> n_calls{0};
+};
+
+// Account of the kernel; created at first use and never freed
+KernelAccount& kernel(char const * const name);
+
+// Account of the Call in scope of this thread; nullptr if none
+Account* current();
+
+//
+// Scope of one kernel call in this thread
+//
+class Call {
+ public:
+  explicit Call(char const * const name);
+  ~Call();
+  Call(Call const&) = delete;
+  Call& operator=(Call const&) = delete;
+
+ private:
+  KernelAccount& kernel_account;
+  Account account;
+  Account* const previous;
+};
+
+//
+// Allocator counting bytes to the account of the current Call
+//
+template<typename T>
+class Allocator {
+ public:
+  typedef T value_type;
+
+  Allocator() noexcept : account(current()) {}
+  template<typename U>
+  Allocator(const Allocator<U>& other) noexcept : account(other.account) {}
+
+  T* allocate(const size_t n) {
+    T* const p = std::allocator<T>().allocate(n);
+    if(account)
+      account->add(n*sizeof(T));
+    return p;
+  }
+
+  void deallocate(T* const p, const size_t n) noexcept {
+    if(account)
+      account->sub(n*sizeof(T));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  Account* account;
+};
+
+template<typename T, typename U>
+bool operator==(const Allocator<T>& a, const Allocator<U>& b) noexcept
+{
+  return a.account == b.account;
+}
+
+template<typename T, typename U>
+bool operator!=(const Allocator<T>& a, const Allocator<U>& b) noexcept
+{
+  return a.account != b.account;
+}
+
+template<typename T>
+using vector = std::vector<T, Allocator<T>>;
+
+template<typename T>
+using deque = std::deque<T, Allocator<T>>;
+
+// Bytes of the array owned by a vector
+template<typename V>
+size_t nbytes(const V& v)
+{
+  return v.capacity()*sizeof(typename V::value_type);
+}
+
+PyObject* py_kernels(PyObject* self, PyObject* args);
+PyObject* py_reset_peak(PyObject* self, PyObject* args);
+
+}
+
+#endif
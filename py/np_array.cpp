@@ -6,11 +6,14 @@
 #include "numpy/arrayobject.h"
 
 #include <vector>
+#include <memory>
 #include <typeinfo>
+#include <cassert>
 #include <type_traits>
 
 #include "error.h"
 #include "np_array.h"
+#include "trace.h"
 
 using std::vector;
 using std::string;
@@ -44,6 +47,7 @@ template<typename T> PyObject* copy_from_vector_template(const vector<T>& v)
   //   v <T>
   // Returns:
   //   numpy array of dtype T
+  trace::Span span("export");
   npy_intp len = static_cast<npy_intp>(v.size());
   
   PyObject* const py_arr = PyArray_SimpleNew(1, &len, dtype<T>());
@@ -56,20 +60,43 @@ template<typename T> PyObject* copy_from_vector_template(const vector<T>& v)
   return py_arr;
 }
 
+
+//
+// Make the array py_arr hold a reference to base
+//
+PyObject* set_base(PyObject* const py_arr, PyObject* const base)
+{
+  // Returns: py_arr, or NULL with the Python error set
+  if(py_arr == NULL || base == NULL) {
+    Py_XDECREF(py_arr);
+    return NULL;
+  }
+
+  Py_INCREF(base);  // stolen by PyArray_SetBaseObject, even on failure
+  if(PyArray_SetBaseObject((PyArrayObject*) py_arr, base) < 0) {
+    Py_DECREF(py_arr);
+    return NULL;
+  }
+
+  return py_arr;
+}
+
   
 //
 // Create an np.array pointing to exising memeory
 // 
 template<typename T>
-PyObject* view_from_vector_template(vector<T>& v)
+PyObject* view_from_vector_template(vector<T>& v, PyObject* const base)
 {
-  // Note: np.array would not work after vector v deallocated
+  // Note: the data of v must not be reallocated while base is alive
+  trace::Span span("export");
   const int ndim = 1;
   npy_intp len = static_cast<npy_intp>(v.size());
 
   npy_intp dims[]= {len};
 
-  return PyArray_SimpleNewFromData(ndim, dims, dtype<T>(), v.data());
+  return set_base(PyArray_SimpleNewFromData(ndim, dims, dtype<T>(),
+                                            v.data()), base);
 }
 
 
@@ -78,7 +105,8 @@ PyObject* view_from_vector_template(vector<T>& v)
 //  T: int/float/double
 template<typename T>
 PyObject* view_from_vector_struct_template(T* const p,
-               const int n, const int ncol, const size_t sizeof_struct)
+               const int n, const int ncol, const size_t sizeof_struct,
+               PyObject* const base)
 {
   // Return vector<S> as an np.array
   // Args:
@@ -86,6 +114,7 @@ PyObject* view_from_vector_struct_template(T* const p,
   //   n: length of the vector
   //   ncol: number of elements <T> to put in array
   //   sizeof_struct: sizeof<S>
+  //   base: object that keeps the data alive; see Generation
   //
   // Example:
   //   struct S {
@@ -96,8 +125,7 @@ PyObject* view_from_vector_struct_template(T* const p,
   // Provide a view as an n x 3 array
   // array_view_from_vector_struct<double>(v.front().x, 2, {v.size(), 3},
   // sizeof(S)}
-  //
-  // Note: np.array would not work after vector v deallocated
+  trace::Span span("export");
 
   int ndim = 2;
   if(ncol == 1)
@@ -108,11 +136,62 @@ PyObject* view_from_vector_struct_template(T* const p,
   npy_intp strides[]= {static_cast<npy_intp>(sizeof_struct),
                        sizeof(T)};
 
-  return PyArray_New(&PyArray_Type, ndim, dims, dtype<T>(), strides,
-                     p, 0, NPY_ARRAY_WRITEABLE, 0);
+  return set_base(PyArray_New(&PyArray_Type, ndim, dims, dtype<T>(),
+                              strides, p, 0, NPY_ARRAY_WRITEABLE, 0), base);
+}
+
+
+//
+// Buffers owned by the base object of their views; the vectors of a
+// retired generation, or of a result moved into numpy
+//
+struct Buffers {
+  vector<std::shared_ptr<void>> buffers;
+};
+
+void py_buffers_free(PyObject *obj)
+{
+  // Delete the buffers with the last view, called by Python
+  Buffers* const b = (Buffers*) PyCapsule_GetPointer(obj, "_Buffers");
+  assert(b);
+
+  delete b;
+}
+
+PyObject* new_buffers()
+{
+  // Returns: new base object owning no buffers, or NULL with the Python
+  //          error set
+  Buffers* const b = new Buffers();
+  PyObject* const base = PyCapsule_New(b, "_Buffers", py_buffers_free);
+  if(base == NULL)
+    delete b;
+
+  return base;
 }
 
 
+//
+// Hand the storage of v over to a new np.array
+//
+template<typename T>
+PyObject* move_from_vector_template(vector<T>&& v)
+{
+  // The array views the moved vector, owned by its base object; no copy
+  // and no allocation of array data
+  PyObject* const base = new_buffers();
+  if(base == NULL)
+    return NULL;
+
+  auto p = std::make_shared<vector<T>>(std::move(v));
+  ((Buffers*) PyCapsule_GetPointer(base, "_Buffers"))->buffers.push_back(p);
+
+  PyObject* const py_arr = view_from_vector_template(*p, base);
+  Py_DECREF(base);  // owned by the array
+
+  return py_arr;
+}
+
 } // unnamed namespace
 
 
@@ -171,58 +250,117 @@ PyObject* copy_from_vector(const vector<double>& v)
   return copy_from_vector_template<double>(v);
 }
 
+
+PyObject* move_from_vector(vector<int>&& v)
+{
+  return move_from_vector_template(std::move(v));
+}
+
+PyObject* move_from_vector(vector<long>&& v)
+{
+  return move_from_vector_template(std::move(v));
+}
+
+PyObject* move_from_vector(vector<double>&& v)
+{
+  return move_from_vector_template(std::move(v));
+}
+
 // Don't know how to do this correctly; not working.
 //template PyObject* array_from_vector<int>(const vector<int>& v);
 
 
   
 // array_vew_from_vector naive instantation
-PyObject* view_from_vector(vector<int>& v)
+PyObject* view_from_vector(vector<int>& v, PyObject* const base)
 {
-  return view_from_vector_template(v);
+  return view_from_vector_template(v, base);
 }
 
 
-PyObject* view_from_vector(vector<long>& v)
+PyObject* view_from_vector(vector<long>& v, PyObject* const base)
 {
-  return view_from_vector_template(v);
+  return view_from_vector_template(v, base);
 }
 
 
-PyObject* view_from_vector(vector<double>& v)
+PyObject* view_from_vector(vector<double>& v, PyObject* const base)
 {
-  return view_from_vector_template(v);
+  return view_from_vector_template(v, base);
 }
 
   
 
 PyObject* view_from_vector_struct(int* const p,
                                         const int n, const int ncol,
-                                        const size_t sizeof_struct)
+                                        const size_t sizeof_struct,
+                                        PyObject* const base)
 {
-  return view_from_vector_struct_template(p, n, ncol, sizeof_struct);
+  return view_from_vector_struct_template(p, n, ncol, sizeof_struct, base);
 }
 
 
 PyObject* view_from_vector_struct(long* const p,
                                         const int n, const int ncol,
-                                        const size_t sizeof_struct)
+                                        const size_t sizeof_struct,
+                                        PyObject* const base)
 {
-  return view_from_vector_struct_template(p, n, ncol, sizeof_struct);
+  return view_from_vector_struct_template(p, n, ncol, sizeof_struct, base);
 }
 
 PyObject* view_from_vector_struct(float* const p,
                                         const int n, const int ncol,
-                                        const size_t sizeof_struct)
+                                        const size_t sizeof_struct,
+                                        PyObject* const base)
 {
-  return view_from_vector_struct_template(p, n, ncol, sizeof_struct);
+  return view_from_vector_struct_template(p, n, ncol, sizeof_struct, base);
 }
 
 PyObject* view_from_vector_struct(double* const p,
                                         const int n, const int ncol,
-                                        const size_t sizeof_struct)
+                                        const size_t sizeof_struct,
+                                        PyObject* const base)
+{
+  return view_from_vector_struct_template(p, n, ncol, sizeof_struct, base);
+}
+
+
+//
+// Generation
+//
+Generation::~Generation()
+{
+  Py_XDECREF(base_);
+}
+
+PyObject* Generation::base()
+{
+  // Returns NULL with the Python error set if the allocation fails
+  if(base_ == nullptr)
+    base_ = new_buffers();
+
+  return base_;
+}
+
+bool Generation::views_alive() const
+{
+  // The generation holds one reference and each view one
+  return base_ != nullptr && Py_REFCNT(base_) > 1;
+}
+
+void Generation::adopt(std::shared_ptr<void> buffer)
+{
+  Buffers* const b = (Buffers*) PyCapsule_GetPointer(base_, "_Buffers");
+  assert(b);
+
+  b->buffers.push_back(std::move(buffer));
+}
+
+void Generation::next()
 {
-  return view_from_vector_struct_template(p, n, ncol, sizeof_struct);
+  // The views own the base object of the retired generation
+  Py_DECREF(base_);
+  base_ = nullptr;
 }
 
 } // namespace array
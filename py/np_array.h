@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <utility>
 #include "Python.h"
 
 namespace np_array {
@@ -20,18 +22,72 @@ PyObject* copy_from_vector(const std::vector<long>& v);
 PyObject* copy_from_vector(const std::vector<float>& v);
 PyObject* copy_from_vector(const std::vector<double>& v);
 
-PyObject* view_from_vector(std::vector<int>& v);
-PyObject* view_from_vector(std::vector<long>& v);
-PyObject* view_from_vector(std::vector<double>& v);
+// New array that takes over the storage of v without a copy; v is left
+// empty and its buffer is freed with the array
+PyObject* move_from_vector(std::vector<int>&& v);
+PyObject* move_from_vector(std::vector<long>&& v);
+PyObject* move_from_vector(std::vector<double>&& v);
+
+//
+// Generation of the buffers an object exports as numpy views
+//
+// A view holds a reference to base(), the base object of the current
+// generation. Before the owner reallocates or frees the exported vectors,
+// retire() moves them into the base object if views of the generation are
+// alive; the views keep the old buffers, the owner starts a new
+// generation with empty vectors, and the old buffers are freed with the
+// last view. Without live views retire() does nothing and the owner
+// reuses its buffers in place.
+//
+// Python API; call with the GIL
+//
+class Generation {
+ public:
+  Generation() : base_(nullptr) {}
+  Generation(Generation const&) = delete;
+  Generation& operator=(Generation const&) = delete;
+  ~Generation();
+
+  // Base object of the views of the current generation; borrowed
+  // reference
+  PyObject* base();
+
+  template<typename... Vectors>
+  void retire(Vectors&... v) {
+    if(!views_alive())
+      return;
+
+    int unpack[] = {(adopt(std::make_shared<Vectors>(std::move(v))), 0)...};
+    (void) unpack;
+    next();
+  }
+
+ private:
+  bool views_alive() const;
+  void adopt(std::shared_ptr<void> buffer);
+  void next();
+
+  PyObject* base_;
+};
+
+// Views of the vector data that keep base alive (PyArray_SetBaseObject);
+// base is typically Generation::base() of the owner of v
+PyObject* view_from_vector(std::vector<int>& v, PyObject* const base);
+PyObject* view_from_vector(std::vector<long>& v, PyObject* const base);
+PyObject* view_from_vector(std::vector<double>& v, PyObject* const base);
 
 PyObject* view_from_vector_struct(int* const p,
-                      const int n, const int ncol, const size_t sizeof_struct);
+                      const int n, const int ncol, const size_t sizeof_struct,
+                      PyObject* const base);
 PyObject* view_from_vector_struct(long* const p,
-                      const int n, const int ncol, const size_t sizeof_struct);
+                      const int n, const int ncol, const size_t sizeof_struct,
+                      PyObject* const base);
 PyObject* view_from_vector_struct(float* const p,
-                      const int n, const int ncol, const size_t sizeof_struct);
+                      const int n, const int ncol, const size_t sizeof_struct,
+                      PyObject* const base);
 PyObject* view_from_vector_struct(double* const p,
-                      const int n, const int ncol, const size_t sizeof_struct);
+                      const int n, const int ncol, const size_t sizeof_struct,
+                      PyObject* const base);
 } // namespace np_array
 
 #endif
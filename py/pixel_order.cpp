@@ -0,0 +1,273 @@
+//
+// Sort pixels by pixel value without comparisons
+//
+// uint8 images and images with at most 256 distinct values (8-bit PNG
+// in float) are sorted by one counting-sort pass over the levels; other
+// images are sorted by LSD radix sort on an order-preserving integer
+// key, skipping the bytes common to all pixels. Both are stable.
+//
+// Work arrays are memory::vector, counted to the kernel calling compute().
+//
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+#include "pixel_order.h"
+#include "thread_pool.h"
+
+using memory::vector;
+
+namespace {
+
+constexpr int n_levels_max = 256;
+
+//
+// Number of chunks for sorting n elements; at most the threads of the
+// shared pool, so that set_nthreads() bounds the sort
+//
+int nthreads_for(const size_t n)
+{
+  const size_t min_chunk = 1 << 16;
+  size_t nthreads = thread_pool::get()->nthreads();
+
+  nthreads = std::min(nthreads, n/min_chunk);
+
+  return std::max(static_cast<int>(nthreads), 1);
+}
+
+//
+// Apply f(ithread, begin, end) to nthreads consecutive chunks of [0, n)
+// on the shared pool; the pool also runs this from a batch worker
+//
+template<typename F>
+void parallel_chunks(const size_t n, const int nthreads, F f)
+{
+  if(nthreads <= 1) {
+    f(0, 0, n);
+    return;
+  }
+
+  thread_pool::get()->parallel_for(nthreads, [&](const int t) {
+    f(t, n*t/nthreads, n*(t + 1)/nthreads);
+  });
+}
+
+//
+// Stable counting sort of idx by digit(i) in [0, 256)
+//   digit(i): bucket of the ith element in the current order
+//   move(i, pos): move the ith element to position pos of the output
+//
+template<typename Digit, typename Move>
+void counting_pass(const size_t n, const int nthreads,
+                   Digit digit, Move move)
+{
+  // histogram per thread
+  vector<size_t> offset(nthreads*256, 0);
+
+  parallel_chunks(n, nthreads,
+    [&](const int t, const size_t begin, const size_t end) {
+      size_t* const hist = offset.data() + 256*t;
+      for(size_t i=begin; i<end; ++i)
+        hist[digit(i)]++;
+    });
+
+  // Starting position of each (digit, thread)
+  size_t sum = 0;
+  for(int b=0; b<256; ++b) {
+    for(int t=0; t<nthreads; ++t) {
+      size_t count = offset[256*t + b];
+      offset[256*t + b] = sum;
+      sum += count;
+    }
+  }
+  assert(sum == n);
+
+  parallel_chunks(n, nthreads,
+    [&](const int t, const size_t begin, const size_t end) {
+      size_t* const pos = offset.data() + 256*t;
+      for(size_t i=begin; i<end; ++i)
+        move(i, pos[digit(i)]++);
+    });
+}
+
+//
+// Map pixel value to uint64 preserving the order
+//
+inline uint64_t sort_key(const unsigned short x)
+{
+  return x;
+}
+
+inline uint64_t sort_key(double x)
+{
+  if(x == 0.0)
+    x = 0.0; // -0.0 is equal to 0.0
+
+  uint64_t u;
+  std::memcpy(&u, &x, sizeof(double));
+
+  const uint64_t sign = static_cast<uint64_t>(1) << 63;
+  return (u & sign) ? ~u : (u | sign);
+}
+
+inline uint64_t sort_key(const float x)
+{
+  return sort_key(static_cast<double>(x));
+}
+
+//
+// Sort with a counting sort if img has n_levels_max distinct values or less
+// Returns false otherwise
+//
+template<typename T>
+bool sort_levels(const vector<T>& v, vector<int>& v_order)
+{
+  const size_t n = v.size();
+
+  // Distinct pixel values in ascending order
+  vector<T> levels;
+  levels.reserve(n_levels_max + 1);
+
+  T last = 0;
+  bool has_last = false;
+
+  for(size_t i=0; i<n; ++i) {
+    const T x = v[i];
+    if(has_last && x == last)
+      continue;
+
+    auto p = std::lower_bound(levels.begin(), levels.end(), x);
+    if(p == levels.end() || *p != x) {
+      if(x != x)
+        return false; // NaN
+
+      levels.insert(p, x);
+      if(levels.size() > n_levels_max)
+        return false;
+    }
+    last = x;
+    has_last = true;
+  }
+
+  // Level index of each pixel
+  vector<unsigned char> v_level(n);
+  int ilast = 0;
+  last = levels[0];
+
+  for(size_t i=0; i<n; ++i) {
+    if(v[i] != last) {
+      last = v[i];
+      ilast = static_cast<int>(std::lower_bound(levels.begin(), levels.end(),
+                                                last) - levels.begin());
+    }
+    v_level[i] = static_cast<unsigned char>(ilast);
+  }
+
+  counting_pass(n, nthreads_for(n),
+                [&](const size_t i) { return v_level[i]; },
+                [&](const size_t i, const size_t pos) {
+                  v_order[pos] = static_cast<int>(i); });
+
+  return true;
+}
+
+//
+// LSD radix sort, 8 bits per pass
+//
+template<typename T>
+void sort_radix(const vector<T>& v, vector<int>& v_order)
+{
+  const size_t n = v.size();
+  const int nthreads = nthreads_for(n);
+
+  vector<uint64_t> keys(n), keys_out(n);
+  vector<int> idx(n), idx_out(n);
+
+  // Bits that are same for all keys
+  uint64_t bits_and = ~static_cast<uint64_t>(0);
+  uint64_t bits_or = 0;
+
+  for(size_t i=0; i<n; ++i) {
+    keys[i] = sort_key(v[i]);
+    idx[i] = static_cast<int>(i);
+    bits_and &= keys[i];
+    bits_or |= keys[i];
+  }
+
+  const uint64_t bits_vary = bits_and ^ bits_or;
+
+  for(int shift=0; shift<64; shift += 8) {
+    if(((bits_vary >> shift) & 0xff) == 0)
+      continue; // all keys have the same digit
+
+    counting_pass(n, nthreads,
+                  [&](const size_t i) { return (keys[i] >> shift) & 0xff; },
+                  [&](const size_t i, const size_t pos) {
+                    keys_out[pos] = keys[i];
+                    idx_out[pos] = idx[i]; });
+
+    keys.swap(keys_out);
+    idx.swap(idx_out);
+  }
+
+  v_order.swap(idx);
+}
+
+template<typename T>
+void sort(const vector<T>& v, vector<int>& v_order)
+{
+  if(!sort_levels(v, v_order))
+    sort_radix(v, v_order);
+}
+
+//
+// Counting sort of uint8 pixels
+//
+void sort(const vector<unsigned char>& v, vector<int>& v_order)
+{
+  counting_pass(v.size(), nthreads_for(v.size()),
+                [&](const size_t i) { return v[i]; },
+                [&](const size_t i, const size_t pos) {
+                  v_order[pos] = static_cast<int>(i); });
+}
+
+} // unnamed namespace
+
+
+namespace pixel_order {
+
+template<typename T>
+void compute(const Buffer<T>& buf_img, vector<int>& v_order)
+{
+  // Args:
+  //   buf_img: 2D image
+  //   v_order: [output] pixel indices in ascending pixel value
+  const int nx = static_cast<int>(buf_img.shape[0]);
+  const int ny = static_cast<int>(buf_img.shape[1]);
+  const size_t n = static_cast<size_t>(nx)*ny;
+
+  // Copy the pixel values in index order
+  vector<T> v;
+  v.reserve(n);
+  for(int ix=0; ix<nx; ++ix) {
+    for(int iy=0; iy<ny; ++iy) {
+      v.push_back(buf_img(ix, iy));
+    }
+  }
+
+  v_order.resize(n);
+  if(n == 0)
+    return;
+
+  sort(v, v_order);
+}
+
+// explicit instantiation
+template void compute(const Buffer<unsigned char>&, vector<int>&);
+template void compute(const Buffer<unsigned short>&, vector<int>&);
+template void compute(const Buffer<float>&, vector<int>&);
+template void compute(const Buffer<double>&, vector<int>&);
+
+}
@@ -0,0 +1,22 @@
+#ifndef PIXEL_ORDER_H
+#define PIXEL_ORDER_H 1
+
+//
+// Order of pixels in ascending pixel value; replaces np.argsort
+//
+// Pixel index is ix*ny + iy. Pixels with the same value are in the
+// order of index, i.e., same as np.argsort(img.flatten(), kind='stable').
+//
+
+#include "buffer.h"
+#include "memory.h"
+
+namespace pixel_order {
+
+// T: unsigned char, unsigned short, float, or double
+template<typename T>
+void compute(const Buffer<T>& buf_img, memory::vector<int>& v_order);
+
+}
+
+#endif
@@ -3,6 +3,9 @@
 #include <algorithm> 
 
 #include "np_array.h"
+#include "stats.h"
+#include "memory.h"
+#include "ccl.h"
 #include "py_clusters.h"
 
 //using namespace std;
@@ -15,39 +18,108 @@ using std::min;
 //
 static void py_clusters_free(PyObject *obj);
 
+// Set the labels of pixel indices [begin, end)
+static void fill_labels(Buffer<int>& buf_labels, const int ny,
+                        const int begin, const int end, const int label)
+{
+  int ix = begin / ny;
+  int iy = begin % ny;
+  for(int i=begin; i<end; ++i) {
+    buf_labels(ix, iy) = label;
+    if(++iy == ny) {
+      iy = 0;
+      ++ix;
+    }
+  }
+}
+
 //
 // Clusters
 //
 Clusters::Clusters() :
   _nx(0), _ny(0)
 {
+  clear();
+}
 
+void Clusters::clear()
+{
+  pixel_offset.assign(1, 0);
+  edge_offset.assign(1, 0);
+  run_offset.assign(1, 0);
+  v_pixel.clear();
+  v_edge_index.clear();
+  v_edge_value.clear();
+  v_run.clear();
+}
+
+void Clusters::retire_views()
+{
+  generation.retire(pixel_offset, edge_offset, run_offset, v_pixel,
+                    v_edge_index, v_edge_value, v_run);
+  clear();  // offsets of the new generation
+}
+
+size_t Clusters::cluster_size(const int k) const
+{
+  size_t n = pixel_offset[k + 1] - pixel_offset[k];
+  for(int j=run_offset[k]; j<run_offset[k + 1]; ++j)
+    n += v_run[j].size();
+  return n;
+}
+
+void Clusters::close_cluster()
+{
+  pixel_offset.push_back(static_cast<int>(v_pixel.size()));
+  edge_offset.push_back(static_cast<int>(v_edge_index.size()));
+  run_offset.push_back(static_cast<int>(v_run.size()));
+}
+
+void Clusters::discard_cluster()
+{
+  v_pixel.resize(pixel_offset.back());
+  v_edge_index.resize(edge_offset.back());
+  v_edge_value.resize(edge_offset.back());
+  v_run.resize(run_offset.back());
+}
+
+size_t Clusters::nbytes() const
+{
+  return sizeof(Clusters) + memory::nbytes(pixel_offset) +
+         memory::nbytes(edge_offset) + memory::nbytes(run_offset) +
+         memory::nbytes(v_pixel) + memory::nbytes(v_edge_index) +
+         memory::nbytes(v_edge_value) + memory::nbytes(v_run);
 }
 
 
 //
 // C++ code
 //
-void Clusters::construct(PyObject* const py_img,
+template<typename T, typename Stats>
+void Clusters::construct(const Buffer<T>& buf_img,
                          const double pixel_threshold,
-                         const int size_threshold)
+                         const int size_threshold,
+                         Stats& stats,
+                         Buffer<int>* const buf_labels)
 {
   /*
    * Args:
-   *   py_img (2D array float64): 2D image array
+   *   buf_img (2D array): 2D image array of T
    *   pixel_threshold: pixel value < are neglected
    *   size_threshold: cluster size < are neglected
-   *   
-   * Exceptions:
-   *   TypeError
+   *   stats: NoStats or KernelStats
+   *   buf_labels: [output] label image if not nullptr
+   *
+   * Note:
+   *   Pure C++; called without the GIL
    */
 
+  memory::Call call("clusters");
+
   // Remove existing cluster in this clusters
   clear();
+  stats.begin_phase();
 
-  // Buffer may throw Type error
-  Buffer<double> buf_img(py_img, "py_img");  // image/2D pixels;
-  
   // image size
   const int nx = _nx = static_cast<int>(buf_img.shape[0]);
   const int ny = _ny = static_cast<int>(buf_img.shape[1]);
@@ -60,36 +132,44 @@ void Clusters::construct(PyObject* const py_img,
   const int dy_list[] = {0,  0, -1, 1};
 
   // remember visited pixels
-  vector<bool> visited(n, false);
+  memory::vector<bool> visited(n, false);
 
   // queue of pixel indices in the same cluster
-  queue<int> q;
+  queue<int, memory::deque<int>> q;
 
   // Travers all pixels
   for(int index0=0; index0<n; ++index0) {
     int ix0 = index0 / ny;
     int iy0 = index0 % ny;
 
-    if(visited[index0] || buf_img(ix0, iy0) < pixel_threshold)
+    if(visited[index0])
       continue;
 
+    if(buf_img(ix0, iy0) < pixel_threshold) {
+      if(buf_labels)
+        (*buf_labels)(ix0, iy0) = 0;
+      continue;
+    }
+
     visited[index0] = true;
     assert(q.empty());
 
     // First pixel in a new cluster
     q.push(index0);
-    emplace_back();
-    Cluster& c = back();
+    const int label = static_cast<int>(size()) + 1;
+    stats.new_cluster();
 
     int sum = 0;
     while(!q.empty()) {
       int index1 = q.front(); q.pop();
       assert(0 <= index1 && index1 < n);
 
-      c.pixels.push_back(index1);
+      push_pixel(index1);
       int ix1 = index1 / ny;
       int iy1 = index1 % ny;
-      double f1 = buf_img(ix1, iy1);
+      double f1 = static_cast<double>(buf_img(ix1, iy1));
+      if(buf_labels)
+        (*buf_labels)(ix1, iy1) = label;
 
       ++sum;
       
@@ -97,29 +177,212 @@ void Clusters::construct(PyObject* const py_img,
       for(int j=0; j<4; ++j) {
         int ix2 = ix1 + dx_list[j];
         int iy2 = iy1 + dy_list[j];
-        double f2 = buf_img(ix2, iy2);
         
         if(!(0 <= ix2 && ix2 < nx && 0 <= iy2 && iy2 < ny))
           continue;  // Outside the image
 
         int index2 = ix2*ny + iy2;
+        double f2 = static_cast<double>(buf_img(ix2, iy2));
         if(visited[index2] || f2 < pixel_threshold)
           continue;
 
         // Add a connected pixel to the queue
         visited[index2] = true;
         q.push(index2);
-        c.edges.emplace_back(index1, index2, min(f1, f2));
+        stats.queue_length(q.size());
+        push_edge(index1, index2, min(f1, f2));
       }
     }
 
     if(sum < size_threshold) {
-      pop_back();
+      if(buf_labels) {
+        for(size_t j=pixel_offset.back(); j<v_pixel.size(); ++j)
+          (*buf_labels)(v_pixel[j] / ny, v_pixel[j] % ny) = 0;
+      }
+      discard_cluster();
       continue;
     }
+
+    close_cluster();
   } // goto to next pixel for a new cluster
+
+  stats.end_phase("bfs");
 }
 
+template<typename T, typename Stats>
+void Clusters::construct_parallel(const Buffer<T>& buf_img,
+                                  const double pixel_threshold,
+                                  const int size_threshold,
+                                  Stats& stats,
+                                  Buffer<int>* const buf_labels)
+{
+  // Same arguments as construct()
+  memory::Call call("clusters_parallel");
+
+  clear();
+  _nx = static_cast<int>(buf_img.shape[0]);
+  _ny = static_cast<int>(buf_img.shape[1]);
+
+  stats.begin_phase();
+  memory::vector<int> labels;
+  memory::vector<Edge> edges;
+  const int n_labels = ccl::label(buf_img, pixel_threshold, labels, &edges);
+  stats.end_phase("ccl");
+
+  stats.begin_phase();
+
+  // Component sizes
+  memory::vector<int> sizes(n_labels, 0);
+  for(const int l : labels) {
+    if(l >= 0)
+      sizes[l]++;
+  }
+
+  // Cluster index of each label; -1 for small components
+  memory::vector<int> cluster_index(n_labels);
+  int n_clusters = 0;
+  for(int l=0; l<n_labels; ++l)
+    cluster_index[l] = sizes[l] >= size_threshold ? n_clusters++ : -1;
+
+  // Offsets of the clusters; a spanning tree of a component of size s
+  // has s - 1 edges
+  for(int l=0; l<n_labels; ++l) {
+    if(cluster_index[l] >= 0) {
+      pixel_offset.push_back(pixel_offset.back() + sizes[l]);
+      edge_offset.push_back(edge_offset.back() + sizes[l] - 1);
+      run_offset.push_back(0);
+      stats.new_cluster();
+    }
+  }
+
+  // Scatter the pixels and edges to their clusters in index order
+  v_pixel.resize(pixel_offset.back());
+  v_edge_index.resize(edge_offset.back());
+  v_edge_value.resize(edge_offset.back());
+
+  memory::vector<int> next_pixel(pixel_offset.begin(), pixel_offset.end());
+  memory::vector<int> next_edge(edge_offset.begin(), edge_offset.end());
+
+  for(int ix=0; ix<_nx; ++ix) {
+    for(int iy=0; iy<_ny; ++iy) {
+      const int i = ix*_ny + iy;
+      const int l = labels[i];
+      const int k = l >= 0 ? cluster_index[l] : -1;
+      if(k >= 0)
+        v_pixel[next_pixel[k]++] = i;
+      if(buf_labels)
+        (*buf_labels)(ix, iy) = k + 1;
+    }
+  }
+
+  for(const Edge& e : edges) {
+    const int k = cluster_index[labels[e.index[0]]];
+    if(k >= 0) {
+      const int j = next_edge[k]++;
+      v_edge_index[j] = EdgeIndex(e.index[0], e.index[1]);
+      v_edge_value[j] = e.value;
+    }
+  }
+
+  stats.end_phase("extract");
+}
+
+template<typename T, typename Stats>
+void Clusters::construct_runs(const Buffer<T>& buf_img,
+                              const double pixel_threshold,
+                              const int size_threshold,
+                              Stats& stats,
+                              Buffer<int>* const buf_labels)
+{
+  // Same arguments as construct()
+  memory::Call call("clusters_runs");
+
+  clear();
+  _nx = static_cast<int>(buf_img.shape[0]);
+  _ny = static_cast<int>(buf_img.shape[1]);
+
+  stats.begin_phase();
+  memory::vector<ccl::Run> runs;
+  memory::vector<int> run_labels;
+  const int n_labels = ccl::label_runs(buf_img, pixel_threshold,
+                                       runs, run_labels);
+  stats.end_phase("ccl");
+
+  stats.begin_phase();
+
+  // Component sizes and the number of runs, accumulated per run
+  const int n_runs = static_cast<int>(runs.size());
+  memory::vector<int> sizes(n_labels, 0);
+  memory::vector<int> nruns(n_labels, 0);
+  for(int k=0; k<n_runs; ++k) {
+    sizes[run_labels[k]] += runs[k].size();
+    nruns[run_labels[k]]++;
+  }
+
+  // Cluster index of each label; -1 for small components
+  memory::vector<int> cluster_index(n_labels);
+  int n_clusters = 0;
+  for(int l=0; l<n_labels; ++l)
+    cluster_index[l] = sizes[l] >= size_threshold ? n_clusters++ : -1;
+
+  for(int l=0; l<n_labels; ++l) {
+    if(cluster_index[l] >= 0) {
+      pixel_offset.push_back(0);
+      edge_offset.push_back(0);
+      run_offset.push_back(run_offset.back() + nruns[l]);
+      stats.new_cluster();
+    }
+  }
+
+  v_run.resize(run_offset.back());
+  memory::vector<int> next_run(run_offset.begin(), run_offset.end());
+
+  // Runs are in index order; pixels between runs are labelled 0
+  const int ny = _ny;
+  int next = 0;  // first pixel index not labelled yet
+  for(int k=0; k<n_runs; ++k) {
+    const ccl::Run& r = runs[k];
+    const int i = cluster_index[run_labels[k]];
+    if(i >= 0)
+      v_run[next_run[i]++] = r;
+
+    if(buf_labels) {
+      const int begin = r.ix*ny + r.iy_begin;
+      fill_labels(*buf_labels, ny, next, begin, 0);
+      fill_labels(*buf_labels, ny, begin, begin + r.size(), i + 1);
+      next = begin + r.size();
+    }
+  }
+
+  if(buf_labels)
+    fill_labels(*buf_labels, ny, next, _nx*ny, 0);
+
+  stats.end_phase("extract");
+}
+
+// explicit instantiation
+#define CLUSTERS_INSTANTIATE_STATS(T, S) \
+  template void Clusters::construct(const Buffer<T>&, const double, \
+                                    const int, S&, Buffer<int>* const); \
+  template void Clusters::construct_parallel(const Buffer<T>&, \
+                                             const double, const int, S&, \
+                                             Buffer<int>* const); \
+  template void Clusters::construct_runs(const Buffer<T>&, \
+                                         const double, const int, S&, \
+                                         Buffer<int>* const);
+
+#define CLUSTERS_INSTANTIATE(T) \
+  CLUSTERS_INSTANTIATE_STATS(T, NoStats) \
+  CLUSTERS_INSTANTIATE_STATS(T, KernelStats)
+
+CLUSTERS_INSTANTIATE(unsigned char)
+CLUSTERS_INSTANTIATE(unsigned short)
+CLUSTERS_INSTANTIATE(float)
+CLUSTERS_INSTANTIATE(double)
+
+#undef CLUSTERS_INSTANTIATE
+#undef CLUSTERS_INSTANTIATE_STATS
+
 
 //
 // Python interface
@@ -137,6 +400,7 @@ void py_clusters_free(PyObject *obj)
   Clusters* const c = (Clusters*) PyCapsule_GetPointer(obj, "_Clusters");
   assert(c);
 
+  c->retire_views();
   delete c;
 }
 
@@ -154,47 +418,109 @@ PyObject* py_clusters_len(PyObject* self, PyObject* args)
   return Py_BuildValue("k", static_cast<unsigned long>(c->size()));
 }
 
-PyObject* py_clusters_get_cluster(PyObject* self, PyObject* args)
+PyObject* py_clusters_get_shape(PyObject* self, PyObject* args)
 {
+  // _clusters_get_shape(_clusters)
+  // Returns: (nx, ny), the image size
   PyObject *py_clusters;
-  int i;
-  if(!PyArg_ParseTuple(args, "Oi", &py_clusters, &i)) {
+  if(!PyArg_ParseTuple(args, "O", &py_clusters)) {
     return NULL;
   }
-  
-  Clusters * const clusters =
-    (Clusters*) PyCapsule_GetPointer(py_clusters, "_Clusters");
+
+  Clusters const * const clusters =
+    (Clusters const *) PyCapsule_GetPointer(py_clusters, "_Clusters");
   assert(clusters);
 
-  if(i < 0) {
-    i = static_cast<int>(clusters->size()) + i;
+  return Py_BuildValue("ii", clusters->_nx, clusters->_ny);
+}
+
+PyObject* py_clusters_get_arrays(PyObject* self, PyObject* args)
+{
+  // _clusters_get_arrays(_clusters)
+  // Returns: views of the CSR arrays of all clusters
+  //   (pixel_offset, pixels, edge_offset, edge_indices, edge_values,
+  //    run_offset, runs)
+  //   edge_indices: n_edges x 2 pixel indices of the end points
+  //   runs: n_runs x 3 (ix, iy_begin, iy_end)
+  PyObject *py_clusters;
+  if(!PyArg_ParseTuple(args, "O", &py_clusters)) {
+    return NULL;
   }
 
-  
-  try {
-    Cluster& cluster = clusters->at(i);  // may throw std::out_of_range
+  Clusters* const c =
+    (Clusters*) PyCapsule_GetPointer(py_clusters, "_Clusters");
+  assert(c);
 
+  const int n_edges = static_cast<int>(c->v_edge_index.size());
+  const int n_runs = static_cast<int>(c->v_run.size());
+  PyObject* const base = c->generation.base();
+
+  return Py_BuildValue("(NNNNNNN)",
+           np_array::view_from_vector(c->pixel_offset, base),
+           np_array::view_from_vector(c->v_pixel, base),
+           np_array::view_from_vector(c->edge_offset, base),
+           np_array::view_from_vector_struct(
+             reinterpret_cast<int*>(c->v_edge_index.data()), n_edges, 2,
+             sizeof(EdgeIndex), base),
+           np_array::view_from_vector(c->v_edge_value, base),
+           np_array::view_from_vector(c->run_offset, base),
+           np_array::view_from_vector_struct(
+             reinterpret_cast<int*>(c->v_run.data()), n_runs, 3,
+             sizeof(ccl::Run), base));
+}
 
-    return Py_BuildValue("Oii", PyCapsule_New(&cluster, "_Cluster", NULL),
-                       clusters->_nx, clusters->_ny);
-  }
-  catch(std::out_of_range& err) {
-    PyErr_SetNone(PyExc_IndexError);
-  }
 
-  return NULL;
+template<typename T>
+static void construct(Clusters* const c, PyObject* const py_img,
+                      const double pixel_threshold,
+                      const int size_threshold,
+                      const bool parallel,
+                      const bool runs,
+                      PyObject* const py_stats,
+                      PyObject* const py_labels)
+{
+  // Buffer may throw TypeError
+  Buffer<T> buf_img(py_img, "py_img");
+  Buffer<int> buf_labels;
+  if(py_labels != Py_None)
+    buf_labels.assign(py_labels);
+
+  Buffer<int>* const labels = py_labels == Py_None ? nullptr : &buf_labels;
+  assert(labels == nullptr || (buf_labels.ndim == 2 &&
+                               buf_labels.shape == buf_img.shape));
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    if(runs)
+      c->construct_runs(buf_img, pixel_threshold, size_threshold, stats,
+                        labels);
+    else if(parallel)
+      c->construct_parallel(buf_img, pixel_threshold, size_threshold, stats,
+                            labels);
+    else
+      c->construct(buf_img, pixel_threshold, size_threshold, stats, labels);
+  });
 }
 
-
 PyObject* py_clusters_obtain(PyObject* self, PyObject* args)
 {
-  // _clusters_obtain(img, pixel_threshold, size_threshold)
+  // _clusters_obtain(_clusters, img, pixel_threshold, size_threshold,
+  //                  stats=None, parallel=0, runs=0, labels=None)
+  //   stats (dict): instrumentation counters are set if not None
+  //   parallel (int): tile-parallel labelling if nonzero
+  //   runs (int): clusters of runs by scanline labelling if nonzero
+  //   labels (2D array int32): [output] label image if not None
+  trace::Span span("_clusters_obtain");
   PyObject *py_clusters;
   PyObject *py_img;
+  PyObject *py_stats = Py_None;
   double pixel_threshold;
   int size_threshold;
-  if(!PyArg_ParseTuple(args, "OOdi", &py_clusters, &py_img,
-                       &pixel_threshold, &size_threshold)) {
+  PyObject *py_labels = Py_None;
+  int parallel = 0;
+  int runs = 0;
+  if(!PyArg_ParseTuple(args, "OOdi|OiiO", &py_clusters, &py_img,
+                       &pixel_threshold, &size_threshold, &py_stats,
+                       &parallel, &runs, &py_labels)) {
     return NULL;
   }
   
@@ -202,8 +528,24 @@ PyObject* py_clusters_obtain(PyObject* self, PyObject* args)
     (Clusters*) PyCapsule_GetPointer(py_clusters, "_Clusters");
   assert(c);
 
+  c->retire_views();
+
   try {
-    c->construct(py_img, pixel_threshold, size_threshold);
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      construct<unsigned char>(c, py_img, pixel_threshold, size_threshold,
+                               parallel, runs, py_stats, py_labels);
+    else if(format == "H")
+      construct<unsigned short>(c, py_img, pixel_threshold, size_threshold,
+                                parallel, runs, py_stats, py_labels);
+    else if(format == "f")
+      construct<float>(c, py_img, pixel_threshold, size_threshold,
+                       parallel, runs, py_stats, py_labels);
+    else
+      construct<double>(c, py_img, pixel_threshold, size_threshold,
+                        parallel, runs, py_stats, py_labels);
   }
   catch (TypeError e) {
     return NULL;
@@ -232,79 +574,24 @@ PyObject* py_clusters_get_sizes(PyObject* self, PyObject* args)
   assert(buf_sizes.ndim == 1);
   assert(buf_sizes.shape[0] == clusters->size());
   
-  for(int i=0; i<n_clusters; ++i) {
-    const Cluster& c = (*clusters)[i];
-    buf_sizes[i] = static_cast<long>(c.pixels.size());
-  }
+  for(int i=0; i<n_clusters; ++i)
+    buf_sizes[i] = static_cast<long>(clusters->cluster_size(i));
 
   Py_RETURN_NONE;
 }
 
-
-
-
-
-//
-// Cluster
-//
-PyObject* py_clusters_cluster_nvertices(PyObject* self, PyObject* args)
-{
-  PyObject *py_cluster;
-  if(!PyArg_ParseTuple(args, "O", &py_cluster)) {
-    return NULL;
-  }
-  
-  Cluster const * const c =
-    (Cluster const*) PyCapsule_GetPointer(py_cluster, "_Cluster");
-  assert(c);
-
-  return Py_BuildValue("k", static_cast<unsigned long>(c->pixels.size()));  
-}
-
-
-PyObject* py_clusters_cluster_nedges(PyObject* self, PyObject* args)
-{
-  PyObject *py_cluster;
-  if(!PyArg_ParseTuple(args, "O", &py_cluster)) {
-    return NULL;
-  }
-  
-  Cluster const * const c =
-    (Cluster const*) PyCapsule_GetPointer(py_cluster, "_Cluster");
-  assert(c);
-
-  return Py_BuildValue("k", static_cast<unsigned long>(c->pixels.size()));  
-}
-
-
-PyObject* py_clusters_cluster_get_edges(PyObject* self, PyObject* args)
+PyObject* py_clusters_nbytes(PyObject* self, PyObject* args)
 {
-  PyObject *py_cluster;
-  if(!PyArg_ParseTuple(args, "O", &py_cluster)) {
+  // _clusters_nbytes(_clusters)
+  // Returns: heap memory owned by the clusters object in bytes
+  PyObject *py_clusters;
+  if(!PyArg_ParseTuple(args, "O", &py_clusters)) {
     return NULL;
   }
-  
-  Cluster* const c =
-    (Cluster *) PyCapsule_GetPointer(py_cluster, "_Cluster");
-  assert(c);
-
-  return np_array::view_from_vector_struct(c->edges.front().index,
-                                           c->edges.size(), 2,sizeof(Edge));
-}
 
+  Clusters const * const clusters =
+    (Clusters const*) PyCapsule_GetPointer(py_clusters, "_Clusters");
+  assert(clusters);
 
-PyObject* py_clusters_cluster_get_edge_values(PyObject* self, PyObject* args)
-{
-  PyObject *py_cluster;
-  if(!PyArg_ParseTuple(args, "O", &py_cluster)) {
-    return NULL;
-  }
-  
-  Cluster* const c =
-    (Cluster*) PyCapsule_GetPointer(py_cluster, "_Cluster");
-  assert(c);
-  
-  return np_array::view_from_vector_struct(&(c->edges.front().value),
-                                           c->edges.size(), 1, sizeof(Edge));
+  return PyLong_FromSize_t(clusters->nbytes());
 }
-
@@ -5,44 +5,115 @@
 #include <memory>
 
 #include "Python.h"
+#include "buffer.h"
 #include "graph.h"
+#include "stats.h"
+#include "ccl.h"
+#include "np_array.h"
 
 
-struct Cluster {
-  std::vector<int> pixels;
-  std::vector<Edge> edges;
-  int centre[2];
-  bool empty() const noexcept {
-    return pixels.empty() && edges.empty();
-  }
-};
-
-
-class Clusters : public std::vector<Cluster> {
+//
+// Clusters in compressed sparse row (CSR) format
+//
+// Cluster k has the pixels
+//   v_pixel[pixel_offset[k]:pixel_offset[k + 1]],
+// the edges
+//   v_edge_index[edge_offset[k]:edge_offset[k + 1]] with v_edge_value,
+// and the runs
+//   v_run[run_offset[k]:run_offset[k + 1]].
+// A cluster has pixels and edges, or runs only (construct_runs). The flat
+// arrays are exported to Python as numpy views without a copy; the views
+// keep their generation of the arrays alive (np_array::Generation).
+//
+class Clusters {
  public:
   Clusters();
   Clusters(Clusters const&) = delete;
   Clusters& operator=(Clusters const&) = delete;
 
-  void construct(PyObject* const py_img,
+  // Number of clusters
+  size_t size() const { return pixel_offset.size() - 1; }
+  bool empty() const { return size() == 0; }
+  void clear();
+
+  // Number of pixels in cluster k
+  size_t cluster_size(const int k) const;
+
+  // Append to the open cluster, the one after the last cluster
+  void push_pixel(const int index) {
+    v_pixel.push_back(index);
+  }
+  void push_edge(const int index1, const int index2, const double value) {
+    v_edge_index.emplace_back(index1, index2);
+    v_edge_value.push_back(value);
+  }
+  void push_run(const ccl::Run& r) {
+    v_run.push_back(r);
+  }
+
+  // Pixels in the open cluster
+  int open_size() const {
+    return static_cast<int>(v_pixel.size()) - pixel_offset.back();
+  }
+
+  // Close the open cluster as cluster size(), or discard it
+  void close_cluster();
+  void discard_cluster();
+
+  // T: unsigned char, unsigned short, float, or double
+  // Stats: NoStats or KernelStats (stats.h)
+  // buf_labels: [output] if not nullptr, nx x ny label image filled while
+  //             the clusters are found; 0 for pixels not in a cluster and
+  //             k for the pixels of cluster k - 1
+  template<typename T, typename Stats>
+  void construct(const Buffer<T>& buf_img,
                  const double pixel_threshold,
-                 const int size_threshold);
-  
-  
+                 const int size_threshold,
+                 Stats& stats,
+                 Buffer<int>* const buf_labels=nullptr);
+
+  // Same clusters with tile-parallel labelling on the thread pool (ccl.h);
+  // pixels of a cluster are in index order, not in BFS order
+  template<typename T, typename Stats>
+  void construct_parallel(const Buffer<T>& buf_img,
+                          const double pixel_threshold,
+                          const int size_threshold,
+                          Stats& stats,
+                          Buffer<int>* const buf_labels=nullptr);
+
+  // Same clusters as runs of pixels in rows, without pixels and edges
+  template<typename T, typename Stats>
+  void construct_runs(const Buffer<T>& buf_img,
+                      const double pixel_threshold,
+                      const int size_threshold,
+                      Stats& stats,
+                      Buffer<int>* const buf_labels=nullptr);
+
+
+  // Heap memory owned by this object
+  size_t nbytes() const;
+
+  // Hand the arrays over to their numpy views, if any are alive, before
+  // the clusters are reconstructed or freed; with the GIL
+  void retire_views();
+
   int _nx, _ny;
- private:
 
+  std::vector<int> pixel_offset, edge_offset, run_offset;
+  std::vector<int> v_pixel;
+  std::vector<EdgeIndex> v_edge_index;
+  std::vector<double> v_edge_value;
+  std::vector<ccl::Run> v_run;
+
+  np_array::Generation generation;  // of the exported views
 };
 
 
 PyObject* py_clusters_alloc(PyObject* self, PyObject* args);
 PyObject* py_clusters_len(PyObject* self, PyObject* args);
 PyObject* py_clusters_obtain(PyObject* self, PyObject* args);
-PyObject* py_clusters_get_cluster(PyObject* self, PyObject* args);
+PyObject* py_clusters_get_shape(PyObject* self, PyObject* args);
+PyObject* py_clusters_get_arrays(PyObject* self, PyObject* args);
 PyObject* py_clusters_get_sizes(PyObject* self, PyObject* args);
- 
-PyObject* py_clusters_cluster_nvertices(PyObject* self, PyObject* args);
-PyObject* py_clusters_cluster_nedges(PyObject* self, PyObject* args);
-PyObject* py_clusters_cluster_get_edges(PyObject* self, PyObject* args);
-PyObject* py_clusters_cluster_get_edge_values(PyObject* self, PyObject* args);
+PyObject* py_clusters_nbytes(PyObject* self, PyObject* args);
 #endif
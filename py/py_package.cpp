@@ -3,54 +3,145 @@
 #include "py_clusters.h"
 #include "ellipses.h"
 #include "py_watershed.h"
+#include "max_tree.h"
+#include "dendrogram.h"
+#include "regionprops.h"
 #include "watershed_ncluster.h"
 #include "watershed_nuclei.h"
+#include "thread_pool.h"
+#include "memory.h"
+#include "trace.h"
 
 //
 // List of all functions callable from Python
 //
+// The kernels run without the GIL after the buffers are acquired, so
+// images can be processed concurrently from Python threads. Kernels have
+// no global state, but one _Watershed or _Clusters object must not be
+// modified from two threads at the same time.
+//
+// Functions with stats=None set instrumentation counters to a given dict:
+//   lookups, hops_mean, hops_max: union-find find() calls and path lengths
+//   merges, clusters:             cluster merges and new clusters
+//   queue_max:                    maximum BFS queue length
+//   splice_volume:                pixels moved on merges (nuclei)
+//   seconds:                      {phase: seconds}, e.g., sort, flood, bfs
+//
 
 static PyMethodDef methods[] = {
   {"_watershed_alloc", py_watershed_alloc, METH_VARARGS,
    "_watershed_alloc()"},
   {"_watershed_construct",  py_watershed_construct, METH_VARARGS,
-   "_watershed_construct(_watershed, img, argsort, threshold)"},
+   "_watershed_construct(_watershed, img, pixel_threshold, "
+   "merge_threshold, persistence_threshold, seed_random_direction, "
+   "record_edges, stats=None)"},
   {"_watershed_get_edges", py_watershed_get_edges, METH_VARARGS,
    "_watershed_get_edges(_watershed)"},
   {"_watershed_get_edge_values", py_watershed_get_edge_values, METH_VARARGS,
-   "_watershed_get_edge_values(_watershed)"},
+   "_watershed_get_edge_values(_watershed, img)"},
+  {"_watershed_get_persistence", py_watershed_get_persistence, METH_VARARGS,
+   "_watershed_get_persistence(_watershed)"},
   {"_watershed_obtain_cluster_sizes", py_watershed_obtain_cluster_sizes,
-   METH_VARARGS, "_watershed_obtain_cluster_size(_watershed,"
+   METH_VARARGS, "_watershed_obtain_cluster_size(_watershed, img, "
    "pixel_threshold, size_threshold)"},
   {"_watershed_obtain_clusters", py_watershed_obtain_clusters, METH_VARARGS,
-   "_watershed_obtain_clusters(_watershed, pixel_threshold, size_threshold)"},
+   "_watershed_obtain_clusters(_watershed, img, pixel_threshold, "
+   "edge_threshold, size_threshold, _clusters, stats=None, labels=None)"},
+  {"_watershed_nbytes", py_watershed_nbytes, METH_VARARGS,
+   "_watershed_nbytes(_watershed)"},
 
   {"_clusters_alloc", py_clusters_alloc, METH_VARARGS,
    "_clusters_alloc()"},
   {"_clusters_len", py_clusters_len, METH_VARARGS,
    "_clusters_len(_clusters)"},
-  {"_clusters_get_cluster", py_clusters_get_cluster, METH_VARARGS,
-   "_clusters_get_cluster(_clusters, i)"},
   {"_clusters_obtain", py_clusters_obtain, METH_VARARGS,
-   "_clusters_obtain(_clusters, img, pixel_threshold, size_threshold)"},
+   "_clusters_obtain(_clusters, img, pixel_threshold, size_threshold, "
+   "stats=None, parallel=0, runs=0, labels=None)"},
   {"_clusters_get_sizes", py_clusters_get_sizes, METH_VARARGS,
    "_clusters_get_sizes(_clusters, sizes)"},
-  {"_clusters_cluster_nvertices", py_clusters_cluster_nvertices, METH_VARARGS,
-   "_clusters_cluster_nvertices(_cluster)"},
-  {"_clusters_cluster_nedges", py_clusters_cluster_nedges, METH_VARARGS,
-   "_clusters_cluster_nedges(_cluster)"},
-  {"_clusters_cluster_get_edges", py_clusters_cluster_get_edges, METH_VARARGS,
-   "_clusters_cluster_get_edges(_cluster)"},
-  {"_clusters_cluster_get_edge_values", py_clusters_cluster_get_edge_values,
-   METH_VARARGS, "_clusters_cluster_get_edge_values(_cluster)"},
+  {"_clusters_nbytes", py_clusters_nbytes, METH_VARARGS,
+   "_clusters_nbytes(_clusters)"},
+  {"_clusters_get_shape", py_clusters_get_shape, METH_VARARGS,
+   "_clusters_get_shape(_clusters)"},
+  {"_clusters_get_arrays", py_clusters_get_arrays, METH_VARARGS,
+   "_clusters_get_arrays(_clusters)"},
+
+  {"_max_tree_alloc", py_max_tree_alloc, METH_VARARGS,
+   "_max_tree_alloc()"},
+  {"_max_tree_construct", py_max_tree_construct, METH_VARARGS,
+   "_max_tree_construct(_max_tree, img, stats=None)"},
+  {"_max_tree_len", py_max_tree_len, METH_VARARGS,
+   "_max_tree_len(_max_tree)"},
+  {"_max_tree_get_nodes", py_max_tree_get_nodes, METH_VARARGS,
+   "_max_tree_get_nodes(_max_tree)"},
+  {"_max_tree_get_pixels", py_max_tree_get_pixels, METH_VARARGS,
+   "_max_tree_get_pixels(_max_tree)"},
+  {"_max_tree_count_clusters", py_max_tree_count_clusters, METH_VARARGS,
+   "_max_tree_count_clusters(_max_tree, thresholds, nclusters, "
+   "size_threshold)"},
+  {"_max_tree_select_nodes", py_max_tree_select_nodes, METH_VARARGS,
+   "_max_tree_select_nodes(_max_tree, size_min, size_max, thresholds)"},
+  {"_max_tree_mark_pixels", py_max_tree_mark_pixels, METH_VARARGS,
+   "_max_tree_mark_pixels(_max_tree, nodes, mask)"},
+  {"_max_tree_nbytes", py_max_tree_nbytes, METH_VARARGS,
+   "_max_tree_nbytes(_max_tree)"},
+
+  {"_dendrogram_alloc", py_dendrogram_alloc, METH_VARARGS,
+   "_dendrogram_alloc()"},
+  {"_dendrogram_construct", py_dendrogram_construct, METH_VARARGS,
+   "_dendrogram_construct(_dendrogram, _watershed, img, pixel_threshold, "
+   "stats=None)"},
+  {"_dendrogram_get_merges", py_dendrogram_get_merges, METH_VARARGS,
+   "_dendrogram_get_merges(_dendrogram)"},
+  {"_dendrogram_get_leaf_pixels", py_dendrogram_get_leaf_pixels,
+   METH_VARARGS, "_dendrogram_get_leaf_pixels(_dendrogram)"},
+  {"_dendrogram_count_clusters", py_dendrogram_count_clusters, METH_VARARGS,
+   "_dendrogram_count_clusters(_dendrogram, thresholds, nclusters, "
+   "size_threshold)"},
+  {"_dendrogram_obtain_clusters", py_dendrogram_obtain_clusters,
+   METH_VARARGS, "_dendrogram_obtain_clusters(_dendrogram, edge_threshold, "
+   "size_threshold, _clusters, labels=None)"},
+  {"_dendrogram_nbytes", py_dendrogram_nbytes, METH_VARARGS,
+   "_dendrogram_nbytes(_dendrogram)"},
 
   {"_watershed_ncluster_compute", watershed_ncluster::py_compute, METH_VARARGS,
-   "_watershed_ncluster_compute()"},
+   "_watershed_ncluster_compute(img, thresholds, nclusters, "
+   "size_threshold, seed_random_direction, stats=None)"},
+  {"_watershed_ncluster_compute_batch", watershed_ncluster::py_compute_batch,
+   METH_VARARGS, "_watershed_ncluster_compute_batch(imgs, thresholds, "
+   "nclusters, size_threshold, seed_random_direction)"},
   {"_watershed_nuclei_obtain", watershed_nuclei::obtain, METH_VARARGS,
-   "_watershed_nuclei_obtain()"},
+   "_watershed_nuclei_obtain(img, thresholds, size_min, size_max, nuclei, "
+   "stats=None, labels=None)"},
+  {"_watershed_nuclei_obtain_batch", watershed_nuclei::obtain_batch,
+   METH_VARARGS, "_watershed_nuclei_obtain_batch(imgs, thresholds, "
+   "size_min, size_max, nuclei)"},
   
   {"_ellipses_obtain", ellipses::obtain, METH_VARARGS,
-   "_ellipses_obtain(img, pixel_threshold, size_threshold)"},
+   "_ellipses_obtain(img, pixel_threshold, size_threshold, weighted=0)"},
+  {"_ellipses_obtain_batch", ellipses::obtain_batch, METH_VARARGS,
+   "_ellipses_obtain_batch(imgs, pixel_thresholds, size_threshold, "
+   "weighted=0)"},
+
+  {"_regionprops_compute", regionprops::py_compute, METH_VARARGS,
+   "_regionprops_compute(_clusters, stack, table)"},
+
+  {"_set_nthreads", thread_pool::py_set_nthreads, METH_VARARGS,
+   "_set_nthreads(n)"},
+  {"_get_nthreads", thread_pool::py_get_nthreads, METH_VARARGS,
+   "_get_nthreads()"},
+
+  {"_memory_kernels", memory::py_kernels, METH_VARARGS,
+   "_memory_kernels()"},
+  {"_memory_reset_peak", memory::py_reset_peak, METH_VARARGS,
+   "_memory_reset_peak()"},
+
+  {"_trace_start", trace::py_start, METH_VARARGS,
+   "_trace_start(filename)"},
+  {"_trace_stop", trace::py_stop, METH_VARARGS,
+   "_trace_stop()"},
+  {"_trace_flush", trace::py_flush, METH_VARARGS,
+   "_trace_flush()"},
   
   {NULL, NULL, 0, NULL}
 };
@@ -67,6 +158,7 @@ static struct PyModuleDef module = {
 PyMODINIT_FUNC
 PyInit__cellularlib(void) {
   np_array::module_init();
+  trace::init_from_env();
   
   return PyModule_Create(&module);
 }
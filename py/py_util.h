@@ -33,6 +33,8 @@ const char* util_type_name()
     return "char";
   else if (typeid(T) == typeid(unsigned char))
     return "unsigned char";
+  else if (typeid(T) == typeid(unsigned short))
+    return "unsigned short";
 
   //else {
   //  PyErr_SetString(PyExc_TypeError, "Unknown type for util_type_name");
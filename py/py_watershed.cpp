@@ -3,62 +3,37 @@
 //
 #include <iostream>
 #include <vector>
-#include <queue>
 #include <random>
 #include <cmath>
+#include <algorithm>
+#include <utility>
 #include <cassert>
 
 #include "buffer.h"
 #include "np_array.h"
 #include "graph.h"
+#include "union_find.h"
+#include "ccl.h"
+#include "thread_pool.h"
+#include "pixel_order.h"
+#include "stats.h"
+#include "memory.h"
 #include "py_clusters.h"
 #include "py_watershed.h"
 
 //using namespace std;
 using std::vector;
 
-//
-// C++ structure/class
-//
-
-class Watershed {
-public:
-  Watershed();
-  Watershed(Watershed const&) = delete;
-  Watershed& operator=(Watershed const&) = delete;
-
-  void construct_graph(PyObject * const py_img,
-                       PyObject * const py_argsort,
-                       const double pixel_threshold,
-                       const int merge_threshold,
-		       const int seed_random_direction);
- 
-  vector<int>& obtain_cluster_sizes(const double pixel_threshold,
-                                    const int size_threshold);
-
-  vector<int> v_sizes;
-  int _nx, _ny;
-
-  std::shared_ptr<vector<Vertex>> ptr_pixels;
-  std::shared_ptr<vector<Edge>> ptr_edges;
-};
-
-
 //
 // static functions
 //
 
-static void obtain_clusters(const vector<Vertex>& v_pixel,
-                            const vector<Edge>& v_edge,
-                            const double pixel_threshold,
-                            const double edge_threshold,
-                            const size_t size_threshold,
-                            Clusters& clusters);
-
-
 // Python deconstructor
 static void py_watershed_free(PyObject *obj);
 
+// Number of edges per task of the edge pass in obtain_clusters
+constexpr int edge_chunk = 1 << 16;
+
 
 
 
@@ -67,70 +42,76 @@ static void py_watershed_free(PyObject *obj);
 //
 
 Watershed::Watershed() :
-  _nx(0), _ny(0),
-  ptr_pixels(new vector<Vertex>()),
-  ptr_edges(new vector<Edge>())
+  _nx(0), _ny(0), has_edges(false)
 {
 
 }
 
 
-void Watershed::construct_graph(PyObject * const py_img,
-                                PyObject * const py_argsort,
+template<typename T, bool record_edges, typename Stats>
+void Watershed::construct_graph(const Buffer<T>& buf_img,
                                 const double pixel_threshold,
                                 const int merge_threshold,
-				const int seed_random_direction)
+                                const double persistence_threshold,
+				const int seed_random_direction,
+                                Stats& stats)
 {
   // Args:
-  //   py_img (2D array float64): 2D image array
-  //   py_argsort (1D array int):  argsort indices
+  //   buf_img (2D array): 2D image array of T = uint8, uint16, float32
+  //                       or float64
   //   pixel_threshold: pixel value < are neglected
   //   merge_threshold: if two clusters have sizes >= merge_threshold,
   //                    they are not merged to one cluster
+  //   persistence_threshold: if the lower top of two clusters is higher
+  //                    than the saddle f1 by >= persistence_threshold,
+  //                    they are not merged; +inf for no such criterion
   //   seed_first_direction: if > 0, select first neighbor randomly
-  //   
-  // Exceptions:
-  //   TypeError
+  //   stats: NoStats or KernelStats
+  //
+  // Note:
+  //   Pure C++; called without the GIL
+  memory::Call call("construct_graph");
 
-  vector<Vertex>& v = *ptr_pixels;
-  vector<Edge>& v_edge = *ptr_edges;
-  
-  v.clear();
   v_edge.clear();
-
-
-  // Buffer may throw Type error
-  Buffer<double> buf_img(py_img, "py_img");         // image/2D pixels;
-  Buffer<long>   buf_arg(py_argsort, "py_argsort"); // sorted order
+  v_persistence.clear();
+  has_edges = record_edges;
 
   // image size
   const int nx = _nx = static_cast<int>(buf_img.shape[0]);
   const int ny = _ny = static_cast<int>(buf_img.shape[1]);
-  const int n = static_cast<int>(buf_arg.shape[0]);
-  assert(nx*ny == n);
+  const int n = nx*ny;
 
+  // pixel indices in ascending pixel value
+  stats.begin_phase();
+  memory::vector<int> v_order;
+  pixel_order::compute(buf_img, v_order);
+  stats.end_phase("sort");
 
   // Define neighbour pixel
   const int dx_list[] = {0, 1, 0, -1}; // up, right, down, left
   const int dy_list[] = {1, 0, -1, 0};
 
-  // Copy img to vector<Vertex>
-  v = graph::obtain_vertices(buf_img);
+  uf.reset(n);
+
+  // pixel value of index
+  auto value = [&buf_img, ny](const int index) {
+    return static_cast<double>(buf_img(index / ny, index % ny));
+  };
 
   // randomly select first neighbour if seed_random_direction > 0
   std::mt19937 mt(seed_random_direction);
   std::uniform_int_distribution<int> rand4(0, 3);  // generates 0, 1, 2, 3
 
-  int n_edges = 0;
-  
+  stats.begin_phase();
+
   // Loop over all pixel from that with largest value to lower
   // The `water level` is going down
   for(int i=n-1; i>=0; --i) {
     // <1> is the lowest land above the water level now
-    int index1 = buf_arg[i];
+    int index1 = v_order[i];
     int ix1 = index1 / ny;
     int iy1 = index1 % ny;
-    double f1 = buf_img(ix1, iy1);
+    double f1 = static_cast<double>(buf_img(ix1, iy1));
 
     assert(0 <= index1 && index1 < n); // DEBUG!
 
@@ -138,15 +119,14 @@ void Watershed::construct_graph(PyObject * const py_img,
       break;
 
     
-    // If this pixel does not link to neighbour pixels,
-    // the link points to itself
-    v[index1].next = index1;
-    v[index1].size = 1;
+    // This pixel is a new cluster of itself until it links to
+    // neighbour pixels
+    uf.add(index1);
 
     // First neibour direction (Always 0 if seed == 0)
     int random_direction = seed_random_direction == 0 ?  0 : rand4(mt);
 
-    int another_top = -1;
+    int the_cluster = -1;  // root of the cluster this pixel belongs to
 
     // 4 directions  // up, right, down, left from <1>
     for(int j1=0; j1<4; ++j1) {
@@ -162,195 +142,293 @@ void Watershed::construct_graph(PyObject * const py_img,
       
       int index2 = ix2*ny + iy2;
         
-      if(v[index2].next < 0)
+      if(!uf.contains(index2))
         continue;  // Not obove waterlevel yet.
       
       // <2> is a neighbour above water level, higher than <1>
       // by construction
 
-      // Find top pixel of this neighbor
-      int top = graph::get_top(index2, v);
-      int j2 = (j1 + 2) % 4;  // direction viewed from <2>
+      // Find the cluster of this neighbor
+      int nbr_cluster = uf.find(index2, stats);
 
-      if(another_top == -1) {
+      if(the_cluster == -1) {
         // This pixel joins this first cluster
-        v[index1].next = top;
-        v[top].size += 1;
-        another_top = top;
-        
-        assert(v[index1].edge[j1] == -1); // DEBUG!
-        assert(v[index2].edge[j2] == -1);
-            
-        v[index1].edge[j1] = n_edges;
-        v[index2].edge[j2] = n_edges;
-
-        // add edge
-        v_edge.push_back(Edge(index1, index2, f1));
-        n_edges++;
+        the_cluster = uf.unite(nbr_cluster, index1, uf.top(nbr_cluster));
       }
-      else if(another_top >= 0 && another_top != top) {
+      else if(the_cluster != nbr_cluster) {
         // New cluster is connected to the `another` existing cluster
 
-        // Do not merge two large clusters
-        if(v[top].size >= merge_threshold &&
-           v[another_top].size >= merge_threshold)
+        // The higher top becomes the top of the merged cluster;
+        // the cluster with the lower top dies at this saddle
+        int top = uf.top(nbr_cluster);
+        int lower_top = uf.top(the_cluster);
+        if(!(value(top) > value(lower_top)))
+          std::swap(top, lower_top);
+        const double birth = value(lower_top);
+
+        // Do not merge two large clusters, or two clusters separated by
+        // a deep valley
+        if((uf.size(nbr_cluster) >= merge_threshold &&
+            uf.size(the_cluster) >= merge_threshold) ||
+           birth - f1 >= persistence_threshold)
           continue;
 
-        if(v[top].value > v[another_top].value) {
-          // top > another_top
-          //   another_top is connected under top,
-          //   and top become the new another_top 
-          v[another_top].next = top;
-          v[top].size += v[another_top].size;
-          another_top = top;
-        }
-        else {
-          // another_top >= top
-          //   top is connected under another_top
-          v[top].next = another_top;
-          v[another_top].size += v[top].size;
-        }
-
-        // vertex -> edge information
-        assert(v[index1].edge[j1] == -1);
-        assert(v[index2].edge[j2] == -1);
-        
-        v[index1].edge[j1] = n_edges;
-        v[index2].edge[j2] = n_edges;
-
-        // add edge
-        v_edge.push_back(Edge(index1, index2, f1));
-        n_edges++;
+        the_cluster = uf.unite(the_cluster, nbr_cluster, top);
+        v_persistence.emplace_back(lower_top, birth, f1);
+        stats.merge();
       }
+      else {
+        continue;
+      }
+
+      if(!record_edges)
+        continue;
+
+      // add edge; the edge value is f1, the value of the lower pixel
+      v_edge.push_back(EdgeIndex(index1, index2));
     }
-  }      
+
+    if(the_cluster == -1)
+      stats.new_cluster(); // a local maximum
+  }
+
+  stats.end_phase("flood");
 }
 
 
-vector<int>& Watershed::obtain_cluster_sizes(
-             const double pixel_threshold, const int size_threshold)
+template<typename T>
+void Watershed::obtain_cluster_sizes(const Buffer<T>& buf_img,
+                                     const double pixel_threshold,
+                                     const int size_threshold,
+                                     vector<int>& v_sizes) const
 {
-  v_sizes.clear(); // or create a new vector??
+  // Sizes of clusters in the order of their top pixels
+  // The graph is not modified; safe to call from many threads
+  //   buf_img: the image the graph is constructed from
+  trace::Span span("cluster_sizes");
+  memory::Call call("cluster_sizes");
   const int n = _nx*_ny;
+  const int ny = _ny;
+
+  memory::vector<std::pair<int, int>> tops; // (top, size)
 
-  vector<Vertex>& v = *ptr_pixels;
-  
   for(int i=0; i<n; ++i) {
-    const Vertex& p = v[i];
-    if(p.next == i && p.value >= pixel_threshold && p.size >= size_threshold)
-      v_sizes.push_back(p.size);
+    if(!uf.is_root(i))
+      continue;
+
+    const int top = uf.top(i);
+    if(buf_img(top / ny, top % ny) >= pixel_threshold &&
+       uf.size(i) >= size_threshold)
+      tops.emplace_back(top, uf.size(i));
   }
-  
-  return v_sizes;
+
+  std::sort(tops.begin(), tops.end());
+
+  v_sizes.clear();
+  for(const std::pair<int, int>& p : tops)
+    v_sizes.push_back(p.second);
 }
 
 //
 // Clusters
 //
-// DEBUG!!!
-void print_edge(char msg[], const Edge& ee)
-{
-  int x0 = ee.index[0] / 64;
-  int y0 = ee.index[0] % 64;
-  int x1 = ee.index[1] / 64;
-  int y1 = ee.index[1] % 64;
-  
-  printf("%-16s  %2d %2d - %2d %2d\n", msg, x0, y0, x1, y1);
-}
-
-
-// Find clusters in a graph
-//   v_pixel: array of verticis
-//   v_edge:  array of edges
-void obtain_clusters(const vector<Vertex>& v_pixel,
-                     const vector<Edge>& v_edge,
-                     const double pixel_threshold,
-                     const double edge_threshold,
-                     const size_t size_threshold,
-                     Clusters& clusters)
+// Find clusters in the graph
+//   buf_img: the image the graph is constructed from
+//
+// A cluster is a component of the graph without the edges < edge_threshold,
+// and its pixels are those >= pixel_threshold. Components are found by
+// union-find over v_edge in one streaming pass, and the pixels and edges
+// are bucketed to their clusters by counting sort. Clusters are in the
+// order of their first edge in v_edge; edges of a cluster are in the order
+// of v_edge, and pixels in the order of their first edge.
+template<typename T, typename Stats>
+void Watershed::obtain_clusters(const Buffer<T>& buf_img,
+                                const double pixel_threshold,
+                                const double edge_threshold,
+                                const size_t size_threshold,
+                                Clusters& clusters,
+                                Stats& stats,
+                                Buffer<int>* const buf_labels) const
 {
   // Thresholds
   //   pixels < pixel_threshold are neglected
   //   edges < edge_threshold are negelected
   //   clusters with sizez >= size_threshold are in result
+  clusters.clear();
+
+  // Pixels not in a cluster are 0
+  if(buf_labels) {
+    for(size_t ix=0; ix<buf_img.shape[0]; ++ix)
+      for(size_t iy=0; iy<buf_img.shape[1]; ++iy)
+        (*buf_labels)(ix, iy) = 0;
+  }
+
   if(v_edge.size() == 0)
     return;
+
+  memory::Call call("obtain_clusters");
   
   const int n_edges = v_edge.size();
-  const int img_size = v_pixel.size();
-
-  // indices of exlpred edges
-  vector<bool> edge_explored(n_edges, false);
-  vector<bool> pixel_explored(img_size, false);
+  const int nx = static_cast<int>(buf_img.shape[0]);
+  const int ny = static_cast<int>(buf_img.shape[1]);
+  const int img_size = nx*ny;
+
+  // Edge values, the value of the lower pixel; the scattered reads of the
+  // image are split into chunks on the thread pool
+  stats.begin_phase();
+  memory::vector<double> values(n_edges);
+  const int n_chunks = (n_edges + edge_chunk - 1)/edge_chunk;
+  thread_pool::get()->parallel_for(n_chunks, [&](const int ichunk) {
+    const int begin = ichunk*edge_chunk;
+    const int end = std::min(n_edges, begin + edge_chunk);
+    for(int k=begin; k<end; ++k) {
+      const int index = v_edge[k].index[0];
+      values[k] = buf_img(index / ny, index % ny);
+    }
+  });
 
-  // edges to be explored
-  std::queue<int> q;
+  // Union of the pixels connected by the edges >= edge_threshold; the
+  // pixels of the graph are initialised when first seen, so the passes
+  // below are over the edges and their end points only
+  memory::vector<int> parent(img_size, -1);
+  memory::vector<int> pixels;  // end points in the order of first edge
 
-  // empty cluster
-  Cluster c_init;
-  
-  // traverse all edges
-  for(int i_new_edge=0; i_new_edge<n_edges; ++i_new_edge) {
-    // skip if the edge is alreay explored or
-    // both endpoint pixels are already explored
-    if(edge_explored[i_new_edge] ||
-       (pixel_explored[v_edge[i_new_edge].index[0]] &&
-        pixel_explored[v_edge[i_new_edge].index[1]]))
+  for(int k=0; k<n_edges; ++k) {
+    if(values[k] < edge_threshold)
       continue;
 
-    // First edge in this new cluster
-    assert(q.empty());
-    q.push(i_new_edge);
+    for(const int index : v_edge[k].index) {
+      if(parent[index] < 0) {
+        parent[index] = index;
+        pixels.push_back(index);
+      }
+    }
+
+    if(ccl::unite(parent.data(), v_edge[k].index[0], v_edge[k].index[1]))
+      stats.merge();
+  }
+  stats.end_phase("union");
+
+  stats.begin_phase();
+
+  // Number the components in the order of their first edge, which is the
+  // order of their first pixel in pixels. parent[] is flattened, and the
+  // root holds -1 - component
+  const int n_pixels = static_cast<int>(pixels.size());
+  memory::vector<int> roots(n_pixels);
+  for(int v=0; v<n_pixels; ++v)
+    roots[v] = ccl::find(parent.data(), pixels[v]);
+
+  int n_components = 0;
+  for(const int r : roots) {
+    if(parent[r] == r)
+      parent[r] = -1 - n_components++;
+  }
 
-    //print_edge("New edge", v_edge[i_new_edge]);
+  for(int v=0; v<n_pixels; ++v) {
+    if(roots[v] != pixels[v])
+      parent[pixels[v]] = roots[v];
+  }
 
-    // A new cluster
-    clusters.push_back(c_init);
-    Cluster& c = clusters.back();
+  auto component = [&parent](const int index) {
+    const int p = parent[index];
+    return -1 - (p >= 0 ? parent[p] : p);
+  };
 
-    while(!q.empty()) {
-      // Pick up an unexplored edge in this cluster
-      const int j_edge = q.front(); q.pop();
-      const Edge edge = v_edge[j_edge];
-      assert(edge_explored[j_edge] == false); // ERROR!!! DEBUG!!!
-      edge_explored[j_edge] = true;
+  // Number of edges and pixels >= pixel_threshold of the components
+  memory::vector<int> n_component_edges(n_components, 0);
+  for(int k=0; k<n_edges; ++k) {
+    if(values[k] >= edge_threshold)
+      n_component_edges[component(v_edge[k].index[0])]++;
+  }
 
-      if(edge.value < edge_threshold)
-        continue;
-      
-      c.edges.push_back(edge);
-
-      //print_edge("  pop edge", v_edge[j_edge]);
-
-      for(int k=0; k<2; ++k) {
-        // for each end-point pixel
-        int index = edge.index[k];
-        if(!pixel_explored[index]) {
-          // Add a new pixel to the cluster
-          if(v_pixel[index].value >= pixel_threshold)
-            c.pixels.push_back(index);
-          pixel_explored[index] = true;
-          
-          // Add the adjacent edges to the queue
-          const Vertex& p = v_pixel[index];
-          for(int j=0; j<4; ++j) { // loop over 4 neighbours
-            int adj_edge = p.edge[j];
-            if(adj_edge >= 0 && (!edge_explored[adj_edge])) {
-              q.push(adj_edge);
-            }
-          }
-        }
-      }
-    } // all connected vertices are added to the cluster
+  memory::vector<int> sizes(n_components, 0);
+  for(const int index : pixels) {
+    if(buf_img(index / ny, index % ny) >= pixel_threshold)
+      sizes[component(index)]++;
+  }
 
-    // Only keep cluster with size >= size_threshold
-    const size_t cluster_size = c.pixels.size();
-    if(0 == cluster_size || cluster_size < size_threshold) {
-      clusters.pop_back();
+  // Cluster index of each component; -1 for small components
+  memory::vector<int> cluster_index(n_components);
+  int n_clusters = 0;
+  for(int c=0; c<n_components; ++c) {
+    const size_t size = static_cast<size_t>(sizes[c]);
+    cluster_index[c] = size > 0 && size >= size_threshold ? n_clusters++ : -1;
+  }
+
+  for(int c=0; c<n_components; ++c) {
+    if(cluster_index[c] >= 0) {
+      clusters.pixel_offset.push_back(clusters.pixel_offset.back() +
+                                      sizes[c]);
+      clusters.edge_offset.push_back(clusters.edge_offset.back() +
+                                     n_component_edges[c]);
+      clusters.run_offset.push_back(0);
+      stats.new_cluster();
+    }
+  }
+
+  // Scatter the pixels and edges to their clusters, keeping their order
+  clusters.v_pixel.resize(clusters.pixel_offset.back());
+  clusters.v_edge_index.resize(clusters.edge_offset.back());
+  clusters.v_edge_value.resize(clusters.edge_offset.back());
+
+  memory::vector<int> next_pixel(clusters.pixel_offset.begin(),
+                                 clusters.pixel_offset.end());
+  memory::vector<int> next_edge(clusters.edge_offset.begin(),
+                                clusters.edge_offset.end());
+
+  for(const int index : pixels) {
+    const int ix = index / ny;
+    const int iy = index % ny;
+    const int k = cluster_index[component(index)];
+    if(k >= 0 && buf_img(ix, iy) >= pixel_threshold) {
+      clusters.v_pixel[next_pixel[k]++] = index;
+      if(buf_labels)
+        (*buf_labels)(ix, iy) = k + 1;
+    }
+  }
+
+  for(int j=0; j<n_edges; ++j) {
+    if(values[j] < edge_threshold)
+      continue;
+
+    const int k = cluster_index[component(v_edge[j].index[0])];
+    if(k >= 0) {
+      const int m = next_edge[k]++;
+      clusters.v_edge_index[m] = v_edge[j];
+      clusters.v_edge_value[m] = values[j];
     }
-  } // all edges explored
+  }
+
+  stats.end_phase("extract");
 }
 
+// explicit instantiation
+#define WATERSHED_INSTANTIATE_STATS(T, S) \
+  template void Watershed::construct_graph<T, true, S>( \
+    const Buffer<T>&, const double, const int, const double, const int, \
+    S&); \
+  template void Watershed::construct_graph<T, false, S>( \
+    const Buffer<T>&, const double, const int, const double, const int, \
+    S&); \
+  template void Watershed::obtain_clusters( \
+    const Buffer<T>&, const double, const double, const size_t, \
+    Clusters&, S&, Buffer<int>* const) const;
+
+#define WATERSHED_INSTANTIATE(T) \
+  WATERSHED_INSTANTIATE_STATS(T, NoStats) \
+  WATERSHED_INSTANTIATE_STATS(T, KernelStats) \
+  template void Watershed::obtain_cluster_sizes( \
+    const Buffer<T>&, const double, const int, vector<int>&) const;
+
+WATERSHED_INSTANTIATE(unsigned char)
+WATERSHED_INSTANTIATE(unsigned short)
+WATERSHED_INSTANTIATE(float)
+WATERSHED_INSTANTIATE(double)
+
+#undef WATERSHED_INSTANTIATE
+#undef WATERSHED_INSTANTIATE_STATS
+
 
 //
 // Python interface
@@ -375,20 +453,57 @@ void py_watershed_free(PyObject *obj)
   Watershed* const w = (Watershed*) PyCapsule_GetPointer(obj, "_Watershed");
   assert(w);
 
+  w->retire_views();
   delete w;
 }
 
 
+template<typename T>
+static void construct(Watershed* const w, PyObject* const py_img,
+                      const double pixel_threshold,
+                      const int merge_threshold,
+                      const double persistence_threshold,
+                      const int seed_random_direction,
+                      const bool record_edges,
+                      PyObject* const py_stats)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+  if(buf_img.ndim != 2) {
+    PyErr_SetString(PyExc_ValueError, "Expected a 2-dimensional img");
+    throw TypeError();
+  }
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    if(record_edges)
+      w->construct_graph<T, true>(buf_img, pixel_threshold, merge_threshold,
+                                  persistence_threshold,
+                                  seed_random_direction, stats);
+    else
+      w->construct_graph<T, false>(buf_img, pixel_threshold, merge_threshold,
+                                   persistence_threshold,
+                                   seed_random_direction, stats);
+  });
+}
+
 PyObject* py_watershed_construct(PyObject* self, PyObject* args)
 {
-  // _watershed_get_edges(_watershed)
-  PyObject *py_watershed, *py_img, *py_argsort;
+  // _watershed_construct(_watershed, img, pixel_threshold,
+  //                      merge_threshold, persistence_threshold,
+  //                      seed_random_direction, record_edges, stats=None)
+  //   persistence_threshold (float): inf for no persistence criterion
+  //   stats (dict): instrumentation counters are set if not None
+  trace::Span span("_watershed_construct");
+  PyObject *py_watershed, *py_img;
+  PyObject *py_stats = Py_None;
   double pixel_threshold;
   int merge_threshold;
+  double persistence_threshold;
   int seed_random_direction;
-  if(!PyArg_ParseTuple(args, "OOOdii", &py_watershed, &py_img, &py_argsort,
+  int record_edges;
+  if(!PyArg_ParseTuple(args, "OOdidii|O", &py_watershed, &py_img,
                        &pixel_threshold, &merge_threshold,
-		       &seed_random_direction)) {
+                       &persistence_threshold,
+		       &seed_random_direction, &record_edges, &py_stats)) {
     return NULL;
   }
 
@@ -396,10 +511,28 @@ PyObject* py_watershed_construct(PyObject* self, PyObject* args)
     (Watershed*) PyCapsule_GetPointer(py_watershed, "_Watershed");
   assert(w);
 
+  w->retire_views();
+
   try {
-    w->construct_graph(py_img, py_argsort,
-                       pixel_threshold, merge_threshold,
-		       seed_random_direction);
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      construct<unsigned char>(w, py_img, pixel_threshold,
+                               merge_threshold, persistence_threshold,
+                               seed_random_direction, record_edges, py_stats);
+    else if(format == "H")
+      construct<unsigned short>(w, py_img, pixel_threshold,
+                                merge_threshold, persistence_threshold,
+                                seed_random_direction, record_edges, py_stats);
+    else if(format == "f")
+      construct<float>(w, py_img, pixel_threshold,
+                       merge_threshold, persistence_threshold,
+                       seed_random_direction, record_edges, py_stats);
+    else
+      construct<double>(w, py_img, pixel_threshold,
+                        merge_threshold, persistence_threshold,
+                        seed_random_direction, record_edges, py_stats);
   }
   catch (TypeError e) {
     return NULL;
@@ -408,6 +541,22 @@ PyObject* py_watershed_construct(PyObject* self, PyObject* args)
   Py_RETURN_NONE;
 }
 
+static Watershed* get_watershed_with_edges(PyObject* py_watershed)
+{
+  // Returns NULL with RuntimeError if edges are not recorded
+  Watershed* const w =
+    (Watershed*) PyCapsule_GetPointer(py_watershed, "_Watershed");
+  assert(w);
+
+  if(!w->has_edges) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Watershed graph is constructed without edges");
+    return NULL;
+  }
+
+  return w;
+}
+
 PyObject* py_watershed_get_edges(PyObject* self, PyObject* args)
 {
   // _watershed_get_edges(_watershed)
@@ -416,19 +565,78 @@ PyObject* py_watershed_get_edges(PyObject* self, PyObject* args)
     return NULL;
   }
 
-  Watershed* const w =
-    (Watershed*) PyCapsule_GetPointer(py_watershed, "_Watershed");
-  assert(w);
+  Watershed* const w = get_watershed_with_edges(py_watershed);
+  if(w == NULL)
+    return NULL;
 
-  return np_array::view_from_vector_struct(w->ptr_edges->front().index,
-                                           w->ptr_edges->size(), 2,
-                                           sizeof(Edge));
+  // v_edge is empty for an image without a pixel >= pixel_threshold;
+  // data() is valid then, unlike front()
+  int* const p = reinterpret_cast<int*>(w->v_edge.data());
+  return np_array::view_from_vector_struct(p, w->v_edge.size(), 2,
+                                           sizeof(EdgeIndex),
+                                           w->generation.base());
 }
 
 
+template<typename T>
+static void obtain_edge_values(Watershed const * const w,
+                               PyObject* const py_img,
+                               vector<double>& v_values)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+  w->check_shape(buf_img);
+  const int ny = w->_ny;
+
+  v_values.reserve(w->v_edge.size());
+  for(const EdgeIndex& e : w->v_edge)
+    v_values.push_back(buf_img(e.index[0] / ny, e.index[0] % ny));
+}
+
 PyObject* py_watershed_get_edge_values(PyObject* self, PyObject* args)
 {
-  // _watershed_get_edge_values(_watershed)
+  // _watershed_get_edge_values(_watershed, img)
+  //   img: the image the graph is constructed from
+  // Returns:
+  //   values of the lower pixel of the edges
+  trace::Span span("_watershed_get_edge_values");
+  PyObject *py_watershed, *py_img;
+  if(!PyArg_ParseTuple(args, "OO", &py_watershed, &py_img)) {
+    return NULL;
+  }
+
+  Watershed const * const w = get_watershed_with_edges(py_watershed);
+  if(w == NULL)
+    return NULL;
+
+  vector<double> v_values;
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      obtain_edge_values<unsigned char>(w, py_img, v_values);
+    else if(format == "H")
+      obtain_edge_values<unsigned short>(w, py_img, v_values);
+    else if(format == "f")
+      obtain_edge_values<float>(w, py_img, v_values);
+    else
+      obtain_edge_values<double>(w, py_img, v_values);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  return np_array::move_from_vector(std::move(v_values));
+}
+
+
+PyObject* py_watershed_get_persistence(PyObject* self, PyObject* args)
+{
+  // _watershed_get_persistence(_watershed)
+  // Returns: (top, birth, death), views of the persistence table
+  //   top: top pixel of the cluster that died in the merge
+  //   birth, death: pixel values of the top and the saddle
   PyObject *py_watershed;
   if(!PyArg_ParseTuple(args, "O", &py_watershed)) {
     return NULL;
@@ -437,60 +645,183 @@ PyObject* py_watershed_get_edge_values(PyObject* self, PyObject* args)
   Watershed* const w =
     (Watershed*) PyCapsule_GetPointer(py_watershed, "_Watershed");
   assert(w);
-  
-  return np_array::view_from_vector_struct(&(w->ptr_edges->front().value),
-                                           w->ptr_edges->size(), 1,
-                                           sizeof(Edge));
+
+  vector<Persistence>& v = w->v_persistence;
+  if(v.empty())
+    return Py_BuildValue("(NNN)",
+                         np_array::copy_from_vector(vector<int>()),
+                         np_array::copy_from_vector(vector<double>()),
+                         np_array::copy_from_vector(vector<double>()));
+
+  const int n = static_cast<int>(v.size());
+  const size_t size = sizeof(Persistence);
+  PyObject* const base = w->generation.base();
+  return Py_BuildValue("(NNN)",
+    np_array::view_from_vector_struct(&v.front().top, n, 1, size, base),
+    np_array::view_from_vector_struct(&v.front().birth, n, 1, size, base),
+    np_array::view_from_vector_struct(&v.front().death, n, 1, size, base));
+}
+
+
+template<typename T>
+static void obtain_cluster_sizes(Watershed const * const w,
+                                 PyObject* const py_img,
+                                 const double pixel_threshold,
+                                 const int size_threshold,
+                                 vector<int>& v_sizes)
+{
+  Buffer<T> buf_img(py_img, "py_img"); // may throw TypeError
+  w->check_shape(buf_img);
+
+  Py_BEGIN_ALLOW_THREADS
+  w->obtain_cluster_sizes(buf_img, pixel_threshold, size_threshold, v_sizes);
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
 }
 
 PyObject* py_watershed_obtain_cluster_sizes(PyObject* self, PyObject* args)
 {
-  // _watershed_get_edge_values(_watershed)
-  PyObject *py_watershed;
+  // _watershed_obtain_cluster_sizes(_watershed, img,
+  //                                 pixel_threshold, size_threshold)
+  trace::Span span("_watershed_obtain_cluster_sizes");
+  PyObject *py_watershed, *py_img;
   double pixel_threshold;
   int size_threshold;
-  if(!PyArg_ParseTuple(args, "Odi",
-                       &py_watershed, &pixel_threshold, &size_threshold)) {
+  if(!PyArg_ParseTuple(args, "OOdi", &py_watershed, &py_img,
+                       &pixel_threshold, &size_threshold)) {
     return NULL;
   }
 
-  Watershed* const w =
-    (Watershed*) PyCapsule_GetPointer(py_watershed, "_Watershed");
+  Watershed const * const w =
+    (Watershed const *) PyCapsule_GetPointer(py_watershed, "_Watershed");
   assert(w);
+
+  vector<int> v_sizes;
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      obtain_cluster_sizes<unsigned char>(w, py_img, pixel_threshold,
+                                          size_threshold, v_sizes);
+    else if(format == "H")
+      obtain_cluster_sizes<unsigned short>(w, py_img, pixel_threshold,
+                                           size_threshold, v_sizes);
+    else if(format == "f")
+      obtain_cluster_sizes<float>(w, py_img, pixel_threshold,
+                                  size_threshold, v_sizes);
+    else
+      obtain_cluster_sizes<double>(w, py_img, pixel_threshold,
+                                   size_threshold, v_sizes);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
   
-  return np_array::view_from_vector(
-           w->obtain_cluster_sizes(pixel_threshold, size_threshold));  
+  return np_array::move_from_vector(std::move(v_sizes));
+}
+
+
+template<typename T>
+static void obtain_clusters_image(Watershed const * const w,
+                                  PyObject* const py_img,
+                                  const double pixel_threshold,
+                                  const double edge_threshold,
+                                  const int size_threshold,
+                                  Clusters& clusters,
+                                  PyObject* const py_stats,
+                                  PyObject* const py_labels)
+{
+  // Buffer may throw TypeError; ValueError for a different shape
+  Buffer<T> buf_img(py_img, "py_img");
+  w->check_shape(buf_img);
+  Buffer<int> buf_labels;
+  if(py_labels != Py_None)
+    buf_labels.assign(py_labels);
+
+  Buffer<int>* const labels = py_labels == Py_None ? nullptr : &buf_labels;
+  assert(labels == nullptr || (buf_labels.ndim == 2 &&
+                               buf_labels.shape == buf_img.shape));
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    w->obtain_clusters(buf_img, pixel_threshold, edge_threshold,
+                       size_threshold, clusters, stats, labels);
+  });
 }
 
 PyObject* py_watershed_obtain_clusters(PyObject* self, PyObject* args)
 {
-  // _watershed_get_edge_values(_watershed)
-  PyObject *py_watershed, *py_clusters;
+  // _watershed_obtain_clusters(_watershed, img, pixel_threshold,
+  //                            edge_threshold, size_threshold, _clusters,
+  //                            stats=None, labels=None)
+  //   labels (2D array int32): [output] label image if not None
+  trace::Span span("_watershed_obtain_clusters");
+  PyObject *py_watershed, *py_img, *py_clusters;
+  PyObject *py_stats = Py_None;
+  PyObject *py_labels = Py_None;
   double pixel_threshold, edge_threshold;
   int size_threshold;
-  if(!PyArg_ParseTuple(args, "OddiO", &py_watershed,
+  if(!PyArg_ParseTuple(args, "OOddiO|OO", &py_watershed, &py_img,
                        &pixel_threshold, &edge_threshold,
-                       &size_threshold, &py_clusters)) {
+                       &size_threshold, &py_clusters, &py_stats,
+                       &py_labels)) {
     return NULL;
   }
 
-  Watershed const * const w =
-    (Watershed const *) PyCapsule_GetPointer(py_watershed, "_Watershed");
-  assert(w);
+  Watershed const * const w = get_watershed_with_edges(py_watershed);
+  if(w == NULL)
+    return NULL;
 
   Clusters* const clusters =
     (Clusters*) PyCapsule_GetPointer(py_clusters, "_Clusters");
   assert(clusters);
 
+  clusters->retire_views();
   clusters->_nx = w->_nx;
   clusters->_ny = w->_ny;
 
-  obtain_clusters(*w->ptr_pixels, *w->ptr_edges,
-                  pixel_threshold, edge_threshold, size_threshold,
-                  *clusters);
-
-  //clusters->ptr_pixels = w->ptr_pixels;
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      obtain_clusters_image<unsigned char>(w, py_img, pixel_threshold,
+                                           edge_threshold, size_threshold,
+                                           *clusters, py_stats, py_labels);
+    else if(format == "H")
+      obtain_clusters_image<unsigned short>(w, py_img, pixel_threshold,
+                                            edge_threshold, size_threshold,
+                                            *clusters, py_stats, py_labels);
+    else if(format == "f")
+      obtain_clusters_image<float>(w, py_img, pixel_threshold,
+                                   edge_threshold, size_threshold,
+                                   *clusters, py_stats, py_labels);
+    else
+      obtain_clusters_image<double>(w, py_img, pixel_threshold,
+                                    edge_threshold, size_threshold,
+                                    *clusters, py_stats, py_labels);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
 
   Py_RETURN_NONE;
 }
 
+
+PyObject* py_watershed_nbytes(PyObject* self, PyObject* args)
+{
+  // _watershed_nbytes(_watershed)
+  // Returns: heap memory owned by the watershed object in bytes
+  PyObject *py_watershed;
+  if(!PyArg_ParseTuple(args, "O", &py_watershed)) {
+    return NULL;
+  }
+
+  Watershed const * const w =
+    (Watershed const *) PyCapsule_GetPointer(py_watershed, "_Watershed");
+  assert(w);
+
+  return PyLong_FromSize_t(w->nbytes());
+}
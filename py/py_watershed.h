@@ -1,12 +1,113 @@
 #ifndef PY_WATERSHED_H
 #define PY_WATERSHED_H 1
 
+#include <vector>
 #include "Python.h"
+#include "buffer.h"
+#include "error.h"
+#include "graph.h"
+#include "union_find.h"
+#include "stats.h"
+#include "memory.h"
+#include "np_array.h"
+#include "py_clusters.h"
+
+//
+// Merge of two clusters while the watershed graph is constructed
+// The cluster with the lower top dies at the saddle (elder rule);
+// persistence = birth - death
+//
+struct Persistence {
+  Persistence(const int top_, const double birth_, const double death_) :
+    top(top_), birth(birth_), death(death_) {}
+  int top;        // top pixel of the cluster that died
+  double birth;   // pixel value of the top
+  double death;   // pixel value of the saddle pixel
+};
+
+//
+// Watershed graph of pixels
+//
+class Watershed {
+public:
+  Watershed();
+  Watershed(Watershed const&) = delete;
+  Watershed& operator=(Watershed const&) = delete;
+
+  // T: unsigned char, unsigned short, float, or double
+  // record_edges: if false, only clusters are constructed, which is
+  //               sufficient for obtain_cluster_sizes
+  // Stats: NoStats or KernelStats (stats.h)
+  template<typename T, bool record_edges, typename Stats>
+  void construct_graph(const Buffer<T>& buf_img,
+                       const double pixel_threshold,
+                       const int merge_threshold,
+                       const double persistence_threshold,
+		       const int seed_random_direction,
+                       Stats& stats);
+
+  // Queries; buf_img is the image the graph is constructed from
+  template<typename T>
+  void obtain_cluster_sizes(const Buffer<T>& buf_img,
+                            const double pixel_threshold,
+                            const int size_threshold,
+                            std::vector<int>& v_sizes) const;
+
+  // clusters:   [output] cleared and filled
+  // buf_labels: [output] if not nullptr, label image of the clusters;
+  //             see Clusters::construct
+  template<typename T, typename Stats>
+  void obtain_clusters(const Buffer<T>& buf_img,
+                       const double pixel_threshold,
+                       const double edge_threshold,
+                       const size_t size_threshold,
+                       Clusters& clusters,
+                       Stats& stats,
+                       Buffer<int>* const buf_labels=nullptr) const;
+
+  // Set ValueError and throw unless buf_img has the shape of the graph;
+  // queries index pixels of buf_img by the stored pixel indices
+  template<typename T>
+  void check_shape(const Buffer<T>& buf_img) const {
+    if(buf_img.ndim != 2 ||
+       buf_img.shape[0] != static_cast<size_t>(_nx) ||
+       buf_img.shape[1] != static_cast<size_t>(_ny)) {
+      PyErr_Format(PyExc_ValueError,
+                   "img shape differs from the graph (%d, %d)", _nx, _ny);
+      throw TypeError();
+    }
+  }
+
+  // Heap memory owned by this object
+  size_t nbytes() const {
+    return sizeof(Watershed) + uf.nbytes() + memory::nbytes(v_edge) +
+           memory::nbytes(v_persistence);
+  }
+
+  // Hand v_edge and v_persistence over to their numpy views, if any are
+  // alive, before the graph is reconstructed or freed; with the GIL
+  void retire_views() {
+    generation.retire(v_edge, v_persistence);
+  }
+
+  int _nx, _ny;
+  bool has_edges;
+
+  // Graph in structure of arrays; pixel values are read from the image
+  UnionFind uf;                  // clusters of pixels above pixel_threshold
+  std::vector<EdgeIndex> v_edge;
+  std::vector<Persistence> v_persistence;  // merges in the order of death
+
+  np_array::Generation generation;  // of the views of v_edge, v_persistence
+};
+
 
 PyObject* py_watershed_alloc(PyObject* self, PyObject* args);
 PyObject* py_watershed_construct(PyObject* self, PyObject* args);
 PyObject* py_watershed_get_edges(PyObject* self, PyObject* args);
 PyObject* py_watershed_get_edge_values(PyObject* self, PyObject* args);
+PyObject* py_watershed_get_persistence(PyObject* self, PyObject* args);
 PyObject* py_watershed_obtain_cluster_sizes(PyObject* self, PyObject* args);
 PyObject* py_watershed_obtain_clusters(PyObject* self, PyObject* args);
+PyObject* py_watershed_nbytes(PyObject* self, PyObject* args);
 #endif
@@ -0,0 +1,275 @@
+//
+// Region properties of clusters in a multi-channel image
+//
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+#include "np_array.h"
+#include "buffer.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "memory.h"
+#include "ellipses.h"
+#include "regionprops.h"
+
+using std::vector;
+
+namespace {
+
+// Number of clusters per task
+constexpr int regionprops_chunk = 64;
+
+//
+// Accumulator of the properties of one cluster
+//
+// Channel sums are of f - shift with shift the value of the first pixel,
+// so that the variance does not lose precision for large pixel values.
+//
+template<typename T>
+class Region {
+ public:
+  Region(const vector<std::unique_ptr<Buffer<T>>>& channels) :
+    channels_(channels), nc(static_cast<int>(channels.size())),
+    shift(nc), sum(nc), sum2(nc), fmin(nc), fmax(nc) {
+    clear();
+  }
+
+  void clear() {
+    n = sx = sy = sxx = sxy = syy = 0;
+    ix_begin = iy_begin = 0;
+    ix_end = iy_end = 0;
+  }
+
+  void add(const int ix, const int iy) {
+    if(n == 0) {
+      ix_begin = ix; ix_end = ix + 1;
+      iy_begin = iy; iy_end = iy + 1;
+      for(int c=0; c<nc; ++c) {
+        const double f = static_cast<double>((*channels_[c])(ix, iy));
+        shift[c] = fmin[c] = fmax[c] = f;
+        sum[c] = sum2[c] = 0.0;
+      }
+    }
+
+    ++n;
+    sx += ix; sy += iy;
+    sxx += static_cast<int64_t>(ix)*ix;
+    sxy += static_cast<int64_t>(ix)*iy;
+    syy += static_cast<int64_t>(iy)*iy;
+
+    ix_begin = std::min(ix_begin, ix); ix_end = std::max(ix_end, ix + 1);
+    iy_begin = std::min(iy_begin, iy); iy_end = std::max(iy_end, iy + 1);
+
+    for(int c=0; c<nc; ++c) {
+      const double f = static_cast<double>((*channels_[c])(ix, iy));
+      const double d = f - shift[c];
+      sum[c] += d;
+      sum2[c] += d*d;
+      fmin[c] = std::min(fmin[c], f);
+      fmax[c] = std::max(fmax[c], f);
+    }
+  }
+
+  // Write row i of the table
+  void write(Buffer<double>& buf_table, const int i) const {
+    assert(n > 0);
+    const double w = static_cast<double>(n);
+    const double mx = sx/w;
+    const double my = sy/w;
+    const double cxx = sxx/w - mx*mx;
+    const double cxy = sxy/w - mx*my;
+    const double cyy = syy/w - my*my;
+
+    double a, b;
+    ellipses::axes(cxx, cxy, cyy, a, b);
+
+    buf_table(0, i) = w;
+    buf_table(1, i) = mx;
+    buf_table(2, i) = my;
+    buf_table(3, i) = ix_begin;
+    buf_table(4, i) = ix_end;
+    buf_table(5, i) = iy_begin;
+    buf_table(6, i) = iy_end;
+    buf_table(7, i) = a;
+    buf_table(8, i) = b;
+    buf_table(9, i) = ellipses::angle(cxx, cxy, cyy);
+
+    for(int c=0; c<nc; ++c) {
+      const int j = regionprops::n_geometry + regionprops::n_channel*c;
+      const double mean_shifted = sum[c]/w;
+      buf_table(j, i) = w*shift[c] + sum[c];
+      buf_table(j + 1, i) = shift[c] + mean_shifted;
+      buf_table(j + 2, i) = fmin[c];
+      buf_table(j + 3, i) = fmax[c];
+      buf_table(j + 4, i) =
+        std::max(sum2[c]/w - mean_shifted*mean_shifted, 0.0);
+    }
+  }
+
+ private:
+  const vector<std::unique_ptr<Buffer<T>>>& channels_;
+  const int nc;
+
+  int64_t n, sx, sy, sxx, sxy, syy;
+  int ix_begin, ix_end, iy_begin, iy_end;
+  vector<double> shift, sum, sum2, fmin, fmax;
+};
+
+} // unnamed namespace
+
+
+namespace regionprops {
+
+template<typename T>
+void compute(const Clusters& clusters, const Buffer<T>& buf_stack,
+             Buffer<double>& buf_table)
+{
+  /*
+   * Args:
+   *   clusters: clusters of pixels or of runs
+   *   buf_stack (3D array): n_channels x nx x ny array of T
+   *   buf_table: [output] see regionprops.h
+   *
+   * Note:
+   *   Pure C++; called without the GIL
+   */
+  trace::Span span("regionprops");
+  memory::Call call("regionprops");
+
+  const int nc = static_cast<int>(buf_stack.shape[0]);
+  const int ny = clusters._ny;
+  const int n_clusters = static_cast<int>(clusters.size());
+
+  assert(buf_stack.ndim == 3);
+  assert(static_cast<int>(buf_stack.shape[1]) == clusters._nx);
+  assert(static_cast<int>(buf_stack.shape[2]) == ny);
+  assert(buf_table.ndim == 2);
+  assert(static_cast<int>(buf_table.shape[0]) == n_columns(nc));
+  assert(static_cast<int>(buf_table.shape[1]) == n_clusters);
+
+  vector<std::unique_ptr<Buffer<T>>> channels;
+  for(int c=0; c<nc; ++c)
+    channels.emplace_back(new Buffer<T>(buf_stack, c));
+
+  const int n_chunks = (n_clusters + regionprops_chunk - 1)/regionprops_chunk;
+  thread_pool::get()->parallel_for(n_chunks, [&](const int ichunk) {
+    const int begin = ichunk*regionprops_chunk;
+    const int end = std::min(n_clusters, begin + regionprops_chunk);
+    Region<T> region(channels);
+
+    for(int i=begin; i<end; ++i) {
+      region.clear();
+
+      for(int j=clusters.pixel_offset[i]; j<clusters.pixel_offset[i + 1];
+          ++j) {
+        const int index = clusters.v_pixel[j];
+        region.add(index / ny, index % ny);
+      }
+
+      for(int j=clusters.run_offset[i]; j<clusters.run_offset[i + 1]; ++j) {
+        const ccl::Run& r = clusters.v_run[j];
+        for(int iy=r.iy_begin; iy<r.iy_end; ++iy)
+          region.add(r.ix, iy);
+      }
+
+      region.write(buf_table, i);
+    }
+  });
+}
+
+// explicit instantiation
+#define REGIONPROPS_INSTANTIATE(T) \
+  template void compute(const Clusters&, const Buffer<T>&, Buffer<double>&);
+
+REGIONPROPS_INSTANTIATE(unsigned char)
+REGIONPROPS_INSTANTIATE(unsigned short)
+REGIONPROPS_INSTANTIATE(float)
+REGIONPROPS_INSTANTIATE(double)
+
+#undef REGIONPROPS_INSTANTIATE
+
+}
+
+//
+// Python interface
+//
+
+template<typename T>
+static void compute_stack(Clusters const * const clusters,
+                          PyObject* const py_stack,
+                          PyObject* const py_table)
+{
+  // Buffer may throw TypeError
+  Buffer<T> buf_stack(py_stack, "py_stack");
+  Buffer<double> buf_table(py_table, "py_table");
+
+  // Clusters are indexed by pixel positions; ValueError for an image or a
+  // table of a different shape
+  const size_t n_clusters = clusters->size();
+  if(buf_stack.ndim != 3 ||
+     buf_stack.shape[1] != static_cast<size_t>(clusters->_nx) ||
+     buf_stack.shape[2] != static_cast<size_t>(clusters->_ny)) {
+    PyErr_Format(PyExc_ValueError,
+                 "Image size of stack differs from clusters (%d, %d)",
+                 clusters->_nx, clusters->_ny);
+    throw TypeError();
+  }
+
+  const int nc = static_cast<int>(buf_stack.shape[0]);
+  if(buf_table.ndim != 2 ||
+     buf_table.shape[0] != static_cast<size_t>(regionprops::n_columns(nc)) ||
+     buf_table.shape[1] != n_clusters) {
+    PyErr_SetString(PyExc_ValueError, "Table shape differs from "
+                    "n_columns x n_clusters");
+    throw TypeError();
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  regionprops::compute(*clusters, buf_stack, buf_table);
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+}
+
+namespace regionprops {
+
+PyObject* py_compute(PyObject* self, PyObject* args)
+{
+  // _regionprops_compute(_clusters, stack, table)
+  //   stack (3D array): n_channels x nx x ny
+  //   table (2D array float64): [output] n_columns x n_clusters
+  // Exception
+  //   TypeError, ValueError for a stack or table of a different shape
+  trace::Span span("_regionprops_compute");
+  PyObject *py_clusters, *py_stack, *py_table;
+  if(!PyArg_ParseTuple(args, "OOO", &py_clusters, &py_stack, &py_table)) {
+    return NULL;
+  }
+
+  Clusters const * const clusters =
+    (Clusters const *) PyCapsule_GetPointer(py_clusters, "_Clusters");
+  assert(clusters);
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_stack);
+
+    if(format == "B")
+      compute_stack<unsigned char>(clusters, py_stack, py_table);
+    else if(format == "H")
+      compute_stack<unsigned short>(clusters, py_stack, py_table);
+    else if(format == "f")
+      compute_stack<float>(clusters, py_stack, py_table);
+    else
+      compute_stack<double>(clusters, py_stack, py_table);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef REGIONPROPS_H
+#define REGIONPROPS_H 1
+
+#include "Python.h"
+#include "buffer.h"
+#include "py_clusters.h"
+
+//
+// Region properties of clusters in a multi-channel image
+//
+// The table has one column per property and one row per cluster, in the
+// order of the clusters; table(j, i) is property j of cluster i:
+//   0     size: number of pixels
+//   1, 2  x, y: centre of the pixel positions
+//   3, 4  ix_begin, ix_end: bounding box in x; end is exclusive
+//   5, 6  iy_begin, iy_end: bounding box in y
+//   7-9   a, b, theta: ellipse of the pixel positions (ellipses.h)
+// followed by n_channel columns for channel c from n_geometry + n_channel*c:
+//   sum, mean, min, max, var (population variance)
+//
+// All columns of a cluster are computed in one pass over its pixels, or
+// runs, for all channels; clusters are computed in chunks on the thread
+// pool.
+//
+namespace regionprops {
+
+constexpr int n_geometry = 10;  // columns that do not depend on channels
+constexpr int n_channel = 5;    // columns per channel
+
+inline int n_columns(const int n_channels) {
+  return n_geometry + n_channel*n_channels;
+}
+
+//   buf_stack: n_channels x nx x ny, the image size of clusters
+//   buf_table: [output] n_columns(n_channels) x clusters.size()
+// T: unsigned char, unsigned short, float, or double
+template<typename T>
+void compute(const Clusters& clusters, const Buffer<T>& buf_stack,
+             Buffer<double>& buf_table);
+
+PyObject* py_compute(PyObject* self, PyObject* args);
+
+}
+
+#endif
@@ -35,8 +35,14 @@ setup(name='junkoda_cellularlib',
                   'junkoda_cellularlib.clusters',
                   'junkoda_cellularlib.data',
                   'junkoda_cellularlib.delaunay',
+                  'junkoda_cellularlib.dendrogram',
                   'junkoda_cellularlib.ellipses',
                   'junkoda_cellularlib.graph',
+                  'junkoda_cellularlib.max_tree',
+                  'junkoda_cellularlib.memory',
+                  'junkoda_cellularlib.parallel',
+                  'junkoda_cellularlib.regionprops',
+                  'junkoda_cellularlib.trace',
                   'junkoda_cellularlib.watershed',
       ],
       ext_modules=[
@@ -44,9 +50,17 @@ setup(name='junkoda_cellularlib',
                     ['py_package.cpp',                     
                      'py_clusters.cpp',
                      'ellipses.cpp',
-                     'graph.cpp',
+                     'ccl.cpp',
+                     'dendrogram.cpp',
+                     'max_tree.cpp',
+                     'memory.cpp',
                      'np_array.cpp',
+                     'pixel_order.cpp',
+                     'regionprops.cpp',
                      'py_watershed.cpp',
+                     'stats.cpp',
+                     'thread_pool.cpp',
+                     'trace.cpp',
                      'watershed_ncluster.cpp',
                      'watershed_nuclei.cpp',
                     ],
@@ -56,13 +70,24 @@ setup(name='junkoda_cellularlib',
                                'ellipses.h',
                                'error.h',
                                'graph.h',
+                               'ccl.h',
+                               'dendrogram.h',
+                               'max_tree.h',
+                               'memory.h',
+                               'pixel_order.h',
+                               'regionprops.h',
+                               'union_find.h',
+                               'stats.h',
                                'grid.h',
                                'py_util.h',
                                'py_watershed.h',
+                               'thread_pool.h',
+                               'trace.h',
                                'watershed_ncluster.h',
                                'watershed_nuclei.h',
                     ],
-                    extra_compile_args = ['-std=c++11'],
+                    extra_compile_args = ['-std=c++14', '-pthread'],
+                    extra_link_args = ['-pthread'],
                     include_dirs = [np.get_include(), ],
                     # libraries = ['gsl', 'gslcblas'],
                     undef_macros = ['NDEBUG'],
@@ -0,0 +1,86 @@
+//
+// Kernel instrumentation counters
+//
+#include "stats.h"
+
+void KernelStats::end_phase(char const * const name)
+{
+  auto te = std::chrono::high_resolution_clock::now();
+  const double t = std::chrono::duration<double>(te - ts).count();
+  phase.end(name);
+
+  for(auto& p : phases) {
+    if(p.first == name) {
+      p.second += t;
+      return;
+    }
+  }
+  phases.emplace_back(name, t);
+}
+
+void KernelStats::add(const KernelStats& stats)
+{
+  n_lookups += stats.n_lookups;
+  hops_total += stats.hops_total;
+  hops_max = std::max(hops_max, stats.hops_max);
+  n_merges += stats.n_merges;
+  n_clusters += stats.n_clusters;
+  queue_max = std::max(queue_max, stats.queue_max);
+  splice_volume += stats.splice_volume;
+
+  for(const auto& q : stats.phases) {
+    auto p = std::find_if(phases.begin(), phases.end(),
+                          [&q](const std::pair<std::string, double>& p) {
+                            return p.first == q.first; });
+    if(p == phases.end())
+      phases.push_back(q);
+    else
+      p->second += q.second;
+  }
+}
+
+static bool set_item(PyObject* const py_dict, char const * const key,
+                     PyObject* const py_value)
+{
+  // Steals the reference of py_value
+  if(py_value == NULL)
+    return false;
+
+  const int ret = PyDict_SetItemString(py_dict, key, py_value);
+  Py_DECREF(py_value);
+
+  return ret == 0;
+}
+
+bool KernelStats::update_dict(PyObject* const py_dict) const
+{
+  const double hops_mean = n_lookups > 0 ?
+    static_cast<double>(hops_total)/n_lookups : 0.0;
+
+  PyObject* const py_seconds = PyDict_New();
+  if(py_seconds == NULL)
+    return false;
+
+  for(const auto& p : phases) {
+    if(!set_item(py_seconds, p.first.c_str(), PyFloat_FromDouble(p.second))) {
+      Py_DECREF(py_seconds);
+      return false;
+    }
+  }
+
+  const bool ok =
+    set_item(py_dict, "lookups", PyLong_FromLong(n_lookups)) &&
+    set_item(py_dict, "hops_mean", PyFloat_FromDouble(hops_mean)) &&
+    set_item(py_dict, "hops_max", PyLong_FromLong(hops_max)) &&
+    set_item(py_dict, "merges", PyLong_FromLong(n_merges)) &&
+    set_item(py_dict, "clusters", PyLong_FromLong(n_clusters)) &&
+    set_item(py_dict, "queue_max", PyLong_FromSize_t(queue_max)) &&
+    set_item(py_dict, "splice_volume", PyLong_FromSize_t(splice_volume));
+
+  if(!ok) {
+    Py_DECREF(py_seconds);
+    return false;
+  }
+
+  return set_item(py_dict, "seconds", py_seconds);
+}
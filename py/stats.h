@@ -0,0 +1,123 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+//
+// Opt-in instrumentation counters of kernels
+//
+// Kernels are templates on the Stats type. All members of NoStats are
+// empty inline functions, so the counters compile to nothing in the
+// default instantiation; KernelStats counts and adds the results to a
+// Python dict.
+//
+// Phases are also recorded as trace spans in both types when tracing is
+// enabled; see trace.h.
+//
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+
+#include "Python.h"
+#include "error.h"
+#include "trace.h"
+
+struct NoStats {
+  void lookup(const int hops) {}
+  void merge() {}
+  void new_cluster() {}
+  void queue_length(const size_t n) {}
+  void splice(const size_t n) {}
+  void begin_phase() { phase.begin(); }
+  void end_phase(char const * const name) { phase.end(name); }
+
+  trace::Phase phase;
+};
+
+class KernelStats {
+ public:
+  // union-find find() with the number of parent hops
+  void lookup(const int hops) {
+    n_lookups++;
+    hops_total += hops;
+    hops_max = std::max(hops_max, hops);
+  }
+
+  // two clusters are merged to one
+  void merge() { n_merges++; }
+
+  // a new cluster is created
+  void new_cluster() { n_clusters++; }
+
+  // current length of the BFS queue
+  void queue_length(const size_t n) { queue_max = std::max(queue_max, n); }
+
+  // number of pixels moved from one member list to another
+  void splice(const size_t n) { splice_volume += n; }
+
+  // wall time of a phase, e.g., sort and flood
+  void begin_phase() {
+    phase.begin();
+    ts = std::chrono::high_resolution_clock::now();
+  }
+  void end_phase(char const * const name);
+
+  // Add the counters of another call, e.g., of another image in a batch;
+  // the seconds of the phases are summed over the calls
+  void add(const KernelStats& stats);
+
+  // Set the counters to dict py_dict
+  //   "lookups", "hops_mean", "hops_max", "merges", "clusters",
+  //   "queue_max", "splice_volume", and "seconds" {phase: seconds}
+  // Returns false with a Python exception on failure
+  bool update_dict(PyObject* const py_dict) const;
+
+ private:
+  long n_lookups = 0;
+  long hops_total = 0;
+  int hops_max = 0;
+  long n_merges = 0;
+  long n_clusters = 0;
+  size_t queue_max = 0;
+  size_t splice_volume = 0;
+  std::vector<std::pair<std::string, double>> phases;
+  std::chrono::high_resolution_clock::time_point ts;
+  trace::Phase phase;
+};
+
+//
+// Call f(stats) without the GIL; with NoStats if py_stats is None or
+// NULL, otherwise with KernelStats, and set the counters to the dict
+// py_stats
+//
+// Throws: TypeError if py_stats is not a dict, or setting dict fails
+//
+template<typename F>
+void call_with_stats(PyObject* const py_stats, F f)
+{
+  if(py_stats == nullptr || py_stats == Py_None) {
+    NoStats stats;
+    Py_BEGIN_ALLOW_THREADS
+    f(stats);
+    trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+    Py_END_ALLOW_THREADS
+    return;
+  }
+
+  if(!PyDict_Check(py_stats)) {
+    PyErr_SetString(PyExc_TypeError, "stats must be a dict or None");
+    throw TypeError();
+  }
+
+  KernelStats stats;
+  Py_BEGIN_ALLOW_THREADS
+  f(stats);
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+
+  if(!stats.update_dict(py_stats))
+    throw TypeError();
+}
+
+#endif
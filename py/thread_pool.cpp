@@ -0,0 +1,195 @@
+//
+// Persistent pool of worker threads
+//
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <unistd.h>  // getpid
+
+#include "thread_pool.h"
+
+using std::vector;
+
+namespace {
+
+// State of one parallel_for call, shared with the tasks
+struct Job {
+  Job(const int n_, const std::function<void(int)>* f_) :
+    n(n_), next(0), done(0), f(f_) {}
+  const int n;
+  std::atomic<int> next;  // next index to be processed
+  int done;               // number of finished indices; guarded by mutex
+  std::function<void(int)> const * const f;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+// Process indices until none is left
+void run(const std::shared_ptr<Job>& job)
+{
+  int i;
+  int ndone = 0;
+  while((i = job->next++) < job->n) {
+    (*job->f)(i);
+    ++ndone;
+  }
+
+  if(ndone > 0) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->done += ndone;
+    if(job->done == job->n)
+      job->cv.notify_all();
+  }
+}
+
+int default_nthreads()
+{
+  return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
+std::mutex pool_mutex;
+std::shared_ptr<ThreadPool> pool;
+pid_t pool_pid = 0;
+
+} // unnamed namespace
+
+
+//
+// ThreadPool
+//
+ThreadPool::ThreadPool(const int nthreads) :
+  stop(false)
+{
+  for(int i=1; i<nthreads; ++i)
+    threads.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv.notify_all();
+
+  for(std::thread& th : threads)
+    th.join();
+}
+
+void ThreadPool::work()
+{
+  while(true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this] { return stop || !tasks.empty(); });
+      if(stop && tasks.empty())
+        return;
+
+      task = std::move(tasks.front());
+      tasks.pop();
+    }
+
+    task();
+  }
+}
+
+void ThreadPool::parallel_for(const int n, const std::function<void(int)>& f)
+{
+  if(n <= 0)
+    return;
+
+  const int nhelpers = std::min(n, nthreads()) - 1;
+
+  if(nhelpers <= 0) {
+    for(int i=0; i<n; ++i)
+      f(i);
+    return;
+  }
+
+  // f is only called for unprocessed indices, i.e., before this function
+  // returns, even if a helper task starts later
+  std::shared_ptr<Job> job = std::make_shared<Job>(n, &f);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int i=0; i<nhelpers; ++i)
+      tasks.emplace([job]() { run(job); });
+  }
+  cv.notify_all();
+
+  run(job);
+
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->cv.wait(lock, [&job] { return job->done == job->n; });
+}
+
+
+namespace thread_pool {
+
+std::shared_ptr<ThreadPool> get()
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+
+  // Threads do not survive fork(); the pool of the parent is abandoned
+  if(pool && pool_pid != getpid()) {
+    new std::shared_ptr<ThreadPool>(pool); // never joined nor freed
+    pool.reset();
+  }
+
+  if(!pool) {
+    pool = std::make_shared<ThreadPool>(default_nthreads());
+    pool_pid = getpid();
+  }
+
+  return pool;
+}
+
+void set_nthreads(const int nthreads)
+{
+  std::shared_ptr<ThreadPool> new_pool =
+    std::make_shared<ThreadPool>(nthreads > 0 ? nthreads :
+                                                default_nthreads());
+  std::shared_ptr<ThreadPool> old_pool;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if(pool_pid == getpid())
+      old_pool = pool;
+    else if(pool)
+      new std::shared_ptr<ThreadPool>(pool); // see get()
+
+    pool = new_pool;
+    pool_pid = getpid();
+  }
+
+  // old_pool is joined here unless a running kernel still holds it
+}
+
+
+//
+// Python interface
+//
+PyObject* py_set_nthreads(PyObject* self, PyObject* args)
+{
+  // _set_nthreads(n)
+  int nthreads;
+  if(!PyArg_ParseTuple(args, "i", &nthreads)) {
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  set_nthreads(nthreads);
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_get_nthreads(PyObject* self, PyObject* args)
+{
+  // _get_nthreads()
+  std::shared_ptr<ThreadPool> p = get();
+
+  return Py_BuildValue("i", p->nthreads());
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H 1
+
+//
+// Persistent pool of worker threads for batched kernels
+//
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+#include "Python.h"
+
+class ThreadPool {
+ public:
+  // nthreads: number of threads including the calling thread
+  explicit ThreadPool(const int nthreads);
+  ~ThreadPool();
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  int nthreads() const { return static_cast<int>(threads.size()) + 1; }
+
+  // Call f(i) for i in [0, n); blocks until all calls are done.
+  // The calling thread also works, so parallel_for can be nested or
+  // called from many Python threads at the same time.
+  void parallel_for(const int n, const std::function<void(int)>& f);
+
+ private:
+  std::vector<std::thread> threads;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop;
+
+  void work();
+};
+
+namespace thread_pool {
+
+// The pool shared by all kernels, created at first use
+std::shared_ptr<ThreadPool> get();
+
+// Replace the shared pool; nthreads <= 0 for the number of cores
+void set_nthreads(const int nthreads);
+
+PyObject* py_set_nthreads(PyObject* self, PyObject* args);
+PyObject* py_get_nthreads(PyObject* self, PyObject* args);
+
+}
+
+#endif
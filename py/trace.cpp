@@ -0,0 +1,193 @@
+//
+// Chrome trace spans of kernel calls
+//
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unistd.h>  // getpid
+
+#include "trace.h"
+
+using std::vector;
+
+namespace {
+
+// Number of spans kept per thread; older spans are overwritten
+const size_t ring_capacity = 1 << 16;
+
+struct Event {
+  char const * name;
+  int64_t begin, end;
+};
+
+// Spans of one thread; mutex is only contended while flushing
+struct Ring {
+  explicit Ring(const int tid_) : tid(tid_), n(0) {}
+  const int tid;
+  size_t n;  // number of spans recorded since start()
+  vector<Event> events;
+  std::mutex mutex;
+};
+
+std::mutex registry_mutex;
+vector<std::shared_ptr<Ring>> rings;  // guarded by registry_mutex
+std::string filename;                 // guarded by registry_mutex
+int64_t t_origin = 0;                 // guarded by registry_mutex
+
+thread_local std::shared_ptr<Ring> this_ring;
+
+Ring& get_ring()
+{
+  // Rings are owned by the registry and outlive their threads
+  if(!this_ring) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    this_ring = std::make_shared<Ring>(static_cast<int>(rings.size()));
+    rings.push_back(this_ring);
+  }
+
+  return *this_ring;
+}
+
+void flush_at_exit()
+{
+  trace::is_enabled = false;
+  trace::flush();
+}
+
+} // unnamed namespace
+
+
+namespace trace {
+
+std::atomic<bool> is_enabled(false);
+
+void record(char const * const name, const int64_t begin, const int64_t end)
+{
+  Ring& ring = get_ring();
+  std::lock_guard<std::mutex> lock(ring.mutex);
+
+  if(ring.events.empty())
+    ring.events.resize(ring_capacity);
+
+  ring.events[ring.n % ring_capacity] = Event{name, begin, end};
+  ring.n++;
+}
+
+void start(char const * const filename_)
+{
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    filename = filename_;
+    t_origin = now();
+
+    for(const std::shared_ptr<Ring>& ring : rings) {
+      std::lock_guard<std::mutex> lock_ring(ring->mutex);
+      ring->n = 0;
+    }
+  }
+  is_enabled = true;
+}
+
+void init_from_env()
+{
+  char const * const env = getenv("JUNKODA_CELLULARLIB_TRACE");
+  if(env == nullptr || env[0] == '\0')
+    return;
+
+  start(env);
+  Py_AtExit(flush_at_exit);
+}
+
+bool flush()
+{
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  if(filename.empty())
+    return true;
+
+  FILE* const fp = fopen(filename.c_str(), "w");
+  if(fp == nullptr)
+    return false;
+
+  const int pid = static_cast<int>(getpid());
+  bool first = true;
+
+  fprintf(fp, "{\"traceEvents\": [\n");
+
+  for(const std::shared_ptr<Ring>& ring : rings) {
+    std::lock_guard<std::mutex> lock_ring(ring->mutex);
+    const size_t n = std::min(ring->n, ring_capacity);
+
+    for(size_t i=ring->n - n; i<ring->n; ++i) {
+      const Event& e = ring->events[i % ring_capacity];
+      fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+              "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+              first ? "" : ",\n", e.name, pid, ring->tid,
+              1.0e-3*(e.begin - t_origin), 1.0e-3*(e.end - e.begin));
+      first = false;
+    }
+  }
+
+  fprintf(fp, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+  return fclose(fp) == 0;
+}
+
+
+//
+// Python interface
+//
+PyObject* py_start(PyObject* self, PyObject* args)
+{
+  // _trace_start(filename)
+  char const * filename_;
+  if(!PyArg_ParseTuple(args, "s", &filename_)) {
+    return NULL;
+  }
+
+  start(filename_);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* flush_or_raise()
+{
+  bool ok;
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = flush();
+  Py_END_ALLOW_THREADS
+
+  if(!ok) {
+    PyErr_SetString(PyExc_OSError, "Unable to write the trace file");
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_stop(PyObject* self, PyObject* args)
+{
+  // _trace_stop()
+  //   Stop recording and write the trace file
+  // Exception
+  //   OSError
+  is_enabled = false;
+
+  return flush_or_raise();
+}
+
+PyObject* py_flush(PyObject* self, PyObject* args)
+{
+  // _trace_flush()
+  //   Write the trace file and continue recording
+  // Exception
+  //   OSError
+  return flush_or_raise();
+}
+
+}
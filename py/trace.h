@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+//
+// Timeline spans of kernel calls in Chrome trace format
+//
+// A Span records its begin and end time to a ring buffer local to the
+// thread if tracing is enabled, and costs one relaxed atomic load
+// otherwise. flush() writes the spans of all threads as Chrome trace JSON,
+// which can be viewed in chrome://tracing or https://ui.perfetto.dev.
+//
+// Tracing is enabled by the environment variable
+//   JUNKODA_CELLULARLIB_TRACE=<filename>
+// at import (written at exit), or with junkoda_cellularlib.trace.start().
+//
+// Span names must be string literals; only the pointers are stored.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "Python.h"
+
+namespace trace {
+
+extern std::atomic<bool> is_enabled;
+
+inline bool enabled()
+{
+  return is_enabled.load(std::memory_order_relaxed);
+}
+
+// Monotonic clock in nanoseconds
+inline int64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Append a span [begin, end) to the ring buffer of this thread
+void record(char const * const name, const int64_t begin, const int64_t end);
+
+//
+// Scoped span; end() closes it before the end of the scope
+//
+class Span {
+ public:
+  explicit Span(char const * const name_) :
+    name(name_), begin(enabled() ? now() : -1) {}
+  ~Span() { end(); }
+
+  Span(const Span&) = delete;
+  Span& operator=(Span const&) = delete;
+
+  void end() {
+    if(begin >= 0) {
+      record(name, begin, now());
+      begin = -1;
+    }
+  }
+
+ private:
+  char const * const name;
+  int64_t begin;
+};
+
+//
+// Span between begin() and end(name) for sequential phases in a kernel
+//
+class Phase {
+ public:
+  void begin() { t_begin = enabled() ? now() : -1; }
+  void end(char const * const name) {
+    if(t_begin >= 0) {
+      record(name, t_begin, now());
+      t_begin = -1;
+    }
+  }
+
+ private:
+  int64_t t_begin = -1;
+};
+
+// Start recording, discarding previous spans; spans are written to
+// filename by flush()
+void start(char const * const filename);
+
+// Start tracing if JUNKODA_CELLULARLIB_TRACE is set, and flush at exit
+void init_from_env();
+
+// Write the spans recorded since start(); recording continues if enabled
+// Returns false if the file cannot be written
+bool flush();
+
+PyObject* py_start(PyObject* self, PyObject* args);
+PyObject* py_stop(PyObject* self, PyObject* args);
+PyObject* py_flush(PyObject* self, PyObject* args);
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef UNION_FIND_H
+#define UNION_FIND_H 1
+
+//
+// Disjoint-set forest shared by the flooding kernels
+//
+// Pixels are added one by one as the `water level` goes down.
+// find() uses path halving and unite() attaches the smaller tree under
+// the larger one, so the root of a tree is not necessarily the highest
+// pixel of the cluster; top(root) keeps that representative pixel.
+//
+
+#include <utility>
+#include <cassert>
+
+#include "stats.h"
+#include "memory.h"
+
+class UnionFind {
+ public:
+  UnionFind() {}
+  explicit UnionFind(const int n) { reset(n); }
+
+  // All n pixels are `under the water'
+  void reset(const int n) {
+    v_parent.assign(n, -1);
+    v_size.assign(n, 0);
+    v_top.assign(n, -1);
+  }
+
+  void clear() {
+    v_parent.clear();
+    v_size.clear();
+    v_top.clear();
+  }
+
+  int n() const { return static_cast<int>(v_parent.size()); }
+
+  // Add pixel i as a new cluster of itself
+  void add(const int i) {
+    assert(0 <= i && i < n() && v_parent[i] < 0);
+    v_parent[i] = i;
+    v_size[i] = 1;
+    v_top[i] = i;
+  }
+
+  // Pixel i is already added (above the water level)
+  bool contains(const int i) const {
+    return v_parent[i] >= 0;
+  }
+
+  bool is_root(const int i) const {
+    return v_parent[i] == i;
+  }
+
+  // Root of the cluster that pixel i belongs to
+  int find(const int i) {
+    NoStats stats;
+    return find(i, stats);
+  }
+
+  // find() counting the number of hops to the root
+  template<typename Stats>
+  int find(int i, Stats& stats) {
+    assert(contains(i));
+    int hops = 0;
+    while(i != v_parent[i]) {
+      v_parent[i] = v_parent[v_parent[i]]; // path halving
+      i = v_parent[i];
+      ++hops;
+    }
+    stats.lookup(hops);
+
+    return i;
+  }
+
+  // Merge two clusters with roots r1 != r2 and returns the new root;
+  // r1 remains the root if the sizes are equal.
+  // top is the representative pixel of the merged cluster
+  int unite(int r1, int r2, const int top) {
+    assert(is_root(r1) && is_root(r2) && r1 != r2);
+    if(v_size[r1] < v_size[r2])
+      std::swap(r1, r2);
+
+    v_parent[r2] = r1;
+    v_size[r1] += v_size[r2];
+    v_top[r1] = top;
+
+    return r1;
+  }
+
+  // Number of pixels in the cluster
+  int size(const int root) const { return v_size[root]; }
+
+  // Representative pixel of the cluster
+  int top(const int root) const { return v_top[root]; }
+
+  size_t nbytes() const {
+    return memory::nbytes(v_parent) + memory::nbytes(v_size) +
+           memory::nbytes(v_top);
+  }
+
+ private:
+  memory::vector<int> v_parent;  // parent in the tree, -1 if not added
+  memory::vector<int> v_size;    // size of the cluster for a root
+  memory::vector<int> v_top;     // representative pixel for a root
+};
+
+#endif
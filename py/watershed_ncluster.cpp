@@ -7,58 +7,44 @@
 #include <random>
 
 #include "buffer.h"
+#include "union_find.h"
+#include "pixel_order.h"
+#include "stats.h"
+#include "memory.h"
+#include "thread_pool.h"
 #include "watershed_ncluster.h"
 
 using namespace std;
 
-//
-// static functions
-//
-
-static inline int get_top(int i, const vector<int>& v_next)
-{
-  assert(0 <= i && i < static_cast<int>(v_next.size())); // DEBUG!
-
-  while(i != v_next[i]) {
-    i = v_next[i];
-    assert(0 <= i && i < static_cast<int>(v_next.size())); // DEBUG!
-  }
-
-  return i;
-}
-
-
 //
 // Main data analysis
 //
 
-static void compute_nclusters(PyObject * const py_img,
-                              PyObject * const py_argsort,
-                              PyObject * const py_thresholds,
-                              PyObject * const py_nclusters,
-                              const int size_threshold,
-                              const int seed_random_direction)
+namespace watershed_ncluster {
+
+template<typename T, typename Stats>
+void compute_nclusters(const Buffer<T>& buf_img,
+                       const Buffer<double>& buf_thresholds,
+                       Buffer<long>& buf_nclusters,
+                       const int size_threshold,
+                       const int seed_random_direction,
+                       Stats& stats)
 {
   /*
    * Args:
-   *   py_img (2D array float64): 2D image array
-   *   py_argsort (1D array int):  argsort indices
-   *   pixel_threshold: pixel value < are neglected
+   *   buf_img (2D array): 2D image array of T
+   *   buf_thresholds (1D array float64): thresholds in decreasing order
+   *   buf_nclusters (1D array long): [output] number of clusters
    *   size_threshold: cluster size < are neglected
    *   seed_first_direction: if > 0, select first neighbor randomly
-   *   
-   * Exceptions:
-   *   TypeError
+   *   stats: NoStats or KernelStats
+   *
+   * Note:
+   *   Pure C++; called without the GIL
    */
-
-  // Buffer may throw TypeError
-  Buffer<double> buf_img(py_img, "py_img");         // image/2D pixels;
-  Buffer<long>   buf_arg(py_argsort, "py_argsort"); // sorted order
-  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
-  Buffer<long>   buf_nclusters(py_nclusters, "py_nclusters"); // result
+  memory::Call call("compute_nclusters");
 
   assert(buf_img.ndim == 2);
-  assert(buf_arg.ndim == 1);
   assert(buf_thresholds.ndim == 1);
   assert(buf_nclusters.ndim == 1);
 
@@ -67,8 +53,13 @@ static void compute_nclusters(PyObject * const py_img,
   const int ny = static_cast<int>(buf_img.shape[1]);
 
   // number of pixels
-  const int n = static_cast<int>(buf_arg.shape[0]);
-  assert(nx*ny == n);
+  const int n = nx*ny;
+
+  // pixel indices in ascending pixel value
+  stats.begin_phase();
+  memory::vector<int> v_order;
+  pixel_order::compute(buf_img, v_order);
+  stats.end_phase("sort");
 
   // thresholds
 
@@ -79,11 +70,8 @@ static void compute_nclusters(PyObject * const py_img,
   const int dx_list[] = {0, 1, 0, -1}; // up, right, down, left
   const int dy_list[] = {1, 0, -1, 0};
 
-  // Copy img to C++ vector<Vertex>
-  //   initial value: vertex.next = -1 and edge[k] = -1
-  vector<int> v_next(n, -1);  // link list pointing `next` pixel
-  vector<int> v_size(n, 0);   // size of the cluster if this pixel
-                              // is a `top` pixel
+  // Clusters of pixels above the water level
+  UnionFind uf(n);
 
   // randomly select first neighbour
   // not used if seed_random_direction = 0
@@ -94,15 +82,17 @@ static void compute_nclusters(PyObject * const py_img,
   // The result of this function; the number of clusters larger or equal
   // to size_treshold
   int n_clusters = 0;
+
+  stats.begin_phase();
   
   // Loop over all pixel from the largest value to lower
   // The `water level` is going down
   for(int i=n-1; i>=0; --i) {
     // <1> is the lowest land above the water level now
-    int index1 = buf_arg[i];
+    int index1 = v_order[i];
     int ix1 = index1 / ny;
     int iy1 = index1 % ny;
-    double f1 = buf_img(ix1, iy1);
+    double f1 = static_cast<double>(buf_img(ix1, iy1));
 
     assert(0 <= index1 && index1 < n); // DEBUG!
 
@@ -118,10 +108,9 @@ static void compute_nclusters(PyObject * const py_img,
     assert(pixel_threshold <= f1);
 
     
-    // If this pixel does not link to neighbour pixels,
-    // the link points to itself
-    v_next[index1] = index1;
-    v_size[index1] = 1;
+    // This pixel is a new cluster of itself until it links to
+    // neighbour pixels
+    uf.add(index1);
 
     // First neibour direction (Always 0 if seed == 0)
     int random_direction = seed_random_direction == 0 ?  0 : rand4(mt);
@@ -141,8 +130,7 @@ static void compute_nclusters(PyObject * const py_img,
       
       int index2 = ix2*ny + iy2;
         
-      //if(v[index2].next < 0)
-      if(v_next[index2] < 0)
+      if(!uf.contains(index2))
         continue;  // This neighbour is not obove waterlevel yet.
       
       // <2> is a neighbour above water level, higher than <1>
@@ -150,30 +138,25 @@ static void compute_nclusters(PyObject * const py_img,
 
       // The cluster that neighbor <2> belogs to.
       // A cluster is a connected component above the waterlevel
-      int nbr_cluster = get_top(index2, v_next);
-      //int j2 = (j1 + 2) % 4;  // direction viewed from <2> (180 deg opposite)
+      int nbr_cluster = uf.find(index2, stats);
 
       if(the_cluster == -1) {
         // This is the first cluster that this pixel meets
         // This pixel joins this cluster
-                
-        the_cluster = nbr_cluster;
-        v_next[index1] = the_cluster;
-        v_size[the_cluster] += 1;
+        the_cluster = uf.unite(nbr_cluster, index1, nbr_cluster);
           
         // Just crossed the size threshold
-        if(v_size[the_cluster] == size_threshold) {
+        if(uf.size(the_cluster) == size_threshold) {
           ++n_clusters;
         }
       }
       else if(the_cluster >= 0 && the_cluster != nbr_cluster) {
         // This pixel is a bridge between the_cluster and the other nbr_cluster
-        // The nbr_cluster will be combined with the_cluster
-        v_next[nbr_cluster] = the_cluster;
+        // The two clusters are combined
 
         // sizes of two clusters
-        int s1 = v_size[the_cluster];
-        int s2 = v_size[nbr_cluster];
+        int s1 = uf.size(the_cluster);
+        int s2 = uf.size(nbr_cluster);
 
         if(s1 < size_threshold && s2 < size_threshold &&
            s1 + s2 >= size_threshold) {
@@ -185,14 +168,16 @@ static void compute_nclusters(PyObject * const py_img,
           --n_clusters;
         }
 
-        v_size[the_cluster] += s2;      
+        the_cluster = uf.unite(the_cluster, nbr_cluster, the_cluster);
+        stats.merge();
       }
     } // loop for 4 neighbor pixels
 
     
-    if(v_next[index1] == index1) {
+    if(the_cluster == -1) {
       // This is a new isolated pixel with size == 1
-      assert(v_size[index1] == 1);
+      assert(uf.size(index1) == 1);
+      stats.new_cluster();
       if(1 >= size_threshold)
          n_clusters++;
     }
@@ -200,33 +185,198 @@ static void compute_nclusters(PyObject * const py_img,
     assert(0 <= i_threshold && i_threshold < n_thresholds);
     buf_nclusters(i_threshold) = n_clusters;
   } // end of loop over all pixels
+
+  stats.end_phase("flood");
+}
+
+// explicit instantiation
+#define NCLUSTER_INSTANTIATE_STATS(T, S) \
+  template void compute_nclusters(const Buffer<T>&, const Buffer<double>&, \
+                                  Buffer<long>&, const int, const int, S&);
+#define NCLUSTER_INSTANTIATE(T) \
+  NCLUSTER_INSTANTIATE_STATS(T, NoStats) \
+  NCLUSTER_INSTANTIATE_STATS(T, KernelStats)
+
+NCLUSTER_INSTANTIATE(unsigned char)
+NCLUSTER_INSTANTIATE(unsigned short)
+NCLUSTER_INSTANTIATE(float)
+NCLUSTER_INSTANTIATE(double)
+
+#undef NCLUSTER_INSTANTIATE
+#undef NCLUSTER_INSTANTIATE_STATS
+
 }
 
+using watershed_ncluster::compute_nclusters;
+
 
 //
 // Python interface
 //
 
+template<typename T>
+static void compute_image(PyObject* const py_img,
+                          PyObject* const py_thresholds,
+                          PyObject* const py_ncluster,
+                          const int size_threshold,
+                          const int seed_random_direction,
+                          PyObject* const py_stats)
+{
+  // Buffer may throw TypeError
+  Buffer<T>      buf_img(py_img, "py_img");         // image/2D pixels;
+  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+  Buffer<long>   buf_nclusters(py_ncluster, "py_nclusters"); // result
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    compute_nclusters(buf_img, buf_thresholds, buf_nclusters,
+                      size_threshold, seed_random_direction, stats);
+  });
+}
+
+template<typename T>
+static void compute_images(PyObject* const py_imgs,
+                           PyObject* const py_thresholds,
+                           PyObject* const py_ncluster,
+                           const int size_threshold,
+                           const int seed_random_direction,
+                           PyObject* const py_stats)
+{
+  // Buffer may throw TypeError
+  Buffer<T>      buf_imgs(py_imgs, "py_imgs");
+  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+  Buffer<long>   buf_nclusters(py_ncluster, "py_nclusters"); // result
+
+  assert(buf_imgs.ndim == 3 && buf_nclusters.ndim == 2);
+  assert(buf_nclusters.shape[0] == buf_imgs.shape[0]);
+
+  const int n_imgs = static_cast<int>(buf_imgs.shape[0]);
+
+  // Counters of each image, added after the batch
+  const bool has_stats = py_stats != nullptr && py_stats != Py_None;
+  if(has_stats && !PyDict_Check(py_stats)) {
+    PyErr_SetString(PyExc_TypeError, "stats must be a dict or None");
+    throw TypeError();
+  }
+  vector<KernelStats> v_stats(has_stats ? n_imgs : 0);
+
+  Py_BEGIN_ALLOW_THREADS
+  thread_pool::get()->parallel_for(n_imgs, [&](const int i) {
+    trace::Span span("image");
+    Buffer<T> buf_img(buf_imgs, i);
+    Buffer<long> buf_nclusters_i(buf_nclusters, i);
+    if(has_stats) {
+      compute_nclusters(buf_img, buf_thresholds, buf_nclusters_i,
+                        size_threshold, seed_random_direction, v_stats[i]);
+    }
+    else {
+      NoStats stats;
+      compute_nclusters(buf_img, buf_thresholds, buf_nclusters_i,
+                        size_threshold, seed_random_direction, stats);
+    }
+  });
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+
+  if(has_stats) {
+    KernelStats stats;
+    for(const KernelStats& s : v_stats)
+      stats.add(s);
+
+    if(!stats.update_dict(py_stats))
+      throw TypeError();
+  }
+}
+
+
 namespace watershed_ncluster {
 
 PyObject* py_compute(PyObject* self, PyObject* args)
 {
-  // _watershed_get_edges(img, argsort, nclusters,
-  //                      size_threshold, seed_romdom_direction)
+  // _watershed_ncluster_compute(img, thresholds, nclusters,
+  //                      size_threshold, seed_romdom_direction, stats=None)
+  //   stats (dict): instrumentation counters are set if not None
+  // Exception
+  //   TypeError
+  trace::Span span("_watershed_ncluster_compute");
+  PyObject *py_img, *py_thresholds, *py_ncluster;
+  PyObject *py_stats = Py_None;
+  int size_threshold, seed_random_direction;
+  if(!PyArg_ParseTuple(args, "OOOii|O",
+                       &py_img, &py_thresholds, &py_ncluster,
+                       &size_threshold, &seed_random_direction,
+                       &py_stats)) {
+    return NULL;
+  }
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      compute_image<unsigned char>(py_img, py_thresholds, py_ncluster,
+                                   size_threshold, seed_random_direction,
+                           py_stats);
+    else if(format == "H")
+      compute_image<unsigned short>(py_img, py_thresholds, py_ncluster,
+                                    size_threshold, seed_random_direction,
+                                    py_stats);
+    else if(format == "f")
+      compute_image<float>(py_img, py_thresholds, py_ncluster,
+                           size_threshold, seed_random_direction,
+                           py_stats);
+    else
+      compute_image<double>(py_img, py_thresholds, py_ncluster,
+                            size_threshold, seed_random_direction,
+                           py_stats);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject* py_compute_batch(PyObject* self, PyObject* args)
+{
+  // _watershed_ncluster_compute_batch(imgs, thresholds, nclusters,
+  //                      size_threshold, seed_romdom_direction, stats=None)
+  //   imgs (3D array): N images
+  //   nclusters (2D array long): [output] N x n_thresholds, can be a
+  //                              transposed view
+  //   stats (dict): counters added over the images are set if not None
   // Exception
   //   TypeError
-  PyObject *py_img, *py_argsort, *py_thresholds, *py_ncluster;
+  trace::Span span("_watershed_ncluster_compute_batch");
+  PyObject *py_imgs, *py_thresholds, *py_ncluster;
+  PyObject *py_stats = Py_None;
   int size_threshold, seed_random_direction;
-  if(!PyArg_ParseTuple(args, "OOOOii",
-                       &py_img, &py_argsort,
-                       &py_thresholds, &py_ncluster,
-                       &size_threshold, &seed_random_direction)) {
+  if(!PyArg_ParseTuple(args, "OOOii|O",
+                       &py_imgs, &py_thresholds, &py_ncluster,
+                       &size_threshold, &seed_random_direction,
+                       &py_stats)) {
     return NULL;
   }
 
   try {
-    compute_nclusters(py_img, py_argsort, py_thresholds, py_ncluster,
-                      size_threshold, seed_random_direction);
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_imgs);
+
+    if(format == "B")
+      compute_images<unsigned char>(py_imgs, py_thresholds, py_ncluster,
+                                    size_threshold, seed_random_direction,
+                                    py_stats);
+    else if(format == "H")
+      compute_images<unsigned short>(py_imgs, py_thresholds, py_ncluster,
+                                     size_threshold, seed_random_direction,
+                                     py_stats);
+    else if(format == "f")
+      compute_images<float>(py_imgs, py_thresholds, py_ncluster,
+                            size_threshold, seed_random_direction,
+                            py_stats);
+    else
+      compute_images<double>(py_imgs, py_thresholds, py_ncluster,
+                             size_threshold, seed_random_direction,
+                             py_stats);
   }
   catch (TypeError e) {
     return NULL;
@@ -2,10 +2,24 @@
 #define WATERSHED_NCLUSTER_H 1
 
 #include "Python.h"
+#include "buffer.h"
+#include "stats.h"
 
 namespace watershed_ncluster {
 
+// Number of clusters for each threshold
+// T: unsigned char, unsigned short, float, or double
+// Stats: NoStats or KernelStats (stats.h)
+template<typename T, typename Stats>
+void compute_nclusters(const Buffer<T>& buf_img,
+                       const Buffer<double>& buf_thresholds,
+                       Buffer<long>& buf_nclusters,
+                       const int size_threshold,
+                       const int seed_random_direction,
+                       Stats& stats);
+
 PyObject* py_compute(PyObject* self, PyObject* args);
+PyObject* py_compute_batch(PyObject* self, PyObject* args);
 
 }
 
@@ -3,86 +3,95 @@
 */
 
 #include <vector>
-#include <deque>
-#include <set>
 #include <chrono>
+#include <utility>  // swap
 #include "buffer.h"
+#include "union_find.h"
+#include "pixel_order.h"
+#include "stats.h"
+#include "memory.h"
+#include "thread_pool.h"
 #include "watershed_nuclei.h"
 
-using std::vector;
-using std::deque;
+using memory::vector;
 
 
 //
 // static functions
 //
-static inline int get_top(int i, const vector<int>& v_next)
+// Pixels of a cluster form a circular singly linked list through
+// v_next, so that two clusters are merged in O(1) by swapping the next
+// pointers of one pixel in each; a new pixel is a list of itself.
+//
+static void merge_pixels(vector<int>& v_next,
+                         const int index1, const int index2)
 {
-  assert(0 <= i && i < static_cast<int>(v_next.size())); // DEBUG!
-
-  while(i != v_next[i]) {
-    i = v_next[i];
-    assert(0 <= i && i < static_cast<int>(v_next.size())); // DEBUG!
-  }
-
-  return i;
+  std::swap(v_next[index1], v_next[index2]);
 }
 
 
-static void merge_pixels(vector<deque<int>>& v_pixels,
-                         const int index1, const int index2)
+static void mark_pixels(const vector<int>& v_next, const int c,
+                        Buffer<bool>& buf_nuclei)
 {
-  // merge 2 -> 1
-  deque<int>& q1 = v_pixels[index1];
-  deque<int>& q2 = v_pixels[index2];
-
-  q1.insert(q1.begin(), q2.begin(), q2.end());
-  q2.clear();
+  int i = c;
+  do {
+    buf_nuclei(i) = true;
+    i = v_next[i];
+  } while(i != c);
 }
 
 
-static void mark_pixels(const deque<int>& q,
-                        Buffer<bool>& buf_nuclei)
+// Label the pixels of cluster c; the labels of the nuclei inside c are
+// overwritten and no longer used
+static void label_pixels(const vector<int>& v_next, const int c,
+                         const int ny, const int label,
+                         Buffer<int>& buf_labels,
+                         vector<bool>& label_used)
 {
-  for(int i : q) {
-    buf_nuclei(i) = true;
-  }
+  int i = c;
+  do {
+    int& l = buf_labels(i / ny, i % ny);
+    label_used[l] = false;
+    l = label;
+    i = v_next[i];
+  } while(i != c);
+
+  label_used[label] = true;
 }
 
 
 //
 // Main data analysis
 //
-static double mark_nuclei(PyObject * const py_img,
-                          PyObject * const py_argsort,
-                          PyObject * const py_thresholds,
-                          const size_t size_min,
-                          const size_t size_max,
-                          PyObject * const py_nuclei)
+namespace watershed_nuclei {
+
+template<typename T, typename Stats>
+double mark_nuclei(const Buffer<T>& buf_img,
+                   const Buffer<double>& buf_thresholds,
+                   const size_t size_min,
+                   const size_t size_max,
+                   Buffer<bool>& buf_nuclei,
+                   Stats& stats,
+                   Buffer<int>* const buf_labels)
 {
   /*
    * Args:
-   *   py_img (2D array float64): 2D image array
-   *   py_argsort (1D array int): argsort indices
-   *   py_thresholds (1D array double0: array of thredholds
+   *   buf_img (2D array): 2D image array of T
+   *   buf_thresholds (1D array double0: array of thredholds
    *             cluster sizes are evaluated for each threshold
    *   size_min, size_max (int); size range of nuclei
-   *   py_nuclei (2D array int):  [output] pixel is in nuclei or not (output)
-   *   
-   * Exceptions:
-   *   TypeError
+   *   buf_nuclei (1D array bool):  [output] pixel is in nuclei or not
+   *   stats: NoStats or KernelStats
+   *   buf_labels: [output] label image if not nullptr
+   *
+   * Note:
+   *   Pure C++; called without the GIL
    */
 
   auto ts = std::chrono::high_resolution_clock::now();
-  
-  // Buffer may throw TypeError
-  Buffer<double> buf_img(py_img, "py_img");         // image/2D pixels;
-  Buffer<long>   buf_arg(py_argsort, "py_argsort"); // sorted order
-  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
-  Buffer<bool>   buf_nuclei(py_nuclei, "py_nuclei");
+  memory::Call call("mark_nuclei");
 
   assert(buf_img.ndim == 2);
-  assert(buf_arg.ndim == 1);
   assert(buf_thresholds.ndim == 1);
   assert(buf_nuclei.ndim == 1);
   assert(size_min <= size_max);
@@ -92,42 +101,61 @@ static double mark_nuclei(PyObject * const py_img,
   const int ny = static_cast<int>(buf_img.shape[1]);
 
   // number of pixels
-  const int n = static_cast<int>(buf_arg.shape[0]);
-  assert(nx*ny == n);
-  assert(buf_nuclei.shape[0] == buf_arg.shape[0]);
+  const int n = nx*ny;
+  assert(static_cast<int>(buf_nuclei.shape[0]) == n);
+
+  // pixel indices in ascending pixel value
+  stats.begin_phase();
+  vector<int> v_order;
+  pixel_order::compute(buf_img, v_order);
+  stats.end_phase("sort");
 
   // Define neighbour direction
   const int dx_list[] = {-1, 1,  0, 0}; // left, right, top, down
   const int dy_list[] = { 0, 0, -1, 1};
 
-  vector<int> v_next(n, -1);  // link list pointing `next` pixel
-  vector<deque<int>> v_pixels(n);
-  std::set<int> updated_clusters;
+  UnionFind uf(n);            // clusters above the water level
+  vector<int> v_next(n);      // member lists of clusters
+
+  // clusters updated in this threshold with a flag to avoid duplicates
+  vector<int> updated_clusters;
+  vector<bool> is_updated(n, false);
 
   const int n_thresholds = static_cast<int>(buf_thresholds.shape[0]);
+
+  // Labels are numbered in the order of marking, and compacted at the end
+  // if some are overwritten by larger nuclei; label_used[0] is background
+  vector<bool> label_used(1, false);
+  if(buf_labels) {
+    for(int ix=0; ix<nx; ++ix)
+      for(int iy=0; iy<ny; ++iy)
+        (*buf_labels)(ix, iy) = 0;
+  }
+
+  stats.begin_phase();
   
   // Loop over all pixels from the largest pixel birghtness to lower
   // The `water level` is going down
   int i = n-1;
   for(int i_threshold=0; i_threshold < n_thresholds; ++i_threshold) {
     double pixel_threshold = buf_thresholds(i_threshold);
-    updated_clusters.clear();
 
     // Find clusters for pixels with value >= pixel_threshold
     while(i >= 0) {
       // <1> is the lowest land above the water level now
-      int index1 = buf_arg[i];  assert(0 <= index1 && index1 < n);
+      int index1 = v_order[i];  assert(0 <= index1 && index1 < n);
       int ix1 = index1 / ny;
       int iy1 = index1 % ny;
-      double f1 = buf_img(ix1, iy1);
+      double f1 = static_cast<double>(buf_img(ix1, iy1));
 
       if(f1 < pixel_threshold)
         break;
 
       --i;
 
-      // If this pixel does not link to neighbour pixels,
-      // the link points to itself
+      // This pixel is a new cluster of itself until it links to
+      // neighbour pixels
+      uf.add(index1);
       v_next[index1] = index1;
 
       int the_cluster = -1;  // the cluster this pixel belongs to
@@ -143,7 +171,7 @@ static double mark_nuclei(PyObject * const py_img,
         
         int index2 = ix2*ny + iy2;
         
-        if(v_next[index2] < 0)
+        if(!uf.contains(index2))
           continue;  // This neighbour is not obove waterlevel yet.
         
         // <2> is a neighbour above water level, higher than <1>
@@ -151,90 +179,279 @@ static double mark_nuclei(PyObject * const py_img,
         
         // The cluster that neighbor <2> belogs to.
         // A cluster is a connected component above the waterlevel
-        int nbr_cluster = get_top(index2, v_next);
+        int nbr_cluster = uf.find(index2, stats);
         assert(nbr_cluster >= 0);
         
         if(the_cluster == -1) {
           // This is the first cluster that this pixel meets
           // This pixel joins this cluster
-          the_cluster = nbr_cluster;
-          v_next[index1] = the_cluster;
-          v_pixels[the_cluster].push_back(index1);
-          size_t s1 = v_pixels[the_cluster].size();
-
-          if(size_min <= s1 && s1 <= size_max)
-            updated_clusters.insert(the_cluster);
+          the_cluster = uf.unite(nbr_cluster, index1, nbr_cluster);
+          assert(the_cluster == nbr_cluster);
+          merge_pixels(v_next, the_cluster, index1);
+          size_t s1 = uf.size(the_cluster);
+
+          if(size_min <= s1 && s1 <= size_max && !is_updated[the_cluster]) {
+            is_updated[the_cluster] = true;
+            updated_clusters.push_back(the_cluster);
+          }
         }
         else if(the_cluster >= 0 && the_cluster != nbr_cluster) {
           // This pixel is a bridge between the_cluster and the other nbr_cluster
           // This pixel is already a member of the_cluster
-          // The nbr_cluster will be merged with the_cluster
-          v_next[nbr_cluster] = the_cluster;
+          // The two clusters are merged
           
           // sizes of two clusters
-          size_t s1 = v_pixels[the_cluster].size();
-          size_t s2 = v_pixels[nbr_cluster].size();
+          size_t s1 = uf.size(the_cluster);
+          size_t s2 = uf.size(nbr_cluster);
           size_t s = s1 + s2;
-          
-          merge_pixels(v_pixels, the_cluster, nbr_cluster);          
-          assert(v_pixels[nbr_cluster].empty());
 
-          if(size_min <= s && s < size_max)
-            updated_clusters.insert(the_cluster);
+          const int root = uf.unite(the_cluster, nbr_cluster, the_cluster);
+          const int other = root == the_cluster ? nbr_cluster : the_cluster;
+          the_cluster = root;
+
+          stats.merge();
+          stats.splice(uf.size(other));
+          merge_pixels(v_next, the_cluster, other);
+
+          if(size_min <= s && s < size_max && !is_updated[the_cluster]) {
+            is_updated[the_cluster] = true;
+            updated_clusters.push_back(the_cluster);
+          }
         }
       } // loop for 4 neighbor pixels
       
       
-      if(v_next[index1] == index1) {
+      if(the_cluster == -1) {
         // This is a new cluster with this pixel only
-        v_pixels[index1].push_back(index1);
+        stats.new_cluster();
       }
     } // endo of loop over pixels >= pixel_threshod
     
-    // update nuclei mask
+    // update nuclei mask; clusters merged into others after the update
+    // are no longer roots and are covered by their root
     for(int c : updated_clusters) {
-      size_t s = v_pixels[c].size();
-      if(size_min <= s && s <= size_max)
-        mark_pixels(v_pixels[c], buf_nuclei);
-    }    
+      is_updated[c] = false;
+      if(!uf.is_root(c))
+        continue;
+
+      size_t s = uf.size(c);
+      if(size_min <= s && s <= size_max) {
+        mark_pixels(v_next, c, buf_nuclei);
+        if(buf_labels) {
+          const int label = static_cast<int>(label_used.size());
+          label_used.push_back(true);
+          label_pixels(v_next, c, ny, label, *buf_labels, label_used);
+        }
+      }
+    }
+    updated_clusters.clear();
   } // end of loop over all thresholds
 
+  stats.end_phase("flood");
+
+  // Renumber the labels to 1, 2, ..., without the overwritten ones
+  if(buf_labels) {
+    const int n_labels = static_cast<int>(label_used.size());
+    vector<int> new_label(n_labels, 0);
+    int n_used = 0;
+    for(int l=1; l<n_labels; ++l)
+      new_label[l] = label_used[l] ? ++n_used : 0;
+
+    if(n_used < n_labels - 1) {
+      for(int ix=0; ix<nx; ++ix)
+        for(int iy=0; iy<ny; ++iy)
+          (*buf_labels)(ix, iy) = new_label[(*buf_labels)(ix, iy)];
+    }
+  }
+
   auto te = std::chrono::high_resolution_clock::now();
   return std::chrono::duration<double>(te - ts).count();
 }
 
+// explicit instantiation
+#define NUCLEI_INSTANTIATE_STATS(T, S) \
+  template double mark_nuclei(const Buffer<T>&, const Buffer<double>&, \
+                              const size_t, const size_t, Buffer<bool>&, \
+                              S&, Buffer<int>* const);
+#define NUCLEI_INSTANTIATE(T) \
+  NUCLEI_INSTANTIATE_STATS(T, NoStats) \
+  NUCLEI_INSTANTIATE_STATS(T, KernelStats)
+
+NUCLEI_INSTANTIATE(unsigned char)
+NUCLEI_INSTANTIATE(unsigned short)
+NUCLEI_INSTANTIATE(float)
+NUCLEI_INSTANTIATE(double)
+
+#undef NUCLEI_INSTANTIATE
+#undef NUCLEI_INSTANTIATE_STATS
+
+}
+
+using watershed_nuclei::mark_nuclei;
+
 
 //
 // Python interface
 //
 
+template<typename T>
+static double obtain_image(PyObject* const py_img,
+                           PyObject* const py_thresholds,
+                           const int size_min, const int size_max,
+                           PyObject* const py_out,
+                           PyObject* const py_stats,
+                           PyObject* const py_labels)
+{
+  // Buffer may throw TypeError
+  Buffer<T>      buf_img(py_img, "py_img");         // image/2D pixels;
+  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+  Buffer<bool>   buf_nuclei(py_out, "py_nuclei");
+  Buffer<int>    buf_labels;
+  if(py_labels != Py_None)
+    buf_labels.assign(py_labels);
+
+  Buffer<int>* const labels = py_labels == Py_None ? nullptr : &buf_labels;
+  assert(labels == nullptr || (buf_labels.ndim == 2 &&
+                               buf_labels.shape == buf_img.shape));
+
+  double t;
+
+  call_with_stats(py_stats, [&](auto& stats) {
+    t = mark_nuclei(buf_img, buf_thresholds, size_min, size_max, buf_nuclei,
+                    stats, labels);
+  });
+
+  return t;
+}
+
+template<typename T>
+static void obtain_images(PyObject* const py_imgs,
+                          PyObject* const py_thresholds,
+                          const int size_min, const int size_max,
+                          PyObject* const py_out)
+{
+  // Buffer may throw TypeError
+  Buffer<T>      buf_imgs(py_imgs, "py_imgs");
+  Buffer<double> buf_thresholds(py_thresholds, "py_thresholds");
+  Buffer<bool>   buf_nuclei(py_out, "py_nuclei");
+
+  assert(buf_imgs.ndim == 3 && buf_nuclei.ndim == 2);
+  assert(buf_nuclei.shape[0] == buf_imgs.shape[0]);
+
+  const int n_imgs = static_cast<int>(buf_imgs.shape[0]);
+
+  Py_BEGIN_ALLOW_THREADS
+  thread_pool::get()->parallel_for(n_imgs, [&](const int i) {
+    trace::Span span("image");
+    Buffer<T> buf_img(buf_imgs, i);
+    Buffer<bool> buf_nuclei_i(buf_nuclei, i);
+    NoStats stats;
+    mark_nuclei(buf_img, buf_thresholds, size_min, size_max, buf_nuclei_i,
+                stats);
+  });
+  trace::Span span_gil("acquire_gil");  // ends after the GIL is acquired
+  Py_END_ALLOW_THREADS
+}
+
+
 namespace watershed_nuclei {
 
 PyObject* obtain(PyObject* self, PyObject* args)
 {
+  // _watershed_nuclei_obtain(img, thresholds, size_min, size_max, nuclei,
+  //                          stats=None, labels=None)
+  //   stats (dict): instrumentation counters are set if not None
+  //   labels (2D array int32): [output] label image of nuclei if not None
+  // Returns:
+  //   t (double): computation time [sec]
+  // Exception
+  //   TypeError
+  trace::Span span("_watershed_nuclei_obtain");
+  PyObject *py_img, *py_thresholds, *py_out;
+  PyObject *py_stats = Py_None;
+  PyObject *py_labels = Py_None;
+  int size_min, size_max;
+  if(!PyArg_ParseTuple(args, "OOiiO|OO",
+                       &py_img, &py_thresholds,
+                       &size_min, &size_max, &py_out, &py_stats,
+                       &py_labels)) {
+    return NULL;
+  }
+
+  double t;
+
+  try {
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_img);
+
+    if(format == "B")
+      t = obtain_image<unsigned char>(py_img, py_thresholds,
+                                      size_min, size_max, py_out,
+                                      py_stats, py_labels);
+    else if(format == "H")
+      t = obtain_image<unsigned short>(py_img, py_thresholds,
+                                       size_min, size_max, py_out,
+                                       py_stats, py_labels);
+    else if(format == "f")
+      t = obtain_image<float>(py_img, py_thresholds,
+                              size_min, size_max, py_out,
+                              py_stats, py_labels);
+    else
+      t = obtain_image<double>(py_img, py_thresholds,
+                               size_min, size_max, py_out,
+                               py_stats, py_labels);
+  }
+  catch (TypeError e) {
+    return NULL;
+  }
+
+  return Py_BuildValue("d", t);
+}
+
+PyObject* obtain_batch(PyObject* self, PyObject* args)
+{
+  // _watershed_nuclei_obtain_batch(imgs, thresholds, size_min, size_max,
+  //                                nuclei)
+  //   imgs (3D array): N images
+  //   nuclei (2D array bool): [output] N x (nx*ny)
   // Returns:
   //   t (double): computation time [sec]
   // Exception
   //   TypeError
-  PyObject *py_img, *py_argsort, *py_thresholds, *py_out;
+  trace::Span span("_watershed_nuclei_obtain_batch");
+  PyObject *py_imgs, *py_thresholds, *py_out;
   int size_min, size_max;
-  if(!PyArg_ParseTuple(args, "OOOiiO",
-                       &py_img, &py_argsort, &py_thresholds,
+  if(!PyArg_ParseTuple(args, "OOiiO",
+                       &py_imgs, &py_thresholds,
                        &size_min, &size_max, &py_out)) {
     return NULL;
   }
 
+  auto ts = std::chrono::high_resolution_clock::now();
 
   try {
-    double t = mark_nuclei(py_img, py_argsort, py_thresholds,
+    // Dispatch on the pixel type; may throw TypeError
+    const std::string format = buffer_format(py_imgs);
+
+    if(format == "B")
+      obtain_images<unsigned char>(py_imgs, py_thresholds,
+                                   size_min, size_max, py_out);
+    else if(format == "H")
+      obtain_images<unsigned short>(py_imgs, py_thresholds,
+                                    size_min, size_max, py_out);
+    else if(format == "f")
+      obtain_images<float>(py_imgs, py_thresholds,
                            size_min, size_max, py_out);
-    return Py_BuildValue("d", t);
+    else
+      obtain_images<double>(py_imgs, py_thresholds,
+                            size_min, size_max, py_out);
   }
   catch (TypeError e) {
     return NULL;
   }
 
-  Py_RETURN_NONE;
+  auto te = std::chrono::high_resolution_clock::now();
+  return Py_BuildValue("d", std::chrono::duration<double>(te - ts).count());
 }
 
 }
@@ -2,10 +2,30 @@
 #define WATERSHED_NUCLEI_H 1
 
 #include "Python.h"
+#include "buffer.h"
+#include "stats.h"
 
 namespace watershed_nuclei {
 
+// Mark pixels in nuclei; returns the wall time in seconds
+// T: unsigned char, unsigned short, float, or double
+// Stats: NoStats or KernelStats (stats.h)
+// buf_labels: [output] if not nullptr, nx x ny label image of the nuclei;
+//             0 for pixels not in nuclei and 1, 2, ... for the nuclei in
+//             the order they are marked; a nucleus is the largest marked
+//             cluster, which contains the nuclei marked at higher
+//             thresholds
+template<typename T, typename Stats>
+double mark_nuclei(const Buffer<T>& buf_img,
+                   const Buffer<double>& buf_thresholds,
+                   const size_t size_min,
+                   const size_t size_max,
+                   Buffer<bool>& buf_nuclei,
+                   Stats& stats,
+                   Buffer<int>* const buf_labels=nullptr);
+
 PyObject* obtain(PyObject* self, PyObject* args);
+PyObject* obtain_batch(PyObject* self, PyObject* args);
 
 }
 